@@ -0,0 +1,105 @@
+/*
+ * relocate-bench: Measure the relocation stub loops in userspace.
+ *
+ * Runs the copy, zero and cache maintenance loops of relocate_kernel.S over
+ * buffers larger than the caches, for each supported page size, and prints
+ * the throughput as CSV.
+ *
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define DEFINE_BENCH(size)						\
+	void bench_copy_##size(void *dest, const void *src,		\
+			       unsigned long pages);			\
+	void bench_zero_##size(void *dest, unsigned long pages);	\
+	void bench_clean_##size(void *dest, unsigned long pages);
+
+DEFINE_BENCH(4096)
+DEFINE_BENCH(16384)
+DEFINE_BENCH(65536)
+
+struct bench_size {
+	unsigned long size;
+	void (*copy)(void *dest, const void *src, unsigned long pages);
+	void (*zero)(void *dest, unsigned long pages);
+	void (*clean)(void *dest, unsigned long pages);
+};
+
+#define BENCH_SIZE(size) \
+	{ size, bench_copy_##size, bench_zero_##size, bench_clean_##size }
+
+static const struct bench_size sizes[] = {
+	BENCH_SIZE(4096),
+	BENCH_SIZE(16384),
+	BENCH_SIZE(65536),
+};
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned long bytes = (argc > 1 ? strtoul(argv[1], NULL, 0) : 64) << 20;
+	int iterations = argc > 2 ? atoi(argv[2]) : 5;
+	char *src, *dest;
+	unsigned int i;
+	int it;
+
+	if (posix_memalign((void **)&src, 65536, bytes) ||
+	    posix_memalign((void **)&dest, 65536, bytes)) {
+		perror("posix_memalign");
+		return 1;
+	}
+	memset(src, 0x5a, bytes);
+	memset(dest, 0, bytes);
+
+	printf("routine,page_size,bytes,gb_per_s\n");
+
+	for (i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++) {
+		const struct bench_size *s = &sizes[i];
+		unsigned long pages = bytes / s->size;
+		double copy = 0, zero = 0, clean = 0, t;
+
+		/* Report the best of a few runs. */
+		for (it = 0; it < iterations; it++) {
+			t = now();
+			s->copy(dest, src, pages);
+			t = now() - t;
+			copy = copy && copy < t ? copy : t;
+
+			t = now();
+			s->zero(dest, pages);
+			t = now() - t;
+			zero = zero && zero < t ? zero : t;
+
+			t = now();
+			s->clean(dest, pages);
+			t = now() - t;
+			clean = clean && clean < t ? clean : t;
+		}
+
+		printf("copy,%lu,%lu,%.2f\n", s->size, bytes, bytes / copy / 1e9);
+		printf("zero,%lu,%lu,%.2f\n", s->size, bytes, bytes / zero / 1e9);
+		printf("clean,%lu,%lu,%.2f\n", s->size, bytes,
+		       bytes / clean / 1e9);
+	}
+
+	free(src);
+	free(dest);
+	return 0;
+}
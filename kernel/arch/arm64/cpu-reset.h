@@ -56,4 +56,26 @@ static void __noreturn cpu_soft_restart(unsigned long entry,
 	unreachable();
 }
 
+/*
+ * Soft restart into @entry at the current exception level. Used for the
+ * secondary CPUs, since the hypervisor vectors are only shimmed for the CPU
+ * that performs the final jump, and for a kexec jump, which has to come back
+ * at the exception level it left.
+ */
+static void __noreturn cpu_soft_restart_same_el(unsigned long entry,
+						unsigned long arg0,
+						unsigned long arg1,
+						unsigned long arg2)
+{
+	typeof(__cpu_soft_restart) *restart;
+
+	restart = (void *)kexec_pa_symbol(__cpu_soft_restart);
+
+	/* Install identity mapping */
+	kexec_idmap_install();
+
+	restart(0, entry, arg0, arg1, arg2);
+	unreachable();
+}
+
 #endif
@@ -0,0 +1,73 @@
+/*
+ * Kernel Image probe for arm64 kexec_file_load
+ *
+ * Copyright (C) 2018 Linaro Limited
+ * Author: AKASHI Takahiro <takahiro.akashi@linaro.org>
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/sizes.h>
+#include <linux/types.h>
+
+#include "../../kexec.h"
+
+/* The header at the start of an arm64 Image, see booting.rst */
+struct kexec_arm64_header {
+       __le32 code0;
+       __le32 code1;
+       __le64 text_offset;
+       __le64 image_size;
+       __le64 flags;
+       __le64 res2;
+       __le64 res3;
+       __le64 res4;
+       __le32 magic;
+       __le32 res5;
+};
+
+#define KEXEC_ARM64_MAGIC		0x644d5241	/* "ARM\x64" */
+#define KEXEC_ARM64_FLAG_BE		(1 << 0)
+#define KEXEC_ARM64_FLAG_ANYWHERE	(1 << 3)
+
+/*
+ * Check that @kernel is an Image this kernel can boot and tell where it goes:
+ * text_offset bytes into a 2MB aligned region of image_size bytes, entered at
+ * its start.
+ */
+int machine_kexec_image_probe(const void *kernel, unsigned long len,
+			     struct kexec_image_layout *layout)
+{
+       const struct kexec_arm64_header *h = kernel;
+       u64 flags;
+
+       if (len < sizeof(*h) || le32_to_cpu(h->magic) != KEXEC_ARM64_MAGIC)
+	       return -ENOEXEC;
+
+       /* Images before 3.17 do not give their size */
+       if (!le64_to_cpu(h->image_size))
+	       return -ENOEXEC;
+
+       flags = le64_to_cpu(h->flags);
+       if (!(flags & KEXEC_ARM64_FLAG_BE) != !IS_ENABLED(CONFIG_CPU_BIG_ENDIAN)) {
+	       pr_err("Image endianness does not match the kernel.\n");
+	       return -EINVAL;
+       }
+
+       /* The placement below may not be where the Image wants to be */
+       if (!(flags & KEXEC_ARM64_FLAG_ANYWHERE)) {
+	       pr_err("Image is not relocatable.\n");
+	       return -EINVAL;
+       }
+
+       layout->align = SZ_2M;
+       layout->offset = le64_to_cpu(h->text_offset);
+       layout->memsz = max_t(u64, le64_to_cpu(h->image_size), len);
+       layout->entry = 0;
+       return 0;
+}
+EXPORT_SYMBOL_GPL(machine_kexec_image_probe);
@@ -9,26 +9,56 @@
  * published by the Free Software Foundation.
  */
 
+#include <linux/arm-smccc.h>
+#include <linux/cpu_pm.h>
+#include <linux/delay.h>
 #include <linux/interrupt.h>
+#include <linux/io.h>
 #include <linux/irq.h>
 #include <linux/kernel.h>
+#include <linux/of.h>
 #include <linux/page-flags.h>
 #include <linux/smp.h>
 
 #include <asm/cacheflush.h>
 #include <asm/cpu_ops.h>
+#include <asm/cpufeature.h>
 #include <asm/daifflags.h>
 #include <asm/memory.h>
 #include <asm/mmu.h>
 #include <asm/mmu_context.h>
 #include <asm/page.h>
+#include <asm/suspend.h>
+#include <asm/sysreg.h>
+
+#include <uapi/linux/psci.h>
 
 #include "../../kexec.h"
 #include "cpu-reset.h"
+#include "relocate_kernel.h"
+
+/* Whether the secondary CPUs take part in the relocation. */
+static bool kexec_smp_enabled;
+
+/* PSCI conduit the secondary CPUs use to turn themselves off. */
+static u64 kexec_smp_psci = KEXEC_SMP_PSCI_NONE;
 
-/* Global variables for the arm64_relocate_new_kernel routine. */
-extern const unsigned char arm64_relocate_new_kernel[];
-extern const unsigned long arm64_relocate_new_kernel_size;
+/* CPUs we know how to park. */
+static struct cpumask kexec_smp_parkable;
+
+/* Rendezvous between machine_kexec() and the parked secondary CPUs. */
+#define KEXEC_SMP_GO		1
+#define KEXEC_SMP_ABORT		2
+static atomic_t kexec_smp_entered;
+static atomic_t kexec_smp_arrived;
+static atomic_t kexec_smp_left;
+static unsigned long kexec_smp_go;
+static phys_addr_t kexec_smp_entry;
+static unsigned long kexec_smp_head;
+
+/* Page in which we leave timestamps for the next kernel, if any. */
+static phys_addr_t kexec_handoff_phys;
+static struct kexec_handoff *kexec_handoff;
 
 /**
  * kexec_image_info - For debugging output.
@@ -55,12 +85,261 @@ static void _kexec_image_info(const char *func, int line,
        }
 }
 
+/**
+ * kexec_smp_parse_psci - Find the PSCI conduit in the device tree.
+ */
+static u64 kexec_smp_parse_psci(void)
+{
+       static const struct of_device_id psci_of_match[] = {
+	       { .compatible = "arm,psci-0.2" },
+	       { .compatible = "arm,psci-1.0" },
+	       {},
+       };
+       struct device_node *np;
+       const char *method;
+       u64 conduit = KEXEC_SMP_PSCI_NONE;
+
+       np = of_find_matching_node(NULL, psci_of_match);
+       if (!np)
+	       return conduit;
+
+       if (!of_property_read_string(np, "method", &method)) {
+	       if (!strcmp(method, "hvc"))
+		       conduit = KEXEC_SMP_PSCI_HVC;
+	       else if (!strcmp(method, "smc"))
+		       conduit = KEXEC_SMP_PSCI_SMC;
+       }
+
+       of_node_put(np);
+       return conduit;
+}
+
+/**
+ * kexec_smp_reset - Forget about the CPUs of an earlier park attempt.
+ */
+static void kexec_smp_reset(void)
+{
+       atomic_set(&kexec_smp_entered, 0);
+       atomic_set(&kexec_smp_arrived, 0);
+       atomic_set(&kexec_smp_left, 0);
+       WRITE_ONCE(kexec_smp_go, 0);
+}
+
+/**
+ * machine_kexec_smp_init - Find out how to park the secondary CPUs.
+ *
+ * A secondary CPU can only be parked if we know how to do so in a way the new
+ * kernel can undo, which is through PSCI CPU_OFF. The new kernel then brings
+ * it up again through PSCI CPU_ON, at the exception level the firmware picks.
+ * If @relocate is set, the parked CPUs also take a share of the relocation.
+ *
+ * CPUs with the spin-table enable method are left to machine_shutdown(). They
+ * would have to wait in the control code page for the new kernel to release
+ * them, but nothing keeps the new kernel from reusing that page before it
+ * does, and they would enter it at EL1 while the boot CPU may enter at EL2.
+ */
+void machine_kexec_smp_init(int relocate)
+{
+       struct device_node *np;
+       const char *method;
+       int cpu;
+
+       kexec_smp_psci = kexec_smp_parse_psci();
+       cpumask_clear(&kexec_smp_parkable);
+
+       for_each_possible_cpu(cpu) {
+	       np = of_get_cpu_node(cpu, NULL);
+	       if (!np)
+		       continue;
+
+	       if (of_property_read_string(np, "enable-method", &method))
+		       method = "";
+
+	       if (!strcmp(method, "psci") &&
+		   kexec_smp_psci != KEXEC_SMP_PSCI_NONE)
+		       cpumask_set_cpu(cpu, &kexec_smp_parkable);
+
+	       of_node_put(np);
+       }
+
+       kexec_smp_enabled = relocate;
+       kexec_smp_reset();
+
+       pr_info("%u CPUs can be parked%s.\n",
+	       cpumask_weight(&kexec_smp_parkable),
+	       relocate ? " and take part in the relocation" : "");
+}
+
+/**
+ * kexec_smp_must_wait - Whether a parked CPU has to wait for machine_kexec().
+ */
+static bool kexec_smp_must_wait(unsigned int cpu)
+{
+       return kexec_smp_enabled;
+}
+
+/**
+ * machine_kexec_can_park - Whether machine_kexec_park_cpu() can stop @cpu.
+ */
+bool machine_kexec_can_park(unsigned int cpu)
+{
+       if (!cpumask_test_cpu(cpu, &kexec_smp_parkable))
+	       return false;
+
+       /* Only so many waiting CPUs fit in the control code page. */
+       if (kexec_smp_must_wait(cpu) && num_online_cpus() > KEXEC_SMP_MAX_CPUS)
+	       return false;
+
+       return true;
+}
+EXPORT_SYMBOL_GPL(machine_kexec_can_park);
+
+/**
+ * machine_kexec_park_cpu - Park a secondary CPU ahead of machine_kexec().
+ *
+ * Runs on each secondary CPU through a single IPI from the core kexec code, in
+ * place of taking the CPU through hotplug. CPUs that take part in the
+ * relocation wait with interrupts masked until machine_kexec() sends them
+ * into the control code page, where they turn themselves off through PSCI
+ * once their share is done. The other CPUs are turned off right away.
+ *
+ * Either way the secondary CPUs stay at EL1 and only come back through PSCI
+ * CPU_ON, so they never enter the new kernel at a different exception level
+ * than the one the firmware starts them at.
+ */
+void machine_kexec_park_cpu(void *info)
+{
+       unsigned int cpu = smp_processor_id();
+       struct arm_smccc_res res;
+       unsigned long flags;
+       unsigned long rank;
+       unsigned long go;
+
+       flags = local_daif_save();
+       atomic_inc(&kexec_smp_entered);
+
+       if (!kexec_smp_must_wait(cpu)) {
+	       set_cpu_online(cpu, false);
+
+	       if (kexec_smp_psci == KEXEC_SMP_PSCI_HVC)
+		       arm_smccc_hvc(PSCI_0_2_FN_CPU_OFF, 0, 0, 0, 0, 0, 0, 0,
+				     &res);
+	       else
+		       arm_smccc_smc(PSCI_0_2_FN_CPU_OFF, 0, 0, 0, 0, 0, 0, 0,
+				     &res);
+
+	       /* CPU_OFF failed, so wait for machine_kexec() after all. */
+       }
+
+       /* The primary CPU has rank 0. */
+       rank = atomic_inc_return(&kexec_smp_arrived);
+       set_cpu_online(cpu, false);
+
+       while (!(go = smp_load_acquire(&kexec_smp_go)))
+	       cpu_relax();
+
+       /* Backed out by machine_kexec_unpark_cpus(), back to the IPI. */
+       if (go == KEXEC_SMP_ABORT) {
+	       set_cpu_online(cpu, true);
+	       local_daif_restore(flags);
+	       atomic_inc(&kexec_smp_left);
+	       return;
+       }
+
+       cpu_soft_restart_same_el(kexec_smp_entry, kexec_smp_head, rank, 0);
+}
+EXPORT_SYMBOL_GPL(machine_kexec_park_cpu);
+
+/**
+ * machine_kexec_unpark_cpus - Back out of a park attempt that timed out.
+ *
+ * @nr_cpus is the number of CPUs that machine_kexec_park_cpu() was sent to.
+ * Waits until all of them ran it, and brings the ones that wait for
+ * machine_kexec() back online, so that none of them is still busy with the
+ * IPI once machine_shutdown() takes the CPUs through hotplug. A CPU whose
+ * CPU_OFF fails after this returns backs out on its own.
+ */
+void machine_kexec_unpark_cpus(unsigned int nr_cpus)
+{
+       unsigned long timeout = USEC_PER_SEC;
+
+       smp_store_release(&kexec_smp_go, KEXEC_SMP_ABORT);
+
+       while (atomic_read(&kexec_smp_entered) < nr_cpus && timeout--)
+	       udelay(1);
+
+       if (atomic_read(&kexec_smp_entered) < nr_cpus)
+	       pr_warn("%u CPUs did not take the park IPI\n",
+		       nr_cpus - atomic_read(&kexec_smp_entered));
+
+       while (atomic_read(&kexec_smp_left) < atomic_read(&kexec_smp_arrived))
+	       cpu_relax();
+
+       atomic_set(&kexec_smp_entered, 0);
+       atomic_set(&kexec_smp_arrived, 0);
+       atomic_set(&kexec_smp_left, 0);
+}
+EXPORT_SYMBOL_GPL(machine_kexec_unpark_cpus);
+
 void machine_kexec_cleanup(struct kimage *kimage)
 {
        /* Empty routine needed to avoid build errors. */
 }
 EXPORT_SYMBOL_GPL(machine_kexec_cleanup);
 
+/**
+ * machine_kexec_handoff_init - Map the handoff page at @addr.
+ *
+ * The page must be reserved in both the running and the next kernel, for
+ * instance through a reserved-memory node, so that nothing else touches it.
+ */
+int machine_kexec_handoff_init(phys_addr_t addr)
+{
+       if (!addr)
+	       return 0;
+
+       if (!PAGE_ALIGNED(addr)) {
+	       pr_err("Handoff page %pa is not page aligned.\n", &addr);
+	       return -EINVAL;
+       }
+
+       kexec_handoff = memremap(addr, PAGE_SIZE, MEMREMAP_WB);
+       if (!kexec_handoff) {
+	       pr_err("Failed to map handoff page %pa.\n", &addr);
+	       return -ENOMEM;
+       }
+
+       kexec_handoff_phys = addr;
+       return 0;
+}
+
+void machine_kexec_handoff_exit(void)
+{
+       if (kexec_handoff)
+	       memunmap(kexec_handoff);
+       kexec_handoff = NULL;
+       kexec_handoff_phys = 0;
+}
+
+/**
+ * kexec_handoff_fill - Fill in the part of the handoff page known before the
+ * relocation stub runs, and clean it to PoC since the stub runs with the MMU
+ * off.
+ */
+static void kexec_handoff_fill(struct kimage *kimage)
+{
+       u64 start_ns = kimage->phases[KEXEC_PHASE_RESTART_PREPARE].start_ns;
+
+       memset(kexec_handoff, 0, sizeof(*kexec_handoff));
+       kexec_handoff->magic = KEXEC_HANDOFF_MAGIC;
+       kexec_handoff->cntfrq = read_sysreg(cntfrq_el0);
+       kexec_handoff->exec_ns = start_ns ? ktime_get_ns() - start_ns : 0;
+       isb();
+       kexec_handoff->machine_kexec = read_sysreg(cntvct_el0);
+
+       __flush_dcache_area(kexec_handoff, sizeof(*kexec_handoff));
+}
+
 /**
  * machine_kexec_prepare - Prepare for a kexec reboot.
  *
@@ -70,6 +349,8 @@ EXPORT_SYMBOL_GPL(machine_kexec_cleanup);
  */
 int machine_kexec_prepare(struct kimage *kimage)
 {
+       unsigned long i;
+
        kexec_image_info(kimage);
 
        if (cpus_are_stuck_in_kernel()) {
@@ -77,6 +358,29 @@ int machine_kexec_prepare(struct kimage *kimage)
 	       return -EBUSY;
        }
 
+       if (kimage->type == KEXEC_TYPE_CRASH &&
+	   !machine_kexec_compat_irqs_available()) {
+	       pr_err("Can't kexec: crash needs irq_to_desc() and nr_irqs.\n");
+	       return -EOPNOTSUPP;
+       }
+
+       if (kimage->preserve_context && !machine_kexec_compat_jump_available()) {
+	       pr_err("Can't kexec: jump needs cpu_suspend() and cpu_resume().\n");
+	       return -EOPNOTSUPP;
+       }
+
+       for (i = 0; kexec_handoff && i < kimage->nr_segments; i++) {
+	       unsigned long mem = kimage->segment[i].mem;
+	       unsigned long memsz = kimage->segment[i].memsz;
+
+	       if (mem < kexec_handoff_phys + PAGE_SIZE &&
+		   kexec_handoff_phys < mem + memsz) {
+		       pr_err("Can't kexec: segment[%lu] overlaps the handoff page.\n",
+			      i);
+		       return -EINVAL;
+	       }
+       }
+
        return 0;
 }
 EXPORT_SYMBOL_GPL(machine_kexec_prepare);
@@ -107,8 +411,9 @@ static void kexec_list_flush(struct kimage *kimage)
 		       entry = (kimage_entry_t *)addr - 1;
 		       break;
 	       case IND_SOURCE:
-		       /* flush the source pages. */
-		       __flush_dcache_area(addr, PAGE_SIZE);
+		       /* flush the source pages, unless the core did already. */
+		       if (!kimage->sources_flushed)
+			       __flush_dcache_area(addr, PAGE_SIZE);
 		       break;
 	       case IND_DESTINATION:
 		       break;
@@ -118,6 +423,18 @@ static void kexec_list_flush(struct kimage *kimage)
        }
 }
 
+/**
+ * machine_kexec_flush - Clean part of the kimage to PoC ahead of machine_kexec().
+ *
+ * Called by the core kexec code on each online CPU before the secondary CPUs
+ * are shut down.
+ */
+void machine_kexec_flush(void *addr, size_t len)
+{
+       __flush_dcache_area(addr, len);
+}
+EXPORT_SYMBOL_GPL(machine_kexec_flush);
+
 /**
  * kexec_segment_flush - Helper to flush the kimage segments to PoC.
  */
@@ -140,22 +457,109 @@ static void kexec_segment_flush(const struct kimage *kimage)
        }
 }
 
+/**
+ * kexec_verify_fill - Hand the segment digests over to the relocation stub.
+ *
+ * The stub checks the segments with the SHA-256 instructions, so it only gets
+ * the digests if this CPU, the one that runs the stub, has them.
+ */
+static void kexec_verify_fill(struct kimage *kimage,
+			      struct kexec_smp_data *smp_data)
+{
+       u64 isar0 = read_sysreg(id_aa64isar0_el1);
+       unsigned long i, j;
+
+       BUILD_BUG_ON(KEXEC_SEGMENT_MAX > KEXEC_SMP_MAX_DIGESTS);
+
+       if (!cpuid_feature_extract_unsigned_field(isar0, ID_AA64ISAR0_SHA2_SHIFT)) {
+	       pr_warn("No SHA-256 instructions, not checking the image.\n");
+	       return;
+       }
+
+       for (i = 0; i < kimage->nr_segments; i++) {
+	       struct kexec_smp_digest *d = &smp_data->digests[i];
+
+	       d->mem = kimage->segment[i].mem;
+	       d->memsz = kimage->segment[i].memsz;
+	       for (j = 0; j < ARRAY_SIZE(d->digest); j++)
+		       d->digest[j] = be32_to_cpup((__be32 *)kimage->digest[i] + j);
+       }
+
+       smp_data->nr_digests = kimage->nr_segments;
+}
+
+/**
+ * kexec_jump_finisher - Enter the image of a kexec jump.
+ *
+ * Called by cpu_suspend() once the context of this CPU is saved. When the
+ * image returns, cpu_resume() restores the context and returns from
+ * cpu_suspend() instead.
+ */
+static int kexec_jump_finisher(unsigned long arg)
+{
+       struct kimage *kimage = (struct kimage *)arg;
+
+       cpu_soft_restart_same_el(page_to_phys(kimage->control_code_page),
+				kimage->head, kimage->start, 0);
+}
+
+/**
+ * kexec_jump - Run the image of a kexec jump and come back.
+ *
+ * The core kexec code already froze the tasks, suspended the devices and took
+ * the secondary CPUs offline. What is left is the state of this CPU: the CPU
+ * PM notifiers save the FPSIMD, timer and GIC state, cpu_suspend() saves the
+ * system registers.
+ */
+static void kexec_jump(struct kimage *kimage)
+{
+       int ret;
+
+       ret = cpu_pm_enter();
+       if (!ret) {
+	       ret = cpu_suspend((unsigned long)kimage, kexec_jump_finisher);
+	       cpu_pm_exit();
+       }
+
+       /* Unmask all but interrupts, which the core kexec code enables. */
+       local_daif_restore(DAIF_PROCCTX_NOIRQ);
+
+       if (ret)
+	       pr_err("Kexec jump failed: %d\n", ret);
+       else
+	       pr_info("Back from kexec jump.\n");
+}
+
 /**
  * machine_kexec - Do the kexec reboot.
  *
  * Called from the core kexec code for a sys_reboot with LINUX_REBOOT_CMD_KEXEC.
+ * Returns only for a kexec jump, once the image came back.
  */
 void machine_kexec(struct kimage *kimage)
 {
        phys_addr_t reboot_code_buffer_phys;
        void *reboot_code_buffer;
+       struct kexec_smp_data *smp_data;
        bool stuck_cpus = cpus_are_stuck_in_kernel();
+       bool in_kexec_crash = kimage->type == KEXEC_TYPE_CRASH;
+       bool in_kexec_jump = kimage->preserve_context;
+       u64 start_ns = 0, flush_ns = 0;
 
-       BUG_ON(stuck_cpus || (num_online_cpus() > 1));
+       /*
+	* The timekeeping behind the phase timings and the handoff page may be
+	* locked by the CPU that panicked, so a crash kernel goes without them.
+	*/
+       if (!in_kexec_crash)
+	       start_ns = kimage_phase_begin(kimage, KEXEC_PHASE_HANDOFF);
 
        /*
 	* New cpus may have become stuck_in_kernel after we loaded the image.
 	*/
+       BUG_ON(!in_kexec_crash && (stuck_cpus || (num_online_cpus() > 1)));
+       WARN(in_kexec_crash && (stuck_cpus || (num_online_cpus() > 1)),
+	    "Some CPUs may be stale, kdump will be unreliable.\n");
+
        reboot_code_buffer_phys = page_to_phys(kimage->control_code_page);
        reboot_code_buffer = phys_to_virt(reboot_code_buffer_phys);
 
@@ -180,6 +584,34 @@ void machine_kexec(struct kimage *kimage)
        memcpy(reboot_code_buffer, arm64_relocate_new_kernel,
 	      arm64_relocate_new_kernel_size);
 
+       /*
+	* The secondary CPUs waiting in machine_kexec_park_cpu() take their
+	* share of the copy before parking themselves for the new kernel.
+	*/
+       smp_data = reboot_code_buffer + arm64_relocate_smp_data_offset;
+       smp_data->psci_conduit = kexec_smp_psci;
+       smp_data->nr_cpus = (in_kexec_crash || in_kexec_jump) ? 1 :
+			   atomic_read(&kexec_smp_arrived) + 1;
+       smp_data->handoff = kexec_handoff_phys;
+
+       /*
+	* A kexec jump swaps the image in, and back out through cpu_resume()
+	* when it returns.
+	*/
+       if (in_kexec_jump) {
+	       smp_data->resume = machine_kexec_compat_resume_phys();
+	       smp_data->head = kimage->head;
+	       smp_data->swap = page_to_phys(kimage->swap_page);
+       }
+
+       /* Let the stub check the segments in their final place. */
+       if (kimage->verify)
+	       kexec_verify_fill(kimage, smp_data);
+
+       kexec_smp_entry = reboot_code_buffer_phys +
+			 arm64_relocate_secondary_offset;
+       kexec_smp_head = kimage->head;
+
        /* Flush the reboot_code_buffer in preparation for its execution. */
        __flush_dcache_area(reboot_code_buffer, arm64_relocate_new_kernel_size);
 
@@ -193,16 +625,39 @@ void machine_kexec(struct kimage *kimage)
 			    arm64_relocate_new_kernel_size);
 
        /* Flush the kimage list and its buffers. */
+       if (!in_kexec_crash)
+	       flush_ns = kimage_phase_begin(kimage, KEXEC_PHASE_LIST_FLUSH);
        kexec_list_flush(kimage);
 
-       /* Flush the new image if already in place. */
-       if (kimage->head & IND_DONE)
+       /*
+	* Flush the new image if already in place. A crash kernel was cleaned
+	* to PoC while it was loaded.
+	*/
+       if (!in_kexec_crash && (kimage->head & IND_DONE))
 	       kexec_segment_flush(kimage);
 
+       if (!in_kexec_crash) {
+	       kimage_phase_end(kimage, KEXEC_PHASE_LIST_FLUSH, flush_ns);
+	       kimage_phase_end(kimage, KEXEC_PHASE_HANDOFF, start_ns);
+	       kimage_phase_print(kimage);
+       }
+
        pr_info("Bye!\n");
 
        local_daif_mask();
 
+       if (kexec_handoff && !in_kexec_crash)
+	       kexec_handoff_fill(kimage);
+
+       if (in_kexec_jump) {
+	       kexec_jump(kimage);
+	       kexec_smp_reset();
+	       return;
+       }
+
+       /* Release the secondary CPUs into the control code page. */
+       smp_store_release(&kexec_smp_go, KEXEC_SMP_GO);
+
        /*
 	* cpu_soft_restart will shutdown the MMU, disable data caches, then
 	* transfer control to the reboot_code_buffer which contains a copy of
@@ -217,3 +672,55 @@ void machine_kexec(struct kimage *kimage)
        BUG(); /* Should never get here. */
 }
 EXPORT_SYMBOL_GPL(machine_kexec);
+
+/*
+ * Deactivate and mask every interrupt, like upstream kexec does. A panic in
+ * interrupt context leaves that interrupt active at the GIC without an EOI,
+ * which would keep the crash kernel from taking any interrupt of its priority.
+ */
+static void machine_kexec_mask_interrupts(void)
+{
+       unsigned int i, nr = machine_kexec_compat_nr_irqs();
+
+       for (i = 0; i < nr; i++) {
+	       struct irq_desc *desc = irq_to_desc(i);
+	       struct irq_chip *chip = desc ? irq_desc_get_chip(desc) : NULL;
+	       int ret;
+
+	       if (!chip)
+		       continue;
+
+	       /* First try to remove the active state, else EOI it */
+	       ret = irq_set_irqchip_state(i, IRQCHIP_STATE_ACTIVE, false);
+	       if (ret && irqd_irq_inprogress(&desc->irq_data) && chip->irq_eoi)
+		       chip->irq_eoi(&desc->irq_data);
+
+	       if (chip->irq_mask)
+		       chip->irq_mask(&desc->irq_data);
+
+	       if (chip->irq_disable && !irqd_irq_disabled(&desc->irq_data))
+		       chip->irq_disable(&desc->irq_data);
+       }
+}
+
+/**
+ * machine_crash_shutdown - Stop the machine ahead of entering the crash kernel.
+ *
+ * Called from the panic notifier of the core kexec code. panic() normally
+ * stopped the other CPUs through an IPI already; do it here in case it did
+ * not. The interrupts are then deactivated and masked. The devices are left
+ * for the crash kernel to reset.
+ */
+void machine_crash_shutdown(struct pt_regs *regs)
+{
+       local_daif_mask();
+
+       /* shutdown non-crashing cpus */
+       if (num_online_cpus() > 1)
+	       smp_send_stop();
+
+       machine_kexec_mask_interrupts();
+
+       pr_info("Starting crashdump kernel...\n");
+}
+EXPORT_SYMBOL_GPL(machine_crash_shutdown);
@@ -16,6 +16,7 @@
 #include <linux/mm_types.h>
 #include <linux/kexec.h>
 #include <linux/kallsyms.h>
+#include <linux/irqdesc.h>
 #include <linux/slab.h>
 #include <asm/uaccess.h>
 #include <asm/virt.h>
@@ -26,6 +27,17 @@ static void (*cpu_do_switch_mm_ptr)(unsigned long, struct mm_struct *);
 static void (*__flush_dcache_area_ptr)(void *, size_t);
 static void (*__hyp_set_vectors_ptr)(phys_addr_t);
 
+/* Only needed by the crash path, which relies on panic() when missing */
+static void (*smp_send_stop_ptr)(void);
+
+/* Only needed for a kexec jump, which is refused when missing */
+static int (*cpu_suspend_ptr)(unsigned long, int (*)(unsigned long));
+static void *cpu_resume_ptr;
+
+/* Only needed by the crash path, which refuses crash images when missing */
+static struct irq_desc *(*irq_to_desc_ptr)(unsigned int);
+static int *nr_irqs_ptr;
+
 void cpu_do_switch_mm(unsigned long pgd_phys, struct mm_struct *mm)
 {
 	cpu_do_switch_mm_ptr(pgd_phys, mm);
@@ -44,6 +56,44 @@ void __hyp_set_vectors(phys_addr_t phys_vector_base)
 void __hyp_set_vectors_nop(phys_addr_t phys_vector_base)
 {}
 
+void smp_send_stop(void)
+{
+	if (smp_send_stop_ptr)
+		smp_send_stop_ptr();
+}
+
+int cpu_suspend(unsigned long arg, int (*fn)(unsigned long))
+{
+	return cpu_suspend_ptr(arg, fn);
+}
+
+bool machine_kexec_compat_jump_available(void)
+{
+	return cpu_suspend_ptr && cpu_resume_ptr;
+}
+
+phys_addr_t machine_kexec_compat_resume_phys(void)
+{
+	extern phys_addr_t kexec_pa_symbol(void *ptr);
+
+	return kexec_pa_symbol(cpu_resume_ptr);
+}
+
+struct irq_desc *irq_to_desc(unsigned int irq)
+{
+	return irq_to_desc_ptr(irq);
+}
+
+bool machine_kexec_compat_irqs_available(void)
+{
+	return irq_to_desc_ptr && nr_irqs_ptr;
+}
+
+unsigned int machine_kexec_compat_nr_irqs(void)
+{
+	return *nr_irqs_ptr;
+}
+
 
 /* These kernel symbols are stubbed since they are not available
  * in the host kernel */
@@ -146,6 +196,12 @@ int machine_kexec_compat_load(int detect_el2, int shim_hyp)
 	    || !(__flush_dcache_area_ptr = ksym("__flush_dcache_area")))
 		return -ENOENT;
 
+	smp_send_stop_ptr = ksym("smp_send_stop");
+	cpu_suspend_ptr = ksym("cpu_suspend");
+	cpu_resume_ptr = ksym("cpu_resume");
+	irq_to_desc_ptr = ksym("irq_to_desc");
+	nr_irqs_ptr = ksym("nr_irqs");
+
 	/* Find __init_mm */
 	__init_mm();
 
@@ -32,4 +32,27 @@ void machine_kexec_compat_unload(void);
  */
 void machine_kexec_compat_prereset(void);
 
+/**
+ * Determine whether cpu_suspend() and cpu_resume() could be resolved, which a
+ * kexec jump needs to save and restore the CPU context.
+ */
+bool machine_kexec_compat_jump_available(void);
+
+/**
+ * Obtain the physical address of cpu_resume(), through which the old kernel
+ * is resumed when the image of a kexec jump returns.
+ */
+phys_addr_t machine_kexec_compat_resume_phys(void);
+
+/**
+ * Determine whether irq_to_desc() and nr_irqs could be resolved, which the
+ * crash path needs to deactivate and mask the interrupts.
+ */
+bool machine_kexec_compat_irqs_available(void);
+
+/**
+ * Obtain the number of interrupt descriptors to walk.
+ */
+unsigned int machine_kexec_compat_nr_irqs(void);
+
 #endif /* LINUX_MACHINE_KEXEC_COMPAT_H */
@@ -15,6 +15,7 @@
 #include <linux/module.h>
 
 #include "machine_kexec_compat.h"
+#include "relocate_kernel.h"
 #include "idmap.h"
 
 MODULE_LICENSE("GPL v2");
@@ -32,6 +33,16 @@ module_param(shim_hyp, int, 0);
 MODULE_PARM_DESC(shim_hyp,
 		 "Shim the HYP_SOFT_RESTART call for EL2 mode (default = 0)");
 
+static int smp_relocate = 0;
+module_param(smp_relocate, int, 0);
+MODULE_PARM_DESC(smp_relocate,
+		 "Relocate the new kernel using all online CPUs (default = 0)");
+
+static unsigned long handoff_addr = 0;
+module_param(handoff_addr, ulong, 0);
+MODULE_PARM_DESC(handoff_addr,
+		 "Physical address of a reserved page to leave kexec timestamps in (default = 0)");
+
 static int __init
 kexecmod_arm64_init(void)
 {
@@ -46,6 +57,15 @@ kexecmod_arm64_init(void)
 	/* Build identity map for MMU */
 	kexec_idmap_setup();
 
+	/* Find out how to park the secondary CPUs */
+	machine_kexec_smp_init(smp_relocate);
+
+	/* Map the page to leave the relocation timestamps in */
+	if ((err = machine_kexec_handoff_init(handoff_addr)) != 0) {
+		machine_kexec_compat_unload();
+		return err;
+	}
+
 	return 0;
 }
 
@@ -54,6 +74,8 @@ module_init(kexecmod_arm64_init)
 static void __exit
 kexecmod_arm64_exit(void)
 {
+	machine_kexec_handoff_exit();
+
 	/* Unload compatibility layer */
 	machine_kexec_compat_unload();
 }
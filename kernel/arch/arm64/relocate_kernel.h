@@ -0,0 +1,212 @@
+/*
+ * Definitions shared between machine_kexec.c, relocate_kernel.S and the
+ * relocation benchmark in bench/.
+ *
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _ARM64_RELOCATE_KERNEL_H
+#define _ARM64_RELOCATE_KERNEL_H
+
+/* Maximum number of CPUs that take a share of the relocation copy. */
+#define KEXEC_SMP_MAX_CPUS	64
+
+/* Offsets into the SMP data area at the end of the control code page. */
+#define KEXEC_SMP_NR_CPUS	0
+#define KEXEC_SMP_PSCI		8
+#define KEXEC_SMP_HANDOFF	16
+#define KEXEC_SMP_RESUME	24
+#define KEXEC_SMP_HEAD		32
+#define KEXEC_SMP_SWAP		40
+#define KEXEC_SMP_NR_DIGESTS	48
+#define KEXEC_SMP_STATE		56
+#define KEXEC_SMP_DIGESTS	(KEXEC_SMP_STATE + 8 * KEXEC_SMP_MAX_CPUS)
+#define KEXEC_SMP_SIZE		(KEXEC_SMP_DIGESTS + \
+				 KEXEC_SMP_DIGEST_SIZE * KEXEC_SMP_MAX_DIGESTS)
+
+/*
+ * Segments the stub checks before entering the image, each as its address,
+ * its size and the eight words of its SHA-256 digest.
+ */
+#define KEXEC_SMP_MAX_DIGESTS	16
+#define KEXEC_SMP_DIGEST_SIZE	48
+
+/* Progress of a secondary CPU, as reported in its state slot. */
+#define KEXEC_SMP_STATE_ENTERED	1
+#define KEXEC_SMP_STATE_DONE	2
+
+/* PSCI conduit used by the secondaries to turn themselves off. */
+#define KEXEC_SMP_PSCI_NONE	0
+#define KEXEC_SMP_PSCI_HVC	1
+#define KEXEC_SMP_PSCI_SMC	2
+
+/*
+ * Layout of the handoff page, a page the next kernel keeps reserved, in which
+ * machine_kexec() and the relocation stub leave timestamps for it to read.
+ * The page starts with KEXEC_HANDOFF_MAGIC. All timestamps are CNTVCT_EL0
+ * values, except for KEXEC_HANDOFF_EXEC_NS.
+ */
+#define KEXEC_HANDOFF_MAGIC		0x314f48434558454b	/* "KEXECHO1" */
+#define KEXEC_HANDOFF_CNTFRQ		8	/* Counter frequency in Hz */
+#define KEXEC_HANDOFF_EXEC_NS		16	/* kernel_kexec() to handoff */
+#define KEXEC_HANDOFF_MACHINE_KEXEC	24	/* Handoff to the stub */
+#define KEXEC_HANDOFF_STUB_ENTRY	32	/* Entry of the stub */
+#define KEXEC_HANDOFF_COPY_DONE		40	/* All CPUs finished the copy */
+#define KEXEC_HANDOFF_JUMP		48	/* Jump into the new image */
+#define KEXEC_HANDOFF_NR_PAGES		56	/* Source pages relocated */
+#define KEXEC_HANDOFF_NR_BYTES		64	/* Bytes relocated */
+#define KEXEC_HANDOFF_RETURN		72	/* Return address of a kexec jump */
+#define KEXEC_HANDOFF_VERIFIED		80	/* Segments checked, or zero */
+#define KEXEC_HANDOFF_SIZE		88
+
+#ifdef __ASSEMBLY__
+
+/*
+ * The loops of the relocation stub, shared with the standalone benchmark in
+ * bench/. They only use what is available at EL0 as well, apart from the
+ * cache maintenance instruction which is passed in.
+ */
+
+/*
+ * kexec_dcache_line_size - Get the minimum D-cache line size from CTR_EL0.
+ */
+	.macro	kexec_dcache_line_size, reg, tmp
+	mrs	\tmp, ctr_el0
+	ubfm	\tmp, \tmp, #16, #19
+	mov	\reg, #4
+	lsl	\reg, \reg, \tmp
+	.endm
+
+/*
+ * kexec_dcache_range - Apply "dc \op" to [\start, \end) by lines of \line
+ * bytes, then wait for completion. Clobbers \start and \tmp.
+ */
+	.macro	kexec_dcache_range, op, start, end, line, tmp
+	sub	\tmp, \line, #1
+	bic	\start, \start, \tmp
+9997:	dc	\op, \start
+	add	\start, \start, \line
+	cmp	\start, \end
+	b.lo	9997b
+	dsb	sy
+	.endm
+
+/*
+ * kexec_copy_page - Copy \size bytes from \src to \dest, both aligned to
+ * \size. Advances \src and \dest past the page.
+ */
+	.macro	kexec_copy_page, dest, src, size, t1, t2, t3, t4, t5, t6, t7, t8
+9998:	ldp	\t1, \t2, [\src]
+	ldp	\t3, \t4, [\src, #16]
+	ldp	\t5, \t6, [\src, #32]
+	ldp	\t7, \t8, [\src, #48]
+	add	\src, \src, #64
+	stnp	\t1, \t2, [\dest]
+	stnp	\t3, \t4, [\dest, #16]
+	stnp	\t5, \t6, [\dest, #32]
+	stnp	\t7, \t8, [\dest, #48]
+	add	\dest, \dest, #64
+	tst	\src, #(\size - 1)
+	b.ne	9998b
+	.endm
+
+/*
+ * kexec_zero_page - Zero \size bytes at \dest, aligned to \size. Advances
+ * \dest past the page.
+ */
+	.macro	kexec_zero_page, dest, size
+9999:	stnp	xzr, xzr, [\dest]
+	stnp	xzr, xzr, [\dest, #16]
+	stnp	xzr, xzr, [\dest, #32]
+	stnp	xzr, xzr, [\dest, #48]
+	add	\dest, \dest, #64
+	tst	\dest, #(\size - 1)
+	b.ne	9999b
+	.endm
+
+/*
+ * kexec_sha256_quad - Four rounds of SHA-256 on the state in v0 (ABCD) and
+ * v1 (EFGH), with the round constants in v\k and the message schedule in
+ * v\w0 to v\w3. Unless this is one of the last four, v\w0 is then advanced
+ * to the words for the quad-round four ahead. Clobbers v2 and v5.
+ */
+	.macro	kexec_sha256_quad, k, w0, w1, w2, w3, update
+	add	v5.4s, v\w0\().4s, v\k\().4s
+	mov	v2.16b, v0.16b
+	sha256h	q0, q1, v5.4s
+	sha256h2	q1, q2, v5.4s
+	.if	\update
+	sha256su0	v\w0\().4s, v\w1\().4s
+	sha256su1	v\w0\().4s, v\w2\().4s, v\w3\().4s
+	.endif
+	.endm
+
+#else /* !__ASSEMBLY__ */
+
+#include <linux/types.h>
+
+/* C view of the SMP data area. */
+struct kexec_smp_data {
+	u64 nr_cpus;
+	u64 psci_conduit;
+	u64 handoff;
+	/* Only set for a kexec jump, to swap the image back on return */
+	u64 resume;
+	u64 head;
+	u64 swap;
+	/* Segments to check before entering the image, zero if none */
+	u64 nr_digests;
+	u64 state[KEXEC_SMP_MAX_CPUS];
+	struct kexec_smp_digest {
+		u64 mem;
+		u64 memsz;
+		u32 digest[8];
+	} digests[KEXEC_SMP_MAX_DIGESTS];
+};
+
+/* C view of the handoff page. */
+struct kexec_handoff {
+	u64 magic;
+	u64 cntfrq;
+	u64 exec_ns;
+	u64 machine_kexec;
+	u64 stub_entry;
+	u64 copy_done;
+	u64 jump;
+	u64 nr_pages;
+	u64 nr_bytes;
+	u64 return_addr;
+	u64 verified;
+};
+
+/* Global variables for the arm64_relocate_new_kernel routine. */
+extern const unsigned char arm64_relocate_new_kernel[];
+extern const unsigned long arm64_relocate_new_kernel_size;
+extern const unsigned long arm64_relocate_secondary_offset;
+extern const unsigned long arm64_relocate_smp_data_offset;
+
+/**
+ * Find out how to park the secondary CPUs.
+ *
+ * @param relocate Let the parked CPUs take part in the relocation.
+ */
+void machine_kexec_smp_init(int relocate);
+
+/**
+ * Set up the handoff page at physical address @addr, or disable it if zero.
+ */
+int machine_kexec_handoff_init(phys_addr_t addr);
+
+/**
+ * Unmap the handoff page.
+ */
+void machine_kexec_handoff_exit(void);
+
+#endif /* __ASSEMBLY__ */
+
+#endif /* _ARM64_RELOCATE_KERNEL_H */
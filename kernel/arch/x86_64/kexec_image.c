@@ -0,0 +1,41 @@
+/*
+ * Kernel image probe for x86_64 kexec_file_load
+ *
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <linux/errno.h>
+#include <linux/kernel.h>
+#include <linux/types.h>
+#include <asm/unaligned.h>
+
+#include "../../kexec.h"
+
+/* The "HdrS" signature of the setup header of a bzImage, see boot.rst */
+#define KEXEC_X86_HDRS_OFFSET	0x202
+#define KEXEC_X86_HDRS_MAGIC	0x53726448
+
+/*
+ * Refuse all images: kexec_file_load lays out a kernel, an initrd and a device
+ * tree, while a bzImage needs a boot_params page with the E820 map and its
+ * setup code skipped. kexec-tools builds those, through kexec_load.
+ */
+int machine_kexec_image_probe(const void *kernel, unsigned long len,
+			     struct kexec_image_layout *layout)
+{
+       const u8 *image = kernel;
+
+       if (len < KEXEC_X86_HDRS_OFFSET + sizeof(__le32) ||
+	   get_unaligned_le32(image + KEXEC_X86_HDRS_OFFSET) !=
+	   KEXEC_X86_HDRS_MAGIC)
+	       return -ENOEXEC;
+
+       pr_err("A bzImage can only be loaded with kexec_load.\n");
+       return -EOPNOTSUPP;
+}
+EXPORT_SYMBOL_GPL(machine_kexec_image_probe);
@@ -0,0 +1,390 @@
+/*
+ * kexec for x86_64
+ *
+ * Copyright (C) 2002-2005 Eric Biederman  <ebiederm@xmission.com>
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/interrupt.h>
+#include <linux/io.h>
+#include <linux/ioport.h>
+#include <linux/kernel.h>
+#include <linux/mem_encrypt.h>
+#include <linux/mm.h>
+#include <linux/smp.h>
+#include <linux/string.h>
+
+#include <asm/apic.h>
+#include <asm/page.h>
+#include <asm/pgtable_types.h>
+#include <asm/processor-flags.h>
+#include <asm/set_memory.h>
+#include <asm/smp.h>
+#include <asm/tlbflush.h>
+
+#include "../../kexec.h"
+#include "machine_kexec_compat.h"
+#include "relocate_kernel.h"
+
+#ifndef X86_CR4_LA57
+#define X86_CR4_LA57 (1UL << 12)
+#endif
+
+/* Entries of the identity map, which only consists of tables and 2MB pages. */
+#define KEXEC_PGTABLE	(_PAGE_PRESENT | _PAGE_RW | _PAGE_ACCESSED | _PAGE_DIRTY)
+#define KEXEC_PGLARGE	(KEXEC_PGTABLE | _PAGE_PSE)
+
+/* Each level of the identity map has 512 entries. */
+#define KEXEC_PGLEVEL_BITS	9
+#define KEXEC_PGINDEX(addr, shift) \
+	(((addr) >> (shift)) & ((1UL << KEXEC_PGLEVEL_BITS) - 1))
+
+/**
+ * kexec_image_info - For debugging output.
+ */
+#define kexec_image_info(_i) _kexec_image_info(__func__, __LINE__, _i)
+static void _kexec_image_info(const char *func, int line,
+			     const struct kimage *kimage)
+{
+       unsigned long i;
+
+       pr_debug("%s:%d:\n", func, line);
+       pr_debug("  kexec kimage info:\n");
+       pr_debug("    type:        %d\n", kimage->type);
+       pr_debug("    start:       %lx\n", kimage->start);
+       pr_debug("    head:        %lx\n", kimage->head);
+       pr_debug("    nr_segments: %lu\n", kimage->nr_segments);
+
+       for (i = 0; i < kimage->nr_segments; i++) {
+	       pr_debug("      segment[%lu]: %016lx - %016lx, 0x%lx bytes, %lu pages\n",
+			i,
+			kimage->segment[i].mem,
+			kimage->segment[i].mem + kimage->segment[i].memsz,
+			kimage->segment[i].memsz,
+			kimage->segment[i].memsz /  PAGE_SIZE);
+       }
+}
+
+/**
+ * machine_kexec_can_park - Whether machine_kexec_park_cpu() can stop @cpu.
+ *
+ * Never: besides stopping the secondary CPUs, machine_shutdown() puts the
+ * local APICs and the I/O APIC back into the mode they were in at boot, which
+ * the next kernel relies on. So the core kexec code always goes through it.
+ */
+bool machine_kexec_can_park(unsigned int cpu)
+{
+       return false;
+}
+EXPORT_SYMBOL_GPL(machine_kexec_can_park);
+
+/**
+ * machine_kexec_park_cpu - Park a secondary CPU ahead of machine_kexec().
+ *
+ * Not used, see machine_kexec_can_park().
+ */
+void machine_kexec_park_cpu(void *info)
+{
+       local_irq_disable();
+       set_cpu_online(smp_processor_id(), false);
+
+       for (;;)
+	       native_halt();
+}
+EXPORT_SYMBOL_GPL(machine_kexec_park_cpu);
+
+/**
+ * machine_kexec_unpark_cpus - Back out of a park attempt that timed out.
+ *
+ * Not used, see machine_kexec_can_park().
+ */
+void machine_kexec_unpark_cpus(unsigned int nr_cpus)
+{
+}
+EXPORT_SYMBOL_GPL(machine_kexec_unpark_cpus);
+
+/**
+ * machine_kexec_cleanup - Make the control code page non-executable again
+ * before it is freed.
+ */
+void machine_kexec_cleanup(struct kimage *kimage)
+{
+       if (kimage->control_code_page)
+	       set_memory_nx((unsigned long)page_address(kimage->control_code_page),
+			     1);
+}
+EXPORT_SYMBOL_GPL(machine_kexec_cleanup);
+
+/*
+ * Memory encryption is refused by machine_kexec_prepare(), so the pages of an
+ * image never need to be decrypted. Only needed if the kernel headers declare
+ * these hooks, which are then used by the core kexec code.
+ */
+#ifdef arch_kexec_post_alloc_pages
+int arch_kexec_post_alloc_pages(void *vaddr, unsigned int pages, gfp_t gfp)
+{
+       return 0;
+}
+EXPORT_SYMBOL_GPL(arch_kexec_post_alloc_pages);
+#endif
+
+#ifdef arch_kexec_pre_free_pages
+void arch_kexec_pre_free_pages(void *vaddr, unsigned int pages)
+{
+}
+EXPORT_SYMBOL_GPL(arch_kexec_pre_free_pages);
+#endif
+
+/**
+ * kexec_pgtable_alloc - Allocate a zeroed page for the identity map.
+ *
+ * The page is a control page of @kimage, so the image will not be copied over
+ * it, and it is freed along with the image.
+ */
+static u64 *kexec_pgtable_alloc(struct kimage *kimage)
+{
+       struct page *page = kimage_alloc_control_pages(kimage, 0);
+
+       if (!page)
+	       return NULL;
+
+       clear_page(page_address(page));
+       return page_address(page);
+}
+
+/**
+ * kexec_pgtable_map - Map the 2MB page at @paddr at @vaddr in @pgd, which has
+ * @levels levels.
+ */
+static int kexec_pgtable_map(struct kimage *kimage, u64 *pgd, int levels,
+			     unsigned long vaddr, phys_addr_t paddr)
+{
+       /* The top level indexes the bits above the levels below it. */
+       int shift = PMD_SHIFT + (levels - 2) * KEXEC_PGLEVEL_BITS;
+       u64 *table = pgd;
+
+       for (; shift > PMD_SHIFT; shift -= KEXEC_PGLEVEL_BITS) {
+	       u64 *entry = &table[KEXEC_PGINDEX(vaddr, shift)];
+
+	       if (*entry & _PAGE_PRESENT) {
+		       table = __va(*entry & PTE_PFN_MASK);
+		       continue;
+	       }
+
+	       table = kexec_pgtable_alloc(kimage);
+	       if (!table)
+		       return -ENOMEM;
+	       *entry = __pa(table) | KEXEC_PGTABLE;
+       }
+
+       table[KEXEC_PGINDEX(vaddr, PMD_SHIFT)] = paddr | KEXEC_PGLARGE;
+       return 0;
+}
+
+/**
+ * kexec_pgtable_map_range - Identity map [@start, @end) in 2MB pages.
+ */
+static int kexec_pgtable_map_range(struct kimage *kimage, u64 *pgd, int levels,
+				   phys_addr_t start, phys_addr_t end)
+{
+       phys_addr_t addr;
+       int ret;
+
+       for (addr = ALIGN_DOWN(start, PMD_SIZE); addr < end; addr += PMD_SIZE) {
+	       ret = kexec_pgtable_map(kimage, pgd, levels, addr, addr);
+	       if (ret)
+		       return ret;
+       }
+
+       return 0;
+}
+
+/**
+ * kexec_pgtable_init - Build the page tables the relocation stub runs on.
+ *
+ * They identity map all System RAM, which holds the source pages and the
+ * list, as well as the destination of every segment and the control code
+ * page. Those need not be System RAM: a crash kernel region is usually a
+ * reserved range. The control code page is mapped at its address in the
+ * direct mapping too, since machine_kexec() enters the stub there and the
+ * stub switches to these page tables before it jumps to the identity
+ * mapping. Returns the physical address of the top level.
+ */
+static int kexec_pgtable_init(struct kimage *kimage, phys_addr_t *pgd_phys)
+{
+       /* A switch between 4 and 5 levels needs paging turned off first. */
+       int levels = (__read_cr4() & X86_CR4_LA57) ? 5 : 4;
+       struct page *control_page = kimage->control_code_page;
+       unsigned long vaddr = (unsigned long)page_address(control_page);
+       struct resource *res;
+       unsigned long i;
+       u64 *pgd;
+       int ret;
+
+       pgd = kexec_pgtable_alloc(kimage);
+       if (!pgd)
+	       return -ENOMEM;
+
+       for (res = iomem_resource.child; res; res = res->sibling) {
+	       if (strcmp(res->name, "System RAM"))
+		       continue;
+
+	       ret = kexec_pgtable_map_range(kimage, pgd, levels, res->start,
+					     res->end + 1);
+	       if (ret)
+		       return ret;
+       }
+
+       for (i = 0; i < kimage->nr_segments; i++) {
+	       ret = kexec_pgtable_map_range(kimage, pgd, levels,
+					     kimage->segment[i].mem,
+					     kimage->segment[i].mem +
+					     kimage->segment[i].memsz);
+	       if (ret)
+		       return ret;
+       }
+
+       ret = kexec_pgtable_map_range(kimage, pgd, levels,
+				     page_to_phys(control_page),
+				     page_to_phys(control_page) + PAGE_SIZE);
+       if (ret)
+	       return ret;
+
+       ret = kexec_pgtable_map(kimage, pgd, levels, vaddr & PMD_MASK,
+			       page_to_phys(control_page) & PMD_MASK);
+       if (ret)
+	       return ret;
+
+       *pgd_phys = __pa(pgd);
+       return 0;
+}
+
+/**
+ * machine_kexec_prepare - Prepare for a kexec reboot.
+ *
+ * Called from the core kexec code when a kernel image is loaded. Builds the
+ * identity map and puts the relocation stub into the control code page, so
+ * that machine_kexec() does not need to allocate anything.
+ */
+int machine_kexec_prepare(struct kimage *kimage)
+{
+       void *reboot_code_buffer = page_address(kimage->control_code_page);
+       struct kexec_x86_data *data = reboot_code_buffer + KEXEC_X86_DATA;
+       phys_addr_t pgd_phys;
+       int ret;
+
+       kexec_image_info(kimage);
+
+       if (sme_me_mask) {
+	       pr_err("Can't kexec: memory encryption is not supported.\n");
+	       return -EOPNOTSUPP;
+       }
+
+       if (kimage->preserve_context) {
+	       pr_err("Can't kexec: kexec jump is not supported.\n");
+	       return -EOPNOTSUPP;
+       }
+
+       if (kimage->verify) {
+	       pr_err("Can't kexec: the segments are not checked on x86_64.\n");
+	       return -EOPNOTSUPP;
+       }
+
+       ret = kexec_pgtable_init(kimage, &pgd_phys);
+       if (ret)
+	       return ret;
+
+       BUILD_BUG_ON(sizeof(*data) > KEXEC_X86_DATA_SIZE);
+
+       memcpy(reboot_code_buffer, x86_64_relocate_new_kernel,
+	      x86_64_relocate_new_kernel_size);
+       data->pgd = pgd_phys;
+
+       /* The direct mapping is not executable. */
+       return set_memory_x((unsigned long)reboot_code_buffer, 1);
+}
+EXPORT_SYMBOL_GPL(machine_kexec_prepare);
+
+/**
+ * machine_kexec_flush - Clean part of the kimage ahead of machine_kexec().
+ *
+ * Nothing to do, the caches are coherent and stay enabled.
+ */
+void machine_kexec_flush(void *addr, size_t len)
+{
+}
+EXPORT_SYMBOL_GPL(machine_kexec_flush);
+
+/**
+ * machine_kexec - Do the kexec reboot.
+ *
+ * Called from the core kexec code for a sys_reboot with LINUX_REBOOT_CMD_KEXEC.
+ */
+void machine_kexec(struct kimage *kimage)
+{
+       void *reboot_code_buffer = page_address(kimage->control_code_page);
+       struct kexec_x86_data *data = reboot_code_buffer + KEXEC_X86_DATA;
+       x86_64_relocate_t relocate = reboot_code_buffer;
+       bool in_kexec_crash = kimage->type == KEXEC_TYPE_CRASH;
+       u64 start_ns = 0;
+
+       /* The CPU that panicked may hold the timekeeping lock. */
+       if (!in_kexec_crash)
+	       start_ns = kimage_phase_begin(kimage, KEXEC_PHASE_HANDOFF);
+
+       kexec_image_info(kimage);
+
+       pr_debug("%s:%d: control_code_page:        %p\n", __func__, __LINE__,
+		kimage->control_code_page);
+       pr_debug("%s:%d: reboot_code_buffer:       %p\n", __func__, __LINE__,
+		reboot_code_buffer);
+       pr_debug("%s:%d: identity map:             0x%llx\n", __func__, __LINE__,
+		data->pgd);
+
+       /* The stub runs without an IDT. */
+       local_irq_disable();
+
+       if (!in_kexec_crash) {
+	       kimage_phase_end(kimage, KEXEC_PHASE_HANDOFF, start_ns);
+	       kimage_phase_print(kimage);
+       }
+
+       pr_info("Bye!\n");
+
+       /*
+	* The stub switches to the identity map, copies the new image to its
+	* final position and transfers control to its entry point.
+	*/
+       relocate(kimage->head, page_to_phys(kimage->control_code_page),
+		kimage->start, data->pgd);
+
+       BUG(); /* Should never get here. */
+}
+EXPORT_SYMBOL_GPL(machine_kexec);
+
+/**
+ * machine_crash_shutdown - Stop the machine ahead of entering the crash kernel.
+ *
+ * Called from the panic notifier of the core kexec code. panic() normally
+ * stopped the other CPUs already; do it here in case it did not. The devices
+ * are left for the crash kernel to reset, but the interrupt controllers are
+ * put back into the mode the crash kernel expects to boot in, if possible.
+ */
+void machine_crash_shutdown(struct pt_regs *regs)
+{
+       local_irq_disable();
+
+       /* shutdown non-crashing cpus */
+       if (num_online_cpus() > 1)
+	       smp_send_stop();
+
+       lapic_shutdown();
+       restore_boot_irq_mode();
+
+       pr_info("Starting crashdump kernel...\n");
+}
+EXPORT_SYMBOL_GPL(machine_crash_shutdown);
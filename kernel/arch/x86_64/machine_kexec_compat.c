@@ -0,0 +1,86 @@
+/*
+ * Arch-specific compatibility layer for enabling kexec as loadable kernel
+ * module.
+ *
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define pr_fmt(fmt) "kexec_mod_x86_64: " fmt
+
+#include <linux/kallsyms.h>
+#include <linux/kernel.h>
+#include <asm/apic.h>
+#include <asm/set_memory.h>
+
+#include "machine_kexec_compat.h"
+
+/* These kernel symbols need to be dynamically resolved at runtime
+ * using kallsym due to them not being exposed to kernel modules */
+static int (*set_memory_x_ptr)(unsigned long, int);
+static int (*set_memory_nx_ptr)(unsigned long, int);
+
+/* Only needed by the crash path, which leaves the interrupt controllers
+ * as they are when missing */
+static void (*lapic_shutdown_ptr)(void);
+static void (*restore_boot_irq_mode_ptr)(void);
+
+int set_memory_x(unsigned long addr, int numpages)
+{
+	return set_memory_x_ptr(addr, numpages);
+}
+
+int set_memory_nx(unsigned long addr, int numpages)
+{
+	return set_memory_nx_ptr(addr, numpages);
+}
+
+void lapic_shutdown(void)
+{
+	if (lapic_shutdown_ptr)
+		lapic_shutdown_ptr();
+}
+
+void restore_boot_irq_mode(void)
+{
+	if (restore_boot_irq_mode_ptr)
+		restore_boot_irq_mode_ptr();
+}
+
+bool machine_kexec_compat_irq_reset_available(void)
+{
+	return lapic_shutdown_ptr && restore_boot_irq_mode_ptr;
+}
+
+
+static void *ksym(const char *name)
+{
+	return (void *) kallsyms_lookup_name(name);
+}
+
+int machine_kexec_compat_load(void)
+{
+	if (!(set_memory_x_ptr = ksym("set_memory_x"))
+	    || !(set_memory_nx_ptr = ksym("set_memory_nx")))
+		return -ENOENT;
+
+	lapic_shutdown_ptr = ksym("lapic_shutdown");
+
+	/* Called disable_IO_APIC before Linux 4.17 */
+	if (!(restore_boot_irq_mode_ptr = ksym("restore_boot_irq_mode")))
+		restore_boot_irq_mode_ptr = ksym("disable_IO_APIC");
+
+	if (!machine_kexec_compat_irq_reset_available())
+		pr_warn("Crash kernel will find the interrupt controllers as they are.\n");
+
+	return 0;
+}
+
+void machine_kexec_compat_unload(void)
+{
+	/* Nothing to release, the symbols are only looked up */
+}
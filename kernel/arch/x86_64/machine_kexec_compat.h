@@ -0,0 +1,32 @@
+/*
+ * Arch-specific compatibility layer for enabling kexec as loadable kernel
+ * module.
+ *
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef LINUX_MACHINE_KEXEC_COMPAT_H
+#define LINUX_MACHINE_KEXEC_COMPAT_H
+
+/**
+ * Load the kexec compatibility layer.
+ */
+int machine_kexec_compat_load(void);
+
+/**
+ * Unload the kexec compatbility layer.
+ */
+void machine_kexec_compat_unload(void);
+
+/**
+ * Determine whether the interrupt controllers can be put back into the mode
+ * they were in at boot, which the crash kernel expects to find them in.
+ */
+bool machine_kexec_compat_irq_reset_available(void);
+
+#endif /* LINUX_MACHINE_KEXEC_COMPAT_H */
@@ -0,0 +1,47 @@
+/*
+ * kexec_mod_x86_64: Kexec driver for x86_64.
+ *
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define MODULE_NAME "kexec_mod_x86_64"
+#define pr_fmt(fmt) MODULE_NAME ": " fmt
+
+#include <linux/module.h>
+
+#include "machine_kexec_compat.h"
+
+MODULE_LICENSE("GPL v2");
+MODULE_AUTHOR("Fabian Mastenbroek <mail.fabianm@gmail.com>");
+MODULE_DESCRIPTION("Kexec backport as Kernel Module for x86_64");
+MODULE_VERSION("1.1");
+
+static int __init
+kexecmod_x86_64_init(void)
+{
+	int err;
+
+	/* Load compatibility layer */
+	if ((err = machine_kexec_compat_load()) != 0) {
+		pr_err("Failed to load: %d\n", err);
+		return err;
+	}
+
+	return 0;
+}
+
+module_init(kexecmod_x86_64_init)
+
+static void __exit
+kexecmod_x86_64_exit(void)
+{
+	/* Unload compatibility layer */
+	machine_kexec_compat_unload();
+}
+
+module_exit(kexecmod_x86_64_exit);
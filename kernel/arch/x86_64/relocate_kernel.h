@@ -0,0 +1,54 @@
+/*
+ * Definitions shared between machine_kexec.c and relocate_kernel.S.
+ *
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef _X86_64_RELOCATE_KERNEL_H
+#define _X86_64_RELOCATE_KERNEL_H
+
+/*
+ * Layout of the control code page: the stub, its stack and, at the end, the
+ * data area filled in by machine_kexec_prepare().
+ */
+#define KEXEC_X86_DATA_SIZE	64
+#define KEXEC_X86_DATA		(KEXEC_CONTROL_PAGE_SIZE - KEXEC_X86_DATA_SIZE)
+#define KEXEC_X86_STACK_SIZE	256
+
+/* Offsets into the data area. */
+#define KEXEC_X86_DATA_PGD	0
+
+/* Segment selectors of the GDT the stub loads. */
+#define KEXEC_X86_CS		0x08
+#define KEXEC_X86_DS		0x10
+
+#ifndef __ASSEMBLY__
+
+#include <linux/types.h>
+
+/* C view of the data area. */
+struct kexec_x86_data {
+	/* Physical address of the top level of the identity map */
+	u64 pgd;
+};
+
+/*
+ * Signature of the stub, as called through the direct mapping of the control
+ * code page. It does not return.
+ */
+typedef void (*x86_64_relocate_t)(unsigned long head,
+				  phys_addr_t control_page,
+				  unsigned long start, phys_addr_t pgd);
+
+/* Global variables for the x86_64_relocate_new_kernel routine. */
+extern const unsigned char x86_64_relocate_new_kernel[];
+extern const unsigned long x86_64_relocate_new_kernel_size;
+
+#endif /* __ASSEMBLY__ */
+
+#endif /* _X86_64_RELOCATE_KERNEL_H */
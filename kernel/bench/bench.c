@@ -0,0 +1,292 @@
+/*
+ * kexec-bench: Benchmark harness for the kexec_core.c page placement logic.
+ *
+ * Loads synthetic images through the real kexec_core.c, running against the
+ * page allocator model in shim.c, and prints one CSV line per configuration
+ * so that runs from different commits can be compared line by line.
+ *
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "shim.h"
+#include "bench.h"
+
+#include "kexec.h"
+#include "kexec_internal.h"
+
+struct bench_options {
+	unsigned long sizes_mb[32];
+	unsigned int nr_sizes;
+	unsigned long segments[32];
+	unsigned int nr_segments;
+	unsigned long chunk_pages;
+	unsigned int overlap;
+	unsigned int mem_factor;
+	unsigned int repeat;
+	unsigned int seed;
+	bool dry_run;
+};
+
+struct bench_result {
+	u64 load_ns;
+	u64 sanity_ns;
+	u64 control_ns;
+	u64 alloc_ns;
+	u64 copy_ns;
+	u64 free_ns;
+	struct bench_mem_stats mem;
+	struct kexec_load_stats load;
+};
+
+static void usage(const char *prog)
+{
+	fprintf(stderr,
+		"usage: %s [-s MB,...] [-n SEGMENTS,...] [-c CHUNK] [-o OVERLAP]\n"
+		"          [-m FACTOR] [-r REPEAT] [-S SEED] [-d]\n"
+		"\n"
+		"  -s  image sizes in MiB (default 10,64,256,1024,4096)\n"
+		"  -n  number of segments the image is split in (default 1,16,256)\n"
+		"  -c  fragmentation: free memory is handed out in chunks of this\n"
+		"      many pages in random order (default 0, fully sequential)\n"
+		"  -o  percentage of the image destination that lies in free\n"
+		"      memory, causing collisions (default 0)\n"
+		"  -m  memory size as a multiple of the image size (default 3)\n"
+		"  -r  repetitions per configuration, fastest is reported (default 3)\n"
+		"  -S  seed for the fragmentation model (default 1)\n"
+		"  -d  dry run: place the pages without copying the data\n",
+		prog);
+	exit(2);
+}
+
+static unsigned int parse_list(char *arg, unsigned long *list,
+			       unsigned int max)
+{
+	unsigned int n = 0;
+	char *tok;
+
+	for (tok = strtok(arg, ","); tok && n < max; tok = strtok(NULL, ","))
+		list[n++] = strtoul(tok, NULL, 0);
+	return n;
+}
+
+static int bench_run(const struct bench_options *opts, unsigned long size_mb,
+		     unsigned long nr_segments, struct bench_result *res)
+{
+	unsigned long image_pages = size_mb << (20 - PAGE_SHIFT);
+	unsigned long seg_pages = image_pages / nr_segments;
+	unsigned long overlap_pages = image_pages * opts->overlap / 100;
+	struct bench_mem_config config = {
+		.nr_pages = image_pages * opts->mem_factor,
+		.chunk_pages = opts->chunk_pages,
+		.seed = opts->seed,
+	};
+	unsigned long dest, i;
+	struct kimage *image;
+	u64 start, t;
+	void *buf;
+	int ret;
+
+	if (!seg_pages || nr_segments > KEXEC_SEGMENT_MAX)
+		return -EINVAL;
+
+	ret = bench_mem_init(&config);
+	if (ret)
+		return ret;
+
+	/* All segments read from the same zero-filled buffer. */
+	buf = mmap(NULL, (seg_pages + image_pages % nr_segments) * PAGE_SIZE,
+		   PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+		   MAP_POPULATE, -1, 0);
+	if (buf == MAP_FAILED)
+		return -ENOMEM;
+
+	/*
+	 * The destination ends @overlap_pages into the top of the modelled
+	 * memory, so that many pages of it can be handed out as sources.
+	 */
+	dest = BENCH_PHYS_BASE +
+	       (config.nr_pages - overlap_pages) * PAGE_SIZE;
+
+	memset(res, 0, sizeof(*res));
+	start = ktime_get_ns();
+
+	image = do_kimage_alloc_init();
+	if (!image)
+		return -ENOMEM;
+	image->nr_segments = nr_segments;
+	image->dry_run = opts->dry_run;
+	for (i = 0; i < nr_segments; i++) {
+		unsigned long pages = seg_pages;
+
+		if (i == nr_segments - 1)
+			pages += image_pages % nr_segments;
+		image->segment[i].buf = buf;
+		image->segment[i].bufsz = pages * PAGE_SIZE;
+		image->segment[i].mem = dest;
+		image->segment[i].memsz = pages * PAGE_SIZE;
+		dest += pages * PAGE_SIZE;
+	}
+
+	t = ktime_get_ns();
+	ret = sanity_check_segment_list(image);
+	res->sanity_ns = ktime_get_ns() - t;
+	if (ret)
+		goto out;
+
+	t = ktime_get_ns();
+	image->control_code_page = kimage_alloc_control_pages(image,
+				get_order(KEXEC_CONTROL_PAGE_SIZE));
+	image->swap_page = kimage_alloc_control_pages(image, 0);
+	res->control_ns = ktime_get_ns() - t;
+	if (!image->control_code_page || !image->swap_page) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr_segments; i++) {
+		ret = kimage_load_segment(image, &image->segment[i]);
+		if (ret)
+			goto out;
+	}
+	kimage_terminate(image);
+
+	res->load_ns = ktime_get_ns() - start;
+	res->alloc_ns = image->phases[KEXEC_PHASE_ALLOC].duration_ns;
+	res->copy_ns = image->phases[KEXEC_PHASE_COPY].duration_ns;
+	res->load = image->stats;
+
+out:
+	t = ktime_get_ns();
+	kimage_free(image);
+	res->free_ns = ktime_get_ns() - t;
+
+	/* Taken after kimage_free(), so that free_calls counts its frees. */
+	res->mem = *bench_mem_stats();
+
+	munmap(buf, (seg_pages + image_pages % nr_segments) * PAGE_SIZE);
+	return ret;
+}
+
+static void bench_merge(struct bench_result *best,
+			const struct bench_result *res, bool first)
+{
+	if (first) {
+		*best = *res;
+		return;
+	}
+
+	best->load_ns = min(best->load_ns, res->load_ns);
+	best->sanity_ns = min(best->sanity_ns, res->sanity_ns);
+	best->control_ns = min(best->control_ns, res->control_ns);
+	best->alloc_ns = min(best->alloc_ns, res->alloc_ns);
+	best->copy_ns = min(best->copy_ns, res->copy_ns);
+	best->free_ns = min(best->free_ns, res->free_ns);
+}
+
+int main(int argc, char **argv)
+{
+	struct bench_options opts = {
+		.sizes_mb = { 10, 64, 256, 1024, 4096 },
+		.nr_sizes = 5,
+		.segments = { 1, 16, 256 },
+		.nr_segments = 3,
+		.mem_factor = 3,
+		.repeat = 3,
+		.seed = 1,
+	};
+	unsigned int s, n, r;
+	int c;
+
+	while ((c = getopt(argc, argv, "s:n:c:o:m:r:S:dh")) != -1) {
+		switch (c) {
+		case 's':
+			opts.nr_sizes = parse_list(optarg, opts.sizes_mb, 32);
+			break;
+		case 'n':
+			opts.nr_segments = parse_list(optarg, opts.segments, 32);
+			break;
+		case 'c':
+			opts.chunk_pages = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			opts.overlap = min(atoi(optarg), 100);
+			break;
+		case 'm':
+			opts.mem_factor = max(atoi(optarg), 3);
+			break;
+		case 'r':
+			opts.repeat = max(atoi(optarg), 1);
+			break;
+		case 'S':
+			opts.seed = atoi(optarg);
+			break;
+		case 'd':
+			opts.dry_run = true;
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+
+	printf("size_mb,segments,chunk,overlap,dry_run,"
+	       "load_us,sanity_us,control_us,alloc_us,copy_us,free_us,"
+	       "alloc_calls,free_calls,peak_pages,overhead_pct,"
+	       "pages_allocated,collisions,swaps,dest_pages,unusable_pages,"
+	       "control_retries,indirection_pages,in_place_pages\n");
+
+	for (s = 0; s < opts.nr_sizes; s++) {
+		for (n = 0; n < opts.nr_segments; n++) {
+			unsigned long size_mb = opts.sizes_mb[s];
+			unsigned long image_pages = size_mb << (20 - PAGE_SHIFT);
+			struct bench_result res, best = { 0 };
+			int ret = 0;
+
+			for (r = 0; r < opts.repeat && !ret; r++) {
+				ret = bench_run(&opts, size_mb,
+						opts.segments[n], &res);
+				bench_merge(&best, &res, r == 0);
+			}
+			if (ret) {
+				fprintf(stderr, "%lu MiB in %lu segments: %s\n",
+					size_mb, opts.segments[n],
+					strerror(-ret));
+				continue;
+			}
+
+			printf("%lu,%lu,%lu,%u,%d,"
+			       "%llu,%llu,%llu,%llu,%llu,%llu,"
+			       "%lu,%lu,%lu,%.2f,"
+			       "%lu,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n",
+			       size_mb, opts.segments[n], opts.chunk_pages,
+			       opts.overlap, opts.dry_run,
+			       (unsigned long long)best.load_ns / 1000,
+			       (unsigned long long)best.sanity_ns / 1000,
+			       (unsigned long long)best.control_ns / 1000,
+			       (unsigned long long)best.alloc_ns / 1000,
+			       (unsigned long long)best.copy_ns / 1000,
+			       (unsigned long long)best.free_ns / 1000,
+			       best.mem.alloc_calls, best.mem.free_calls,
+			       best.mem.peak_held,
+			       100.0 * ((double)best.mem.peak_held -
+					image_pages) / image_pages,
+			       best.load.pages_allocated,
+			       best.load.dest_collisions, best.load.swaps,
+			       best.load.dest_pages, best.load.unusable_pages,
+			       best.load.control_retries,
+			       best.load.indirection_pages,
+			       best.load.in_place_pages);
+			fflush(stdout);
+		}
+	}
+
+	bench_mem_exit();
+	return 0;
+}
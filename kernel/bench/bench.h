@@ -0,0 +1,39 @@
+/*
+ * kexec-bench: Benchmark harness for the kexec_core.c page placement logic.
+ *
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef KEXEC_BENCH_H
+#define KEXEC_BENCH_H
+
+/* Physical address of the first page of the modelled memory */
+#define BENCH_PHYS_BASE 0x40000000UL
+
+struct bench_mem_config {
+	/* Size of the modelled memory */
+	unsigned long nr_pages;
+	/* Pages handed out in order before jumping elsewhere, 0 for all */
+	unsigned long chunk_pages;
+	/* Seed for the order in which chunks are handed out */
+	unsigned int seed;
+};
+
+struct bench_mem_stats {
+	unsigned long alloc_calls;
+	unsigned long free_calls;
+	/* Pages currently allocated, and the most at any time */
+	unsigned long held;
+	unsigned long peak_held;
+};
+
+int bench_mem_init(const struct bench_mem_config *config);
+void bench_mem_exit(void);
+const struct bench_mem_stats *bench_mem_stats(void);
+
+#endif /* KEXEC_BENCH_H */
@@ -0,0 +1,85 @@
+#!/bin/sh
+# /init of the guest booted by qemu.sh: loads the kexec modules, measures a
+# load and unload of the next kernel, then kexecs into it, until the number
+# of cycles given on the command line has been reached.
+#
+# Copyright (C) 2021 Fabian Mastenbroek.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+mount -t proc proc /proc
+mount -t sysfs sysfs /sys
+mount -t devtmpfs devtmpfs /dev 2>/dev/null
+
+arg() {
+	for opt in $(cat /proc/cmdline); do
+		case "$opt" in
+		"$1"=*) echo "${opt#*=}"; return ;;
+		esac
+	done
+}
+
+fail() {
+	echo "KEXEC_BENCH fail cycle=$cycle $*"
+	poweroff -f
+}
+
+cycle=$(arg kexec_bench.cycle)
+cycles=$(arg kexec_bench.cycles)
+loader=$(arg kexec_bench.loader)
+arch=$(arg kexec_bench.arch)
+uptime=$(cut -d' ' -f1 /proc/uptime)
+
+echo "KEXEC_BENCH init cycle=$cycle uptime=$uptime"
+
+if [ "$cycle" -ge "$cycles" ]; then
+	echo "KEXEC_BENCH done"
+	poweroff -f
+fi
+
+insmod /kexec_mod.ko || fail "insmod kexec_mod"
+insmod /kexec_mod_$arch.ko || fail "insmod kexec_mod_$arch"
+
+mkdir -p /share
+mount -t vfat -o ro /dev/vda1 /share || fail "mount share"
+
+# kexec_load IMAGE INITRD CMDLINE, kexec_unload and kexec_exec
+if [ "$loader" = native ]; then
+	kexec_load() { /kexec-load -i "$2" -c "$3" "$1"; }
+	kexec_unload() { /kexec-load -u; }
+	kexec_exec() { /kexec-load -e; }
+else
+	# Without kexec_file_load support for bzImage, x86_64 needs kexec_load
+	[ "$arch" = x86_64 ] && syscall=--kexec-syscall || syscall=
+	kexec_load() {
+		LD_PRELOAD=/redir.so kexec $syscall -l "$1" --initrd="$2" \
+			--append="$3"
+	}
+	kexec_unload() { LD_PRELOAD=/redir.so kexec -u; }
+	kexec_exec() { LD_PRELOAD=/redir.so kexec -e; }
+fi
+
+# Read the images once, so the page cache does not show up as a leak.
+cat /share/Image /share/initrd > /dev/null
+
+append=$(sed "s/kexec_bench.cycle=$cycle/kexec_bench.cycle=$((cycle + 1))/" \
+	/proc/cmdline)
+
+# Load and unload once to find out what the load leaves behind.
+free_before=$(awk '/^MemFree/ { print $2 }' /proc/meminfo)
+kexec_load /share/Image /share/initrd "$append" || fail "load"
+load_us=$(awk '{ s += $3 } END { print int(s / 1000) }' \
+	/sys/kernel/kexec/timings)
+kexec_unload || fail "unload"
+free_after=$(awk '/^MemFree/ { print $2 }' /proc/meminfo)
+
+echo "KEXEC_BENCH load cycle=$cycle load_us=$load_us" \
+	"leak_kb=$((free_before - free_after))"
+
+kexec_load /share/Image /share/initrd "$append" || fail "reload"
+echo "KEXEC_BENCH exec cycle=$cycle"
+kexec_exec
+fail "exec"
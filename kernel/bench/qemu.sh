@@ -0,0 +1,184 @@
+#!/bin/bash
+# End-to-end kexec benchmark: boots an arm64 or x86_64 kernel in qemu and lets
+# it kexec into itself a number of times, reporting per cycle the load
+# time, the memory left behind by a load and unload, and the time from
+# kexec -e to the first userspace of the next kernel.
+#
+# Copyright (C) 2021 Fabian Mastenbroek.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 2 of the License, or
+# (at your option) any later version.
+
+set -euo pipefail
+
+usage() {
+	cat >&2 <<EOF
+usage: $0 -k IMAGE -r ROOTFS [options]
+
+  -k IMAGE   kernel to boot and kexec into, an Image or bzImage for ARCH
+  -r ROOTFS  gzipped newc cpio with the guest userspace: a shell, busybox
+             tools and a dynamically linked kexec(8) for redir.so
+  -A ARCH    arm64 or x86_64 (default: arm64)
+  -M DIR     directory with kexec_mod.ko and kexec_mod_ARCH.ko built for
+             IMAGE (default: kernel/)
+  -u FILE    redir.so built for the guest (default: user/redir.so)
+  -l LOADER  load with kexec(8) through redir.so or with kexec-load
+             (kexec or native, default: kexec, native is arm64 only)
+  -L FILE    kexec-load built for the guest (default: user/kexec-load)
+  -n N       number of kexec cycles (default: 10)
+  -s N       number of CPUs (default: 2)
+  -m MB      guest memory (default: 1024)
+  -a ACCEL   kvm or tcg (default: kvm when available on an ARCH host)
+  -t SEC     timeout per cycle (default: 300)
+  -o FILE    write the CSV results to FILE instead of stdout
+EOF
+	exit 2
+}
+
+HERE=$(cd "$(dirname "$0")" && pwd)
+TOP=$(cd "$HERE/../.." && pwd)
+
+image=
+rootfs=
+arch=arm64
+moddir=$TOP/kernel
+redir=$TOP/user/redir.so
+loader=kexec
+native=$TOP/user/kexec-load
+cycles=10
+smp=2
+mem=1024
+accel=
+timeout=300
+out=/dev/stdout
+
+while getopts "k:r:A:M:u:l:L:n:s:m:a:t:o:h" opt; do
+	case "$opt" in
+	k) image=$OPTARG ;;
+	r) rootfs=$OPTARG ;;
+	A) arch=$OPTARG ;;
+	M) moddir=$OPTARG ;;
+	u) redir=$OPTARG ;;
+	l) loader=$OPTARG ;;
+	L) native=$OPTARG ;;
+	n) cycles=$OPTARG ;;
+	s) smp=$OPTARG ;;
+	m) mem=$OPTARG ;;
+	a) accel=$OPTARG ;;
+	t) timeout=$OPTARG ;;
+	o) out=$OPTARG ;;
+	*) usage ;;
+	esac
+done
+
+[ -n "$image" ] && [ -n "$rootfs" ] || usage
+case "$arch" in
+arm64)
+	qemu=qemu-system-aarch64
+	machine=virt
+	host=aarch64
+	console=ttyAMA0
+	;;
+x86_64)
+	# kexec-load only knows arm64 Images
+	[ "$loader" = kexec ] || usage
+	qemu=qemu-system-x86_64
+	machine=q35
+	host=x86_64
+	console=ttyS0
+	;;
+*) usage ;;
+esac
+case "$loader" in
+kexec) tool=$redir ;;
+native) tool=$native ;;
+*) usage ;;
+esac
+for f in "$image" "$rootfs" "$moddir/kexec_mod.ko" \
+	 "$moddir/arch/$arch/kexec_mod_$arch.ko" "$tool"; do
+	[ -f "$f" ] || { echo "$0: missing $f" >&2; exit 1; }
+done
+
+if [ -z "$accel" ]; then
+	if [ -w /dev/kvm ] && [ "$(uname -m)" = "$host" ]; then
+		accel=kvm
+	else
+		accel=tcg
+	fi
+fi
+[ "$accel" = kvm ] && cpu=host || cpu=max
+
+work=$(mktemp -d)
+trap 'rm -rf "$work"' EXIT
+
+# The overlay replaces /init and adds the modules; the kernel unpacks it on
+# top of the rootfs. The guest reads the same Image and initrd back from a
+# virtual FAT disk to kexec into them.
+mkdir -p "$work/overlay" "$work/share"
+install -m 0755 "$HERE/qemu-init.sh" "$work/overlay/init"
+cp "$moddir/kexec_mod.ko" "$moddir/arch/$arch/kexec_mod_$arch.ko" \
+   "$tool" "$work/overlay/"
+(cd "$work/overlay" && find . | cpio -o -H newc --quiet | gzip) \
+	> "$work/overlay.cpio.gz"
+cat "$rootfs" "$work/overlay.cpio.gz" > "$work/share/initrd"
+cp "$image" "$work/share/Image"
+
+cmdline="console=$console rdinit=/init"
+cmdline+=" kexec_bench.cycle=0 kexec_bench.cycles=$cycles"
+cmdline+=" kexec_bench.loader=$loader kexec_bench.arch=$arch"
+
+echo "cycle,load_us,leak_kb,exec_to_init_ms,boot_to_init_ms" > "$out"
+
+declare -A exec_at
+status=1
+
+# Timestamp the console output as it arrives, so that the time between the
+# exec marker of one cycle and the init marker of the next is measured on
+# the host, independent of the guest clocks.
+while IFS= read -r line; do
+	now=$EPOCHREALTIME
+	line=${line%$'\r'}
+	case "$line" in
+	"KEXEC_BENCH init "*)
+		set -- ${line#KEXEC_BENCH init }
+		cycle=${1#cycle=}
+		uptime=${2#uptime=}
+		prev=$((cycle - 1))
+		if [ -n "${exec_at[$prev]:-}" ]; then
+			awk -v c="$prev" -v l="$load_us" -v k="$leak_kb" \
+			    -v e="${exec_at[$prev]}" -v n="$now" -v u="$uptime" \
+			    'BEGIN { printf "%d,%d,%d,%.1f,%.1f\n",
+				     c, l, k, (n - e) * 1000, u * 1000 }' \
+				>> "$out"
+		fi
+		;;
+	"KEXEC_BENCH load "*)
+		set -- ${line#KEXEC_BENCH load }
+		load_us=${2#load_us=}
+		leak_kb=${3#leak_kb=}
+		;;
+	"KEXEC_BENCH exec "*)
+		set -- ${line#KEXEC_BENCH exec }
+		exec_at[${1#cycle=}]=$now
+		;;
+	"KEXEC_BENCH fail "*)
+		echo "$0: $line" >&2
+		break
+		;;
+	"KEXEC_BENCH done")
+		status=0
+		break
+		;;
+	esac
+done < <(timeout $((timeout * (cycles + 1))) \
+	"$qemu" -M "$machine" -cpu "$cpu" -accel "$accel" \
+		-smp "$smp" -m "$mem" -nographic -no-reboot \
+		-kernel "$work/share/Image" -initrd "$work/share/initrd" \
+		-append "$cmdline" \
+		-drive if=virtio,format=raw,readonly=on,file="fat:$work/share" \
+		2>&1)
+
+[ "$status" = 0 ] || echo "$0: benchmark did not complete" >&2
+exit "$status"
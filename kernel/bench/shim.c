@@ -0,0 +1,326 @@
+/*
+ * Userspace model of the page allocator and the other kernel services that
+ * kexec_core.c depends on.
+ *
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#include <sys/mman.h>
+#include <time.h>
+
+#include "shim.h"
+#include "bench.h"
+
+#include "kexec.h"
+#include "kexec_internal.h"
+
+/*
+ * Physical memory is an array of struct page starting at BENCH_PHYS_BASE,
+ * backed by a lazily populated virtual mapping. Only pages that kexec_core.c
+ * reaches through page_address() (the entry list) are ever touched; the
+ * image data itself goes through a single scratch page returned by kmap().
+ */
+static struct {
+	struct page *pages;
+	unsigned long nr_pages;
+	char *virt;
+
+	/* Free pages, the next one to hand out at the top */
+	unsigned long *free;
+	unsigned long nr_free;
+
+	struct bench_mem_stats stats;
+} mem;
+
+static char scratch[PAGE_SIZE] __attribute__((aligned(PAGE_SIZE)));
+
+unsigned long totalram_pages;
+
+static unsigned int bench_rand(unsigned int *seed)
+{
+	unsigned int x = *seed;
+
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *seed = x;
+}
+
+int bench_mem_init(const struct bench_mem_config *config)
+{
+	unsigned long chunk = config->chunk_pages;
+	unsigned long nr_chunks, i, j, n = 0;
+	unsigned long *order;
+	unsigned int seed = config->seed ? config->seed : 1;
+
+	bench_mem_exit();
+
+	mem.nr_pages = config->nr_pages;
+	mem.pages = calloc(mem.nr_pages, sizeof(*mem.pages));
+	mem.free = malloc(mem.nr_pages * sizeof(*mem.free));
+	mem.virt = mmap(NULL, mem.nr_pages * PAGE_SIZE, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if (!mem.pages || !mem.free || mem.virt == MAP_FAILED)
+		return -ENOMEM;
+
+	/*
+	 * Fragmentation is modelled by handing out memory in chunks of
+	 * @chunk pages in random order, each chunk in ascending order.
+	 */
+	if (!chunk || chunk > mem.nr_pages)
+		chunk = mem.nr_pages;
+	nr_chunks = (mem.nr_pages + chunk - 1) / chunk;
+	order = malloc(nr_chunks * sizeof(*order));
+	if (!order)
+		return -ENOMEM;
+	for (i = 0; i < nr_chunks; i++)
+		order[i] = i;
+	for (i = nr_chunks - 1; i > 0; i--) {
+		unsigned long k = bench_rand(&seed) % (i + 1);
+		unsigned long tmp = order[i];
+
+		order[i] = order[k];
+		order[k] = tmp;
+	}
+
+	/* The stack pops from the top, so fill it back to front. */
+	for (i = nr_chunks; i-- > 0;) {
+		unsigned long start = order[i] * chunk;
+		unsigned long end = min(start + chunk, mem.nr_pages);
+
+		for (j = end; j-- > start;)
+			mem.free[n++] = j;
+	}
+	mem.nr_free = n;
+	free(order);
+
+	totalram_pages = mem.nr_pages;
+	memset(&mem.stats, 0, sizeof(mem.stats));
+	return 0;
+}
+
+void bench_mem_exit(void)
+{
+	if (mem.virt && mem.virt != MAP_FAILED)
+		munmap(mem.virt, mem.nr_pages * PAGE_SIZE);
+	free(mem.pages);
+	free(mem.free);
+	memset(&mem, 0, sizeof(mem));
+}
+
+const struct bench_mem_stats *bench_mem_stats(void)
+{
+	return &mem.stats;
+}
+
+static void bench_mem_take(unsigned long idx)
+{
+	mem.pages[idx].in_use = 1;
+	mem.stats.held++;
+	if (mem.stats.held > mem.stats.peak_held)
+		mem.stats.peak_held = mem.stats.held;
+}
+
+struct page *alloc_pages(gfp_t gfp_mask, unsigned int order)
+{
+	unsigned long count = 1UL << order;
+	unsigned long idx, i;
+
+	mem.stats.alloc_calls++;
+
+	if (!order) {
+		while (mem.nr_free) {
+			idx = mem.free[--mem.nr_free];
+			if (mem.pages[idx].in_use)
+				continue;
+			bench_mem_take(idx);
+			return &mem.pages[idx];
+		}
+		return NULL;
+	}
+
+	/* Higher orders are rare, just look for a free aligned block. */
+	for (idx = 0; idx + count <= mem.nr_pages; idx += count) {
+		for (i = 0; i < count && !mem.pages[idx + i].in_use; i++)
+			;
+		if (i < count)
+			continue;
+		for (i = 0; i < count; i++)
+			bench_mem_take(idx + i);
+		return &mem.pages[idx];
+	}
+	return NULL;
+}
+
+void __free_pages(struct page *page, unsigned int order)
+{
+	unsigned long idx = page - mem.pages;
+	unsigned long i;
+
+	mem.stats.free_calls++;
+
+	for (i = 0; i < (1UL << order); i++) {
+		mem.pages[idx + i].in_use = 0;
+		mem.free[mem.nr_free++] = idx + i;
+		mem.stats.held--;
+	}
+}
+
+unsigned long page_to_pfn(struct page *page)
+{
+	return (BENCH_PHYS_BASE >> PAGE_SHIFT) + (page - mem.pages);
+}
+
+struct page *pfn_to_page(unsigned long pfn)
+{
+	return &mem.pages[pfn - (BENCH_PHYS_BASE >> PAGE_SHIFT)];
+}
+
+void *page_address(struct page *page)
+{
+	return mem.virt + (page - mem.pages) * PAGE_SIZE;
+}
+
+void *phys_to_virt(phys_addr_t phys)
+{
+	return mem.virt + (phys - BENCH_PHYS_BASE);
+}
+
+phys_addr_t virt_to_phys(void *addr)
+{
+	return BENCH_PHYS_BASE + ((char *)addr - mem.virt);
+}
+
+void *kmap(struct page *page)
+{
+	return scratch;
+}
+
+u64 ktime_get_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* The benchmark preserves no memory for the next kernel. */
+bool kexec_preserve_overlaps(unsigned long start, unsigned long end)
+{
+	return false;
+}
+
+/* Everything below is only reachable from kernel_kexec(). */
+int schedule_on_each_cpu(work_func_t func)
+{
+	func(NULL);
+	return 0;
+}
+
+void smp_call_function(void (*func)(void *info), void *info, int wait)
+{
+}
+
+void migrate_to_reboot_cpu(void)
+{
+}
+
+void cpu_hotplug_enable(void)
+{
+}
+
+void machine_shutdown(void)
+{
+}
+
+int freeze_processes(void)
+{
+	return 0;
+}
+
+void thaw_processes(void)
+{
+}
+
+void suspend_console(void)
+{
+}
+
+void resume_console(void)
+{
+}
+
+int freeze_secondary_cpus(int primary)
+{
+	return 0;
+}
+
+void enable_nonboot_cpus(void)
+{
+}
+
+int dpm_suspend_start(pm_message_t state)
+{
+	return 0;
+}
+
+int dpm_suspend_end(pm_message_t state)
+{
+	return 0;
+}
+
+void dpm_resume_start(pm_message_t state)
+{
+}
+
+void dpm_resume_end(pm_message_t state)
+{
+}
+
+int syscore_suspend(void)
+{
+	return 0;
+}
+
+void syscore_resume(void)
+{
+}
+
+void kexec_restart_prepare(char *cmd)
+{
+}
+
+int machine_kexec_prepare(struct kimage *image)
+{
+	return 0;
+}
+
+void machine_kexec_cleanup(struct kimage *image)
+{
+}
+
+void machine_kexec(struct kimage *image)
+{
+}
+
+void machine_kexec_flush(void *addr, size_t len)
+{
+}
+
+bool machine_kexec_can_park(unsigned int cpu)
+{
+	return false;
+}
+
+void machine_kexec_park_cpu(void *info)
+{
+}
+
+void machine_kexec_unpark_cpus(unsigned int nr_cpus)
+{
+}
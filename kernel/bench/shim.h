@@ -0,0 +1,293 @@
+/*
+ * Userspace model of the kernel interfaces used by kexec_core.c, so that its
+ * page placement and entry list logic can be benchmarked without a reboot.
+ *
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#ifndef KEXEC_BENCH_SHIM_H
+#define KEXEC_BENCH_SHIM_H
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Types */
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef long long s64;
+typedef unsigned long long __u64;
+typedef unsigned int gfp_t;
+typedef unsigned long long phys_addr_t;
+typedef struct { int counter; } atomic_t;
+typedef struct { long counter; } atomic_long_t;
+
+#define __user
+#define __init
+#define __exit
+#define __weak __attribute__((weak))
+#define __packed __attribute__((packed))
+#define likely(x) __builtin_expect(!!(x), 1)
+#define unlikely(x) __builtin_expect(!!(x), 0)
+#define READ_ONCE(x) (*(volatile typeof(x) *)&(x))
+#define WRITE_ONCE(x, v) (*(volatile typeof(x) *)&(x) = (v))
+#define barrier() __asm__ __volatile__("" ::: "memory")
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#define min_t(t, a, b) min((t)(a), (t)(b))
+#define max_t(t, a, b) max((t)(a), (t)(b))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define container_of(ptr, type, member) \
+	((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define NSEC_PER_USEC 1000ULL
+#define USEC_PER_SEC 1000000UL
+
+static inline u64 div_u64(u64 dividend, u32 divisor)
+{
+	return dividend / divisor;
+}
+
+/* Logging */
+#define KERN_INFO ""
+#define pr_emerg(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+#define pr_err(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+#define pr_warn(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+#define pr_info(fmt, ...) do { if (0) printf(fmt, ##__VA_ARGS__); } while (0)
+#define pr_debug(fmt, ...) do { if (0) printf(fmt, ##__VA_ARGS__); } while (0)
+#define WARN_ON(x) (!!(x))
+#define BUG() abort()
+#define BUG_ON(x) do { if (x) abort(); } while (0)
+
+/* Modules */
+#define EXPORT_SYMBOL(sym)
+#define EXPORT_SYMBOL_GPL(sym)
+#define THIS_MODULE NULL
+
+/* Lists */
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+static inline void INIT_LIST_HEAD(struct list_head *list)
+{
+	list->next = list;
+	list->prev = list;
+}
+
+static inline void list_add(struct list_head *entry, struct list_head *head)
+{
+	entry->next = head->next;
+	entry->prev = head;
+	head->next->prev = entry;
+	head->next = entry;
+}
+
+static inline void list_del(struct list_head *entry)
+{
+	entry->next->prev = entry->prev;
+	entry->prev->next = entry->next;
+	entry->next = entry->prev = NULL;
+}
+
+static inline int list_empty(const struct list_head *head)
+{
+	return head->next == head;
+}
+
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_for_each_entry(pos, head, member)				\
+	for (pos = list_entry((head)->next, typeof(*pos), member);	\
+	     &pos->member != (head);					\
+	     pos = list_entry(pos->member.next, typeof(*pos), member))
+#define list_for_each_entry_safe(pos, n, head, member)			\
+	for (pos = list_entry((head)->next, typeof(*pos), member),	\
+	     n = list_entry(pos->member.next, typeof(*pos), member);	\
+	     &pos->member != (head);					\
+	     pos = n, n = list_entry(n->member.next, typeof(*n), member))
+
+/* Locking, atomics and scheduling: the benchmark is single threaded */
+struct mutex {
+	int locked;
+};
+
+#define DEFINE_MUTEX(name) struct mutex name = { 0 }
+
+static inline int mutex_trylock(struct mutex *lock)
+{
+	return lock->locked ? 0 : (lock->locked = 1);
+}
+
+static inline void mutex_lock(struct mutex *lock)
+{
+	lock->locked = 1;
+}
+
+static inline void mutex_unlock(struct mutex *lock)
+{
+	lock->locked = 0;
+}
+
+#define atomic_long_set(v, i) ((v)->counter = (i))
+#define atomic_long_inc_return(v) (++(v)->counter)
+#define cond_resched() do { } while (0)
+#define preempt_disable() do { } while (0)
+#define preempt_enable() do { } while (0)
+#define smp_processor_id() 0
+#define num_online_cpus() 1U
+#define for_each_online_cpu(cpu) for ((cpu) = 0; (cpu) < 1; (cpu)++)
+#define udelay(us) do { } while (0)
+
+struct work_struct;
+typedef void (*work_func_t)(struct work_struct *work);
+int schedule_on_each_cpu(work_func_t func);
+void smp_call_function(void (*func)(void *info), void *info, int wait);
+void migrate_to_reboot_cpu(void);
+void cpu_hotplug_enable(void);
+void machine_shutdown(void);
+
+/* Power management, only used by a kexec jump */
+typedef struct pm_message { int event; } pm_message_t;
+#define PMSG_FREEZE ((struct pm_message){ .event = 1 })
+#define PMSG_RESTORE ((struct pm_message){ .event = 2 })
+#define local_irq_disable() do { } while (0)
+#define local_irq_enable() do { } while (0)
+
+int freeze_processes(void);
+void thaw_processes(void);
+void suspend_console(void);
+void resume_console(void);
+int freeze_secondary_cpus(int primary);
+int dpm_suspend_start(pm_message_t state);
+int dpm_suspend_end(pm_message_t state);
+void dpm_resume_start(pm_message_t state);
+void dpm_resume_end(pm_message_t state);
+int syscore_suspend(void);
+void syscore_resume(void);
+
+/* Time */
+u64 ktime_get_ns(void);
+
+/* Memory model, see shim.c */
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+#define PAGE_MASK (~(PAGE_SIZE - 1))
+#define PAGE_ALIGN(addr) (((addr) + PAGE_SIZE - 1) & PAGE_MASK)
+
+#define GFP_KERNEL 0x01U
+#define GFP_HIGHUSER 0x02U
+#define __GFP_NORETRY 0x04U
+#define __GFP_ZERO 0x08U
+#define __GFP_HIGHMEM 0x10U
+
+struct page {
+	struct list_head lru;
+	unsigned long private;
+	void *mapping;
+	unsigned int in_use:1;
+	unsigned int reserved:1;
+};
+
+extern unsigned long totalram_pages;
+
+struct page *alloc_pages(gfp_t gfp_mask, unsigned int order);
+void __free_pages(struct page *page, unsigned int order);
+unsigned long page_to_pfn(struct page *page);
+struct page *pfn_to_page(unsigned long pfn);
+void *page_address(struct page *page);
+void *phys_to_virt(phys_addr_t phys);
+phys_addr_t virt_to_phys(void *addr);
+void *kmap(struct page *page);
+
+#define __pa(addr) virt_to_phys((void *)(addr))
+#define kunmap(page) do { } while (0)
+#define PageHighMem(page) 0
+#define SetPageReserved(page) ((page)->reserved = 1)
+#define ClearPageReserved(page) ((page)->reserved = 0)
+#define set_page_private(page, v) ((page)->private = (v))
+#define page_private(page) ((page)->private)
+#define clear_page(addr) memset((addr), 0, PAGE_SIZE)
+#define clear_highpage(page) do { } while (0)
+#define copy_highpage(to, from) do { } while (0)
+#define get_order(size) \
+	((size) <= PAGE_SIZE ? 0 : 64 - __builtin_clzl(((size) - 1) >> PAGE_SHIFT))
+
+static inline void *kzalloc(size_t size, gfp_t flags)
+{
+	return calloc(1, size);
+}
+
+static inline void kfree(const void *ptr)
+{
+	free((void *)ptr);
+}
+
+static inline unsigned long copy_from_user(void *to, const void __user *from,
+					   unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+static inline unsigned long copy_to_user(void __user *to, const void *from,
+					 unsigned long n)
+{
+	memcpy(to, from, n);
+	return 0;
+}
+
+/* Resources */
+#define IORESOURCE_SYSTEM_RAM 0x01000200UL
+#define IORESOURCE_BUSY 0x80000000UL
+
+struct resource {
+	phys_addr_t start;
+	phys_addr_t end;
+	const char *name;
+	unsigned long flags;
+};
+
+struct pt_regs;
+
+/* Tracepoints compile to nothing */
+#define TP_PROTO(args...) args
+#define TP_ARGS(args...) args
+#define TRACE_EVENT(name, proto, args, tstruct, assign, print) \
+	static inline void trace_##name(proto) { }
+
+/* uapi/linux/kexec.h, with room for more segments than the real ABI */
+#define KEXEC_ON_CRASH 0x00000001
+#define KEXEC_PRESERVE_CONTEXT 0x00000002
+#define KEXEC_ARCH_MASK 0xffff0000
+#define KEXEC_ARCH_DEFAULT (0 << 16)
+#define KEXEC_FILE_UNLOAD 0x00000001
+#define KEXEC_FILE_ON_CRASH 0x00000002
+#define KEXEC_FILE_NO_INITRAMFS 0x00000004
+#ifndef KEXEC_SEGMENT_MAX
+#define KEXEC_SEGMENT_MAX 16
+#endif
+
+/* crypto/sha.h */
+#define SHA256_DIGEST_SIZE 32
+
+/* asm/kexec.h */
+#define KEXEC_SOURCE_MEMORY_LIMIT (-1UL)
+#define KEXEC_DESTINATION_MEMORY_LIMIT (-1UL)
+#define KEXEC_CONTROL_MEMORY_LIMIT (-1UL)
+#define KEXEC_CONTROL_PAGE_SIZE 4096
+#define KEXEC_ARCH (183 << 16)
+
+#endif /* KEXEC_BENCH_SHIM_H */
@@ -18,6 +18,7 @@
 #include <linux/vmalloc.h>
 #include <linux/slab.h>
 
+#include "kexec_compat.h"
 #include "kexec.h"
 #include "kexec_internal.h"
 
@@ -40,15 +41,84 @@ static int copy_user_segment_list(struct kimage *image,
 	return ret;
 }
 
+/* A device tree for the module to build, see sys_kexec_load_fdt() */
+struct kexec_fdt_build {
+	struct kexec_fdt_request req;
+	char *cmdline;
+	void *fdt;
+	size_t size;
+};
+
+/*
+ * Build the device tree described by @fb and add a segment for it, which is
+ * filled in by kimage_write_fdt() once the other segments are loaded. It goes
+ * right after the last segment unless asked otherwise.
+ */
+static int kimage_add_fdt(struct kimage *image, struct kexec_fdt_build *fb)
+{
+	struct kexec_segment *segment;
+	unsigned long mem = fb->req.mem, i;
+
+	if (image->nr_segments >= KEXEC_SEGMENT_MAX)
+		return -EINVAL;
+
+	fb->fdt = kexec_fdt_create(image, fb->cmdline, fb->req.initrd_start,
+				   fb->req.initrd_size, &fb->size);
+	if (IS_ERR(fb->fdt)) {
+		int ret = PTR_ERR(fb->fdt);
+
+		fb->fdt = NULL;
+		return ret;
+	}
+
+	for (i = 0; !fb->req.mem && i < image->nr_segments; i++)
+		mem = max(mem, PAGE_ALIGN(image->segment[i].mem +
+					  image->segment[i].memsz));
+
+	/* Leave room for the preserved ranges */
+	segment = &image->segment[image->nr_segments++];
+	segment->buf = NULL;
+	segment->bufsz = 0;
+	segment->mem = mem;
+	segment->memsz = PAGE_ALIGN(fb->size + kexec_preserved_nr *
+				    sizeof(struct kexec_preserved_range));
+	return 0;
+}
+
+static int kimage_write_fdt(struct kimage *image, struct kexec_fdt_build *fb)
+{
+	struct kexec_segment *segment;
+	int ret;
+
+	segment = &image->segment[image->nr_segments - 1];
+	ret = kimage_segment_rw(image, segment, fb->fdt, 0, fb->size, true);
+	if (!ret)
+		segment->bufsz = fb->size;
+	return ret;
+}
+
 static int kimage_alloc_init(struct kimage **rimage, unsigned long entry,
 			     unsigned long nr_segments,
 			     struct kexec_segment __user
 
 				     *segments,
-			     unsigned long flags)
+			     unsigned long flags, struct kexec_fdt_build *fb)
 {
 	int ret;
 	struct kimage *image;
+	bool kexec_on_panic = flags & KEXEC_ON_CRASH;
+	u64 start_ns;
+
+	if (kexec_on_panic) {
+		/* Without a reserved region there is nowhere to load to */
+		if (!kexec_crash_res.end)
+			return -EADDRNOTAVAIL;
+
+		/* Verify we have a valid entry point */
+		if ((entry < phys_to_boot_phys(kexec_crash_res.start)) ||
+		    (entry > phys_to_boot_phys(kexec_crash_res.end)))
+			return -EADDRNOTAVAIL;
+	}
 
 	/* Allocate and initialize a controlling structure */
 	image = do_kimage_alloc_init();
@@ -57,19 +127,34 @@ static int kimage_alloc_init(struct kimage **rimage, unsigned long entry,
 
 	image->start = entry;
 
+	if (kexec_on_panic) {
+		/* Enable special crash kernel control page alloc policy. */
+		image->control_page = kexec_crash_res.start;
+		image->type = KEXEC_TYPE_CRASH;
+	}
+
+	start_ns = kimage_phase_begin(image, KEXEC_PHASE_VALIDATE);
 	ret = copy_user_segment_list(image, nr_segments, segments);
 	if (ret)
 		goto out_free_image;
 
+	if (fb) {
+		ret = kimage_add_fdt(image, fb);
+		if (ret)
+			goto out_free_image;
+	}
+
 	ret = sanity_check_segment_list(image);
 	if (ret)
 		goto out_free_image;
+	kimage_phase_end(image, KEXEC_PHASE_VALIDATE, start_ns);
 
 	/*
  	 * Find a location for the control code buffer, and add it
 	 * the vector of segments so that it's pages will also be
  	 * counted as destination pages.
  	 */
+	start_ns = kimage_phase_begin(image, KEXEC_PHASE_CONTROL);
 	ret = -ENOMEM;
 	image->control_code_page = kimage_alloc_control_pages(
 		image, get_order(KEXEC_CONTROL_PAGE_SIZE));
@@ -78,11 +163,14 @@ static int kimage_alloc_init(struct kimage **rimage, unsigned long entry,
 		goto out_free_image;
 	}
 
-	image->swap_page = kimage_alloc_control_pages(image, 0);
-	if (!image->swap_page) {
-		pr_err("Could not allocate swap buffer\n");
-		goto out_free_control_pages;
+	if (!kexec_on_panic) {
+		image->swap_page = kimage_alloc_control_pages(image, 0);
+		if (!image->swap_page) {
+			pr_err("Could not allocate swap buffer\n");
+			goto out_free_control_pages;
+		}
 	}
+	kimage_phase_end(image, KEXEC_PHASE_CONTROL, start_ns);
 
 	*rimage = image;
 	return 0;
@@ -97,13 +185,18 @@ static int do_kexec_load(unsigned long entry, unsigned long nr_segments,
 			 struct kexec_segment __user
 
 				 *segments,
-			 unsigned long flags)
+			 unsigned long flags, unsigned int slot,
+			 struct kexec_fdt_build *fb)
 {
 	struct kimage **dest_image, *image;
 	unsigned long i;
+	u64 start_ns;
 	int ret;
 
-	dest_image = &kexec_image;
+	if (flags & KEXEC_ON_CRASH)
+		dest_image = &kexec_crash_image;
+	else
+		dest_image = &kexec_slots[slot];
 
 	if (nr_segments == 0) {
 		/* Uninstall image */
@@ -111,26 +204,61 @@ static int do_kexec_load(unsigned long entry, unsigned long nr_segments,
 
 		return 0;
 	}	
+	if (flags & KEXEC_ON_CRASH) {
+		/*
+		 * Loading another kernel to switch to if this one
+		 * crashes.  Free any current crash dump kernel before
+		 * we corrupt it.
+		 */
+		kimage_free(xchg(&kexec_crash_image, NULL));
+	}
 
-	ret = kimage_alloc_init(&image, entry, nr_segments, segments, flags);
+	ret = kimage_alloc_init(&image, entry, nr_segments, segments, flags,
+				fb);
 	if (ret)
 		return ret;
 
 	if (flags & KEXEC_PRESERVE_CONTEXT)
 		image->preserve_context = 1;
+	image->verify = !!kexec_verify;
 
+	start_ns = kimage_phase_begin(image, KEXEC_PHASE_CONTROL);
 	ret = machine_kexec_prepare(image);
 	if (ret)
 		goto out;
+	kimage_phase_end(image, KEXEC_PHASE_CONTROL, start_ns);
 
-	for (i = 0; i < nr_segments; i++) {
+	for (i = 0; i < image->nr_segments; i++) {
 		ret = kimage_load_segment(image, &image->segment[i]);
 		if (ret)
 			goto out;
 	}
 
+	if (fb) {
+		ret = kimage_write_fdt(image, fb);
+		if (ret)
+			goto out;
+	}
+
 	kimage_terminate(image);
 
+	/* Reserve the preserved ranges in the new kernel's device tree */
+	ret = kexec_preserve_publish(image);
+	if (ret)
+		goto out;
+
+	/* Hand a crash kernel our ELF core header */
+	ret = kexec_crash_publish(image);
+	if (ret)
+		goto out;
+
+	/* Digest the segments last, once nothing changes them anymore */
+	start_ns = kimage_phase_begin(image, KEXEC_PHASE_DIGEST);
+	ret = kimage_digest_segments(image);
+	if (ret)
+		goto out;
+	kimage_phase_end(image, KEXEC_PHASE_DIGEST, start_ns);
+
 	/* Install the new kernel and uninstall the old */
 	image = xchg(dest_image, image);
 
@@ -139,6 +267,55 @@ out:
 	return ret;
 }
 
+/*
+ * Report what loading an image would cost, without copying its data or
+ * installing it. The pages are counted from the segments, unless the plan
+ * asks for KEXEC_PLAN_ALLOC: then they are placed like do_kexec_load() would,
+ * which allocates as much memory as the load itself until the image is freed.
+ */
+static int do_kexec_plan(unsigned long entry, unsigned long nr_segments,
+			 struct kexec_segment __user *segments,
+			 unsigned long flags, struct kexec_plan *plan)
+{
+	u64 plan_flags = plan->flags;
+	struct kimage *image;
+	unsigned long i;
+	int ret;
+
+	if (nr_segments == 0)
+		return -EINVAL;
+
+	ret = kimage_alloc_init(&image, entry, nr_segments, segments, flags,
+				NULL);
+	if (ret)
+		return ret;
+
+	image->dry_run = 1;
+
+	ret = machine_kexec_prepare(image);
+	if (ret)
+		goto out;
+
+	if (!(plan_flags & KEXEC_PLAN_ALLOC)) {
+		kimage_plan_count(image, plan);
+		goto out;
+	}
+
+	for (i = 0; i < nr_segments; i++) {
+		ret = kimage_load_segment(image, &image->segment[i]);
+		if (ret)
+			goto out;
+	}
+
+	kimage_terminate(image);
+	kimage_plan(image, plan);
+
+out:
+	plan->flags = plan_flags;
+	kimage_free(image);
+	return ret;
+}
+
 /*
  * Exec Kernel system call: for obvious reasons only root may call it.
  *
@@ -189,9 +366,10 @@ static inline int kexec_load_check(unsigned long nr_segments,
 	return 0;
 }
 
-long sys_kexec_load(unsigned long entry, unsigned long nr_segments,
-		    struct kexec_segment __user *segments,
-		    unsigned long flags)
+static long __kexec_load(unsigned long entry, unsigned long nr_segments,
+			 struct kexec_segment __user *segments,
+			 unsigned long flags, unsigned int slot,
+			 struct kexec_fdt_build *fb)
 {
 	int result;
 
@@ -199,6 +377,17 @@ long sys_kexec_load(unsigned long entry, unsigned long nr_segments,
 	if (result)
 		return result;
 
+	/* A crash kernel has its own slot */
+	if (slot >= KEXEC_SLOT_MAX ||
+	    (slot && (flags & KEXEC_ON_CRASH)))
+		return -EINVAL;
+
+	/* A crash kernel never comes back */
+	if ((flags & KEXEC_PRESERVE_CONTEXT) && (flags & KEXEC_ON_CRASH))
+		return -EINVAL;
+	if ((flags & KEXEC_PRESERVE_CONTEXT) && !kexec_compat_jump_available())
+		return -EOPNOTSUPP;
+
 	/* Verify we are on the appropriate architecture */
 	if (((flags & KEXEC_ARCH_MASK) != KEXEC_ARCH) &&
 	    ((flags & KEXEC_ARCH_MASK) != KEXEC_ARCH_DEFAULT))
@@ -215,9 +404,95 @@ long sys_kexec_load(unsigned long entry, unsigned long nr_segments,
 	if (!mutex_trylock(&kexec_mutex))
 		return -EBUSY;
 
-	result = do_kexec_load(entry, nr_segments, segments, flags);
+	result = do_kexec_load(entry, nr_segments, segments, flags, slot, fb);
 
 	mutex_unlock(&kexec_mutex);
 
 	return result;
 }
+
+long sys_kexec_load(unsigned long entry, unsigned long nr_segments,
+		    struct kexec_segment __user *segments,
+		    unsigned long flags, unsigned int slot)
+{
+	return __kexec_load(entry, nr_segments, segments, flags, slot, NULL);
+}
+
+/*
+ * kexec_load with the device tree built by the module, from the one the
+ * running kernel booted with and /chosen as given in @ureq. It is added as
+ * the last segment, after those in @segments.
+ */
+long sys_kexec_load_fdt(unsigned long entry, unsigned long nr_segments,
+			struct kexec_segment __user *segments,
+			unsigned long flags, unsigned int slot,
+			const struct kexec_fdt_request __user *ureq)
+{
+	struct kexec_fdt_build fb = { };
+	long result;
+
+	if (!nr_segments)
+		return __kexec_load(entry, 0, segments, flags, slot, NULL);
+
+	if (!kexec_compat_fdt_available())
+		return -EOPNOTSUPP;
+
+	if (copy_from_user(&fb.req, ureq, sizeof(fb.req)))
+		return -EFAULT;
+
+	if (!PAGE_ALIGNED(fb.req.mem) || fb.req.cmdline_len > PAGE_SIZE)
+		return -EINVAL;
+
+	if (fb.req.cmdline_len) {
+		fb.cmdline = memdup_user(fb.req.cmdline, fb.req.cmdline_len);
+		if (IS_ERR(fb.cmdline))
+			return PTR_ERR(fb.cmdline);
+		if (fb.cmdline[fb.req.cmdline_len - 1] != '\0') {
+			kfree(fb.cmdline);
+			return -EINVAL;
+		}
+	}
+
+	result = __kexec_load(entry, nr_segments, segments, flags, slot, &fb);
+
+	kvfree(fb.fdt);
+	kfree(fb.cmdline);
+	return result;
+}
+
+/*
+ * Dry run of kexec_load: checks the segments and estimates the cost of the
+ * load, see do_kexec_plan(), then returns it to user space.
+ */
+long sys_kexec_plan(unsigned long entry, unsigned long nr_segments,
+		    struct kexec_segment __user *segments,
+		    unsigned long flags, struct kexec_plan __user *uplan)
+{
+	struct kexec_plan plan;
+	int result;
+
+	result = kexec_load_check(nr_segments, flags);
+	if (result)
+		return result;
+
+	if (((flags & KEXEC_ARCH_MASK) != KEXEC_ARCH) &&
+	    ((flags & KEXEC_ARCH_MASK) != KEXEC_ARCH_DEFAULT))
+		return -EINVAL;
+
+	if (copy_from_user(&plan.flags, &uplan->flags, sizeof(plan.flags)))
+		return -EFAULT;
+	if (plan.flags & ~KEXEC_PLAN_ALLOC)
+		return -EINVAL;
+
+	if (!mutex_trylock(&kexec_mutex))
+		return -EBUSY;
+
+	result = do_kexec_plan(entry, nr_segments, segments, flags, &plan);
+
+	mutex_unlock(&kexec_mutex);
+
+	if (!result && copy_to_user(uplan, &plan, sizeof(plan)))
+		result = -EFAULT;
+
+	return result;
+}
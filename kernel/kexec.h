@@ -24,7 +24,11 @@
 #include <linux/compat.h>
 #include <linux/ioport.h>
 #include <linux/module.h>
+#include <linux/timekeeping.h>
 #include <asm/kexec.h>
+#include <crypto/sha.h>
+
+#include "kexec_ioctl.h"
 
 /* Verify architecture specific macros are defined */
 
@@ -44,6 +48,10 @@
 #define KEXEC_CONTROL_MEMORY_GFP (GFP_KERNEL | __GFP_NORETRY)
 #endif
 
+#ifndef KEXEC_CRASH_CONTROL_MEMORY_LIMIT
+#define KEXEC_CRASH_CONTROL_MEMORY_LIMIT KEXEC_CONTROL_MEMORY_LIMIT
+#endif
+
 #ifndef KEXEC_CONTROL_PAGE_SIZE
 #error KEXEC_CONTROL_PAGE_SIZE not defined
 #endif
@@ -77,6 +85,53 @@ struct kexec_segment {
 	size_t memsz;
 };
 
+/*
+ * Phases of loading and executing an image, in the order they happen. The
+ * load phases are timed by kexec_load, the exec phases by kernel_kexec() and
+ * machine_kexec().
+ */
+enum kexec_phase {
+	KEXEC_PHASE_VALIDATE,
+	KEXEC_PHASE_ALLOC,
+	KEXEC_PHASE_COPY,
+	KEXEC_PHASE_CONTROL,
+	KEXEC_PHASE_DIGEST,
+	KEXEC_PHASE_RESTART_PREPARE,
+	KEXEC_PHASE_CPU_TEARDOWN,
+	KEXEC_PHASE_CPU_PARK,
+	KEXEC_PHASE_MACHINE_SHUTDOWN,
+	KEXEC_PHASE_LIST_FLUSH,
+	KEXEC_PHASE_HANDOFF,
+	KEXEC_PHASE_NR,
+};
+
+struct kexec_phase_time {
+	/* ktime_get_ns() at the first time the phase was entered */
+	u64 start_ns;
+	/* Total time spent in the phase */
+	u64 duration_ns;
+};
+
+/* Allocator and relocation counters of a single load. */
+struct kexec_load_stats {
+	/* Pages taken from the page allocator for the image */
+	unsigned long pages_allocated;
+	/* Allocated pages that turned out to be another page's destination */
+	unsigned long dest_collisions;
+	/* Source pages moved out of the way of their destination */
+	unsigned long swaps;
+	/* Pages parked on dest_pages until their own data comes along */
+	unsigned long dest_pages;
+	/* Pages parked on unusable_pages, above the source memory limit */
+	unsigned long unusable_pages;
+	/* Control page allocations rejected for overlapping a destination */
+	unsigned long control_retries;
+	/* Pages holding the entry list */
+	unsigned long indirection_pages;
+	/* Source pages that are their own destination */
+	unsigned long in_place_pages;
+};
+
 struct kimage {
 	kimage_entry_t head;
 	kimage_entry_t *entry;
@@ -97,27 +152,89 @@ struct kimage {
 	unsigned long control_page;
 
 	/* Flags to indicate special processing */
+	unsigned int type : 1;
+#define KEXEC_TYPE_DEFAULT 0
+#define KEXEC_TYPE_CRASH   1
 	unsigned int preserve_context : 1;
 	/* If set, we are using file mode kexec syscall */
 	unsigned int file_mode:1;
+	/* If set, the source pages have already been cleaned to PoC */
+	unsigned int sources_flushed:1;
+	/* If set, the segments are only placed, not copied */
+	unsigned int dry_run:1;
+	/*
+	 * If set, the segments are digested at the end of the load and
+	 * checked against digest before entry. Set before
+	 * machine_kexec_prepare(), so that it can refuse what it cannot check.
+	 */
+	unsigned int verify:1;
+
+	/* SHA-256 of each segment as loaded, see kimage_digest_segments() */
+	u8 digest[KEXEC_SEGMENT_MAX][SHA256_DIGEST_SIZE];
+
+	struct kexec_phase_time phases[KEXEC_PHASE_NR];
+	struct kexec_load_stats stats;
 
 #ifdef ARCH_HAS_KIMAGE_ARCH
 	struct kimage_arch arch;
 #endif
 };
 
+/* Number of images that can be staged at once, see kexec_slots */
+#define KEXEC_SLOT_MAX 8
+
 long sys_kexec_load(unsigned long entry, unsigned long nr_segments,
 		    struct kexec_segment __user *segments,
-		    unsigned long flags);
+		    unsigned long flags, unsigned int slot);
+long sys_kexec_plan(unsigned long entry, unsigned long nr_segments,
+		    struct kexec_segment __user *segments,
+		    unsigned long flags, struct kexec_plan __user *uplan);
+
+long sys_kexec_load_fdt(unsigned long entry, unsigned long nr_segments,
+			struct kexec_segment __user *segments,
+			unsigned long flags, unsigned int slot,
+			const struct kexec_fdt_request __user *ureq);
+
+long sys_kexec_file_load(int kernel_fd, int initrd_fd,
+			 unsigned long cmdline_len,
+			 const char __user *cmdline_ptr,
+			 unsigned long flags, unsigned int slot);
+
+/*
+ * Where a kernel image wants to be placed, as found by
+ * machine_kexec_image_probe() in its header.
+ */
+struct kexec_image_layout {
+	/* Alignment of the base the image is placed relative to */
+	unsigned long align;
+	/* Offset of the image from that base */
+	unsigned long offset;
+	/* Memory the image occupies once running, including its bss */
+	unsigned long memsz;
+	/* Entry point, relative to the start of the image */
+	unsigned long entry;
+};
+
+long sys_kexec_preserve(unsigned long addr, unsigned long size,
+			unsigned long flags);
 
 /* kexec interface functions */
 extern void machine_kexec(struct kimage *image);
 extern int machine_kexec_prepare(struct kimage *image);
+extern int machine_kexec_image_probe(const void *kernel, unsigned long len,
+				     struct kexec_image_layout *layout);
 extern void machine_kexec_cleanup(struct kimage *image);
-extern int kernel_kexec(void);
+extern void machine_kexec_flush(void *addr, size_t len);
+extern bool machine_kexec_can_park(unsigned int cpu);
+extern void machine_kexec_park_cpu(void *info);
+extern void machine_kexec_unpark_cpus(unsigned int nr_cpus);
+extern void machine_crash_shutdown(struct pt_regs *regs);
+extern int kernel_kexec(unsigned int slot);
 extern struct page *kimage_alloc_control_pages(struct kimage *image,
 					       unsigned int order);
-extern struct kimage *kexec_image;
+extern struct kimage *kexec_slots[KEXEC_SLOT_MAX];
+extern struct kimage *kexec_crash_image;
+extern struct resource kexec_crash_res;
 extern int kexec_load_disabled;
 
 #ifndef kexec_flush_icache_page
@@ -125,7 +242,7 @@ extern int kexec_load_disabled;
 #endif
 
 /* List of defined/legal kexec flags */
-#define KEXEC_FLAGS    KEXEC_ON_CRASH
+#define KEXEC_FLAGS    (KEXEC_ON_CRASH | KEXEC_PRESERVE_CONTEXT)
 
 /* List of defined/legal kexec file flags */
 #define KEXEC_FILE_FLAGS	(KEXEC_FILE_UNLOAD | KEXEC_FILE_ON_CRASH | \
@@ -172,6 +289,78 @@ static inline void *boot_phys_to_virt(unsigned long entry)
 	return phys_to_virt(boot_phys_to_phys(entry));
 }
 
+static inline const char *kexec_phase_name(enum kexec_phase phase)
+{
+	switch (phase) {
+	case KEXEC_PHASE_VALIDATE:		return "validate";
+	case KEXEC_PHASE_ALLOC:			return "alloc";
+	case KEXEC_PHASE_COPY:			return "copy";
+	case KEXEC_PHASE_CONTROL:		return "control";
+	case KEXEC_PHASE_DIGEST:		return "digest";
+	case KEXEC_PHASE_RESTART_PREPARE:	return "restart_prepare";
+	case KEXEC_PHASE_CPU_TEARDOWN:		return "cpu_teardown";
+	case KEXEC_PHASE_CPU_PARK:		return "cpu_park";
+	case KEXEC_PHASE_MACHINE_SHUTDOWN:	return "machine_shutdown";
+	case KEXEC_PHASE_LIST_FLUSH:		return "list_flush";
+	case KEXEC_PHASE_HANDOFF:		return "handoff";
+	default:				return "unknown";
+	}
+}
+
+/*
+ * Enter @phase of @image. Returns the timestamp to pass to kimage_phase_end().
+ * A phase may be entered several times, its durations add up.
+ */
+static inline u64 kimage_phase_begin(struct kimage *image,
+				     enum kexec_phase phase)
+{
+	u64 now = ktime_get_ns();
+
+	if (!image->phases[phase].start_ns)
+		image->phases[phase].start_ns = now;
+	return now;
+}
+
+static inline void kimage_phase_end(struct kimage *image,
+				    enum kexec_phase phase, u64 start_ns)
+{
+	image->phases[phase].duration_ns += ktime_get_ns() - start_ns;
+}
+
+/*
+ * Add @duration_ns to @phase of @image at once, for phases that are timed in
+ * many small pieces. @start_ns is when the first piece began.
+ */
+static inline void kimage_phase_add(struct kimage *image,
+				    enum kexec_phase phase, u64 start_ns,
+				    u64 duration_ns)
+{
+	if (!image->phases[phase].start_ns)
+		image->phases[phase].start_ns = start_ns;
+	image->phases[phase].duration_ns += duration_ns;
+}
+
+/*
+ * Print the exec phases of @image, relative to the start of the first one.
+ * Used right before leaving the kernel, when nothing can read sysfs anymore.
+ */
+static inline void kimage_phase_print(struct kimage *image)
+{
+	u64 base = image->phases[KEXEC_PHASE_RESTART_PREPARE].start_ns;
+	int phase;
+
+	for (phase = KEXEC_PHASE_RESTART_PREPARE; phase < KEXEC_PHASE_NR;
+	     phase++) {
+		struct kexec_phase_time *time = &image->phases[phase];
+
+		if (!time->start_ns)
+			continue;
+		pr_info("%-16s +%llu us %llu us\n", kexec_phase_name(phase),
+			div_u64(time->start_ns - base, NSEC_PER_USEC),
+			div_u64(time->duration_ns, NSEC_PER_USEC));
+	}
+}
+
 #ifndef arch_kexec_post_alloc_pages
 static inline int arch_kexec_post_alloc_pages(void *vaddr, unsigned int pages, gfp_t gfp) { return 0; }
 #endif
@@ -0,0 +1,291 @@
+/*
+ * kexec_bench: Benchmark of the kexec load path on real hardware.
+ *
+ * Loads synthetic images through the kimage code of kexec_mod, without
+ * installing them, and reports the cost per page of allocation, copy,
+ * cache maintenance and teardown. The benchmark runs when the module is
+ * inserted; the results end up in the kernel log.
+ *
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define MODULE_NAME "kexec_bench"
+#define pr_fmt(fmt) MODULE_NAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/ioport.h>
+#include <linux/mm.h>
+#include <linux/random.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "kexec.h"
+#include "kexec_internal.h"
+
+MODULE_LICENSE("GPL v2");
+MODULE_AUTHOR("Fabian Mastenbroek <mail.fabianm@gmail.com>");
+MODULE_DESCRIPTION("Benchmark of the kexec load path");
+MODULE_VERSION("1.1");
+
+static unsigned int size_mb = 32;
+module_param(size_mb, uint, 0);
+MODULE_PARM_DESC(size_mb, "Size of the synthetic image in MiB (default = 32)");
+
+static unsigned int segments = 1;
+module_param(segments, uint, 0);
+MODULE_PARM_DESC(segments,
+		 "Number of segments the image is split in (default = 1)");
+
+static char *pattern = "contiguous";
+module_param(pattern, charp, 0);
+MODULE_PARM_DESC(pattern,
+		 "Placement of the segments: contiguous, sparse or shuffled (default = contiguous)");
+
+static unsigned long dest;
+module_param(dest, ulong, 0);
+MODULE_PARM_DESC(dest,
+		 "Physical address of the image (default = start of System RAM)");
+
+static unsigned int pressure_mb;
+module_param(pressure_mb, uint, 0);
+MODULE_PARM_DESC(pressure_mb,
+		 "Memory to hold on to during the benchmark, in MiB (default = 0)");
+
+static int fragment = 1;
+module_param(fragment, int, 0);
+MODULE_PARM_DESC(fragment,
+		 "Release every other page of the held memory (default = 1)");
+
+static unsigned int iterations = 5;
+module_param(iterations, uint, 0);
+MODULE_PARM_DESC(iterations, "Number of loads to average over (default = 5)");
+
+struct kexec_bench_result {
+	u64 alloc_ns;
+	u64 copy_ns;
+	u64 flush_ns;
+	u64 free_ns;
+	unsigned long pages;
+	struct kexec_load_stats stats;
+};
+
+/* Pages held to put the page allocator under pressure */
+static LIST_HEAD(kexec_bench_held);
+
+static void kexec_bench_pressure(void)
+{
+	unsigned long nr_pages = (unsigned long)pressure_mb << (20 - PAGE_SHIFT);
+	unsigned long i, held = 0;
+	struct page *page;
+
+	for (i = 0; i < nr_pages; i++) {
+		page = alloc_page(GFP_KERNEL | __GFP_NORETRY | __GFP_NOWARN);
+		if (!page)
+			break;
+
+		/* Give back every other page, to leave only isolated holes. */
+		if (fragment && (i & 1)) {
+			__free_page(page);
+			continue;
+		}
+
+		list_add(&page->lru, &kexec_bench_held);
+		held++;
+	}
+
+	pr_info("Holding %lu pages\n", held);
+}
+
+static void kexec_bench_release(void)
+{
+	struct page *page, *next;
+
+	list_for_each_entry_safe(page, next, &kexec_bench_held, lru) {
+		list_del(&page->lru);
+		__free_page(page);
+	}
+}
+
+/*
+ * Find the start of the first System RAM range, which is where a kernel
+ * image normally ends up.
+ */
+static unsigned long kexec_bench_default_dest(void)
+{
+	struct resource *res;
+
+	for (res = iomem_resource.child; res; res = res->sibling) {
+		if (!strcmp(res->name, "System RAM"))
+			return ALIGN(res->start, SZ_2M);
+	}
+
+	return 0;
+}
+
+/*
+ * Lay out the segments of the image at @base according to the pattern. Each
+ * segment reads from @buf.
+ */
+static int kexec_bench_layout(struct kimage *image, unsigned long base,
+			      void *buf, unsigned long seg_size)
+{
+	unsigned int order[KEXEC_SEGMENT_MAX];
+	unsigned long stride = seg_size;
+	unsigned int i;
+
+	if (!strcmp(pattern, "sparse"))
+		stride = 2 * seg_size;
+	else if (strcmp(pattern, "contiguous") && strcmp(pattern, "shuffled"))
+		return -EINVAL;
+
+	for (i = 0; i < segments; i++)
+		order[i] = i;
+	if (!strcmp(pattern, "shuffled")) {
+		for (i = segments - 1; i > 0; i--)
+			swap(order[i], order[prandom_u32() % (i + 1)]);
+	}
+
+	image->nr_segments = segments;
+	for (i = 0; i < segments; i++) {
+		struct kexec_segment *segment = &image->segment[i];
+
+		segment->kbuf = buf;
+		segment->bufsz = seg_size;
+		segment->mem = base + order[i] * stride;
+		segment->memsz = seg_size;
+	}
+
+	return 0;
+}
+
+static void kexec_bench_flush(struct kimage *image)
+{
+	kimage_entry_t *ptr, entry;
+
+	for (ptr = &image->head; (entry = *ptr) && !(entry & IND_DONE);
+	     ptr = (entry & IND_INDIRECTION) ?
+		   boot_phys_to_virt(entry & PAGE_MASK) : ptr + 1) {
+		if (entry & IND_SOURCE)
+			machine_kexec_flush(boot_phys_to_virt(entry & PAGE_MASK),
+					    PAGE_SIZE);
+	}
+}
+
+static int kexec_bench_run(unsigned long base, void *buf,
+			   unsigned long seg_size,
+			   struct kexec_bench_result *result)
+{
+	struct kimage *image;
+	unsigned int i;
+	u64 start_ns;
+	int ret;
+
+	image = do_kimage_alloc_init();
+	if (!image)
+		return -ENOMEM;
+
+	/* The source buffer lives in kernel memory, like for kexec_file_load */
+	image->file_mode = 1;
+
+	ret = kexec_bench_layout(image, base, buf, seg_size);
+	if (ret)
+		goto out;
+
+	ret = sanity_check_segment_list(image);
+	if (ret)
+		goto out;
+
+	ret = -ENOMEM;
+	image->control_code_page = kimage_alloc_control_pages(image,
+				get_order(KEXEC_CONTROL_PAGE_SIZE));
+	if (!image->control_code_page)
+		goto out;
+
+	for (i = 0; i < image->nr_segments; i++) {
+		ret = kimage_load_segment(image, &image->segment[i]);
+		if (ret)
+			goto out;
+	}
+	kimage_terminate(image);
+
+	start_ns = ktime_get_ns();
+	kexec_bench_flush(image);
+	result->flush_ns += ktime_get_ns() - start_ns;
+
+	result->alloc_ns += image->phases[KEXEC_PHASE_ALLOC].duration_ns;
+	result->copy_ns += image->phases[KEXEC_PHASE_COPY].duration_ns;
+	result->pages += segments * (seg_size >> PAGE_SHIFT);
+	result->stats = image->stats;
+
+out:
+	start_ns = ktime_get_ns();
+	kimage_free(image);
+	if (!ret)
+		result->free_ns += ktime_get_ns() - start_ns;
+	return ret;
+}
+
+static int __init
+kexec_bench_init(void)
+{
+	struct kexec_bench_result result = {};
+	unsigned long seg_size, base;
+	unsigned int i;
+	void *buf;
+	int ret = 0;
+
+	if (!segments || segments > KEXEC_SEGMENT_MAX || !iterations)
+		return -EINVAL;
+
+	seg_size = PAGE_ALIGN(((unsigned long)size_mb << 20) / segments);
+	base = dest ? dest : kexec_bench_default_dest();
+	if (!seg_size || !base || !PAGE_ALIGNED(base))
+		return -EINVAL;
+
+	buf = vmalloc(seg_size);
+	if (!buf)
+		return -ENOMEM;
+	memset(buf, 0x5a, seg_size);
+
+	kexec_bench_pressure();
+
+	for (i = 0; i < iterations && !ret; i++)
+		ret = kexec_bench_run(base, buf, seg_size, &result);
+
+	kexec_bench_release();
+	vfree(buf);
+
+	if (ret) {
+		pr_err("Failed to load image: %d\n", ret);
+		return ret;
+	}
+
+	pr_info("%u MiB in %u %s segments at %#lx, %u iterations\n",
+		size_mb, segments, pattern, base, iterations);
+	pr_info("  alloc: %llu ns/page\n", div_u64(result.alloc_ns, result.pages));
+	pr_info("  copy:  %llu ns/page\n", div_u64(result.copy_ns, result.pages));
+	pr_info("  flush: %llu ns/page\n", div_u64(result.flush_ns, result.pages));
+	pr_info("  free:  %llu ns/page\n", div_u64(result.free_ns, result.pages));
+	pr_info("  %lu collisions, %lu swaps, %lu in place, %lu parked\n",
+		result.stats.dest_collisions, result.stats.swaps,
+		result.stats.in_place_pages,
+		result.stats.dest_pages + result.stats.unusable_pages);
+
+	return 0;
+}
+
+module_init(kexec_bench_init)
+
+static void __exit
+kexec_bench_exit(void)
+{
+}
+
+module_exit(kexec_bench_exit);
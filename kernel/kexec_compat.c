@@ -17,8 +17,15 @@
 #include <linux/kexec.h>
 #include <linux/kallsyms.h>
 #include <linux/slab.h>
+#include <linux/device.h>
+#include <linux/kmod.h>
+#include <linux/notifier.h>
+#include <linux/freezer.h>
+#include <linux/console.h>
+#include <linux/cpu.h>
+#include <linux/ioport.h>
+#include <linux/libfdt.h>
 #include <asm/uaccess.h>
-#include <asm/virt.h>
 
 #include "kexec_compat.h"
 
@@ -29,6 +36,41 @@ static void (*kernel_restart_prepare_ptr)(char*);
 static void (*migrate_to_reboot_cpu_ptr)(void);
 static void (*cpu_hotplug_enable_ptr)(void);
 
+/* These kernel symbols are only needed by the kexec-specific shutdown path,
+ * which falls back to kernel_restart_prepare when they cannot be found */
+static struct kset **devices_kset_ptr;
+static struct blocking_notifier_head *reboot_notifier_list_ptr;
+static int (*__usermodehelper_disable_ptr)(enum umh_disable_depth);
+static void (*device_block_probing_ptr)(void);
+static void (*device_shutdown_ptr)(void);
+
+/* Only available with CONFIG_CRASH_CORE, for the ELF core header */
+static phys_addr_t (*paddr_vmcoreinfo_note_ptr)(void);
+
+/* Only needed for the ELF core header, which is refused without it */
+static int (*walk_system_ram_res_ptr)(u64, u64, void *,
+				      int (*)(struct resource *, void *));
+
+/* Only needed for a kexec jump, which is refused when they cannot be found.
+ * enable_nonboot_cpus was renamed to thaw_secondary_cpus in Linux 5.10 */
+static int (*freeze_processes_ptr)(void);
+static void (*thaw_processes_ptr)(void);
+static void (*suspend_console_ptr)(void);
+static void (*resume_console_ptr)(void);
+static int (*freeze_secondary_cpus_ptr)(int);
+static void (*enable_nonboot_cpus_ptr)(void);
+
+/* Only needed to build the device tree for kexec_file_load, which is refused
+ * when they cannot be found. The libfdt of the kernel is not exported */
+static void **initial_boot_params_ptr;
+static int (*fdt_open_into_ptr)(const void *, void *, int);
+static int (*fdt_pack_ptr)(void *);
+static int (*fdt_path_offset_ptr)(const void *, const char *);
+static int (*fdt_add_subnode_ptr)(void *, int, const char *);
+static const void *(*fdt_getprop_ptr)(const void *, int, const char *, int *);
+static int (*fdt_setprop_ptr)(void *, int, const char *, const void *, int);
+static int (*fdt_delprop_ptr)(void *, int, const char *);
+
 void machine_shutdown(void)
 {
 	machine_shutdown_ptr();
@@ -49,6 +91,146 @@ void cpu_hotplug_enable(void)
 	cpu_hotplug_enable_ptr();
 }
 
+int __usermodehelper_disable(enum umh_disable_depth depth)
+{
+	return __usermodehelper_disable_ptr(depth);
+}
+
+void device_block_probing(void)
+{
+	device_block_probing_ptr();
+}
+
+void device_shutdown(void)
+{
+	device_shutdown_ptr();
+}
+
+bool kexec_compat_shutdown_available(void)
+{
+	return devices_kset_ptr && reboot_notifier_list_ptr
+	       && __usermodehelper_disable_ptr && device_block_probing_ptr
+	       && device_shutdown_ptr;
+}
+
+phys_addr_t paddr_vmcoreinfo_note(void)
+{
+	return paddr_vmcoreinfo_note_ptr();
+}
+
+bool kexec_compat_vmcoreinfo_available(void)
+{
+	return paddr_vmcoreinfo_note_ptr;
+}
+
+int walk_system_ram_res(u64 start, u64 end, void *arg,
+			int (*func)(struct resource *, void *))
+{
+	return walk_system_ram_res_ptr(start, end, arg, func);
+}
+
+bool kexec_compat_ram_walk_available(void)
+{
+	return walk_system_ram_res_ptr;
+}
+
+int freeze_processes(void)
+{
+	return freeze_processes_ptr();
+}
+
+void thaw_processes(void)
+{
+	thaw_processes_ptr();
+}
+
+void suspend_console(void)
+{
+	suspend_console_ptr();
+}
+
+void resume_console(void)
+{
+	resume_console_ptr();
+}
+
+int freeze_secondary_cpus(int primary)
+{
+	return freeze_secondary_cpus_ptr(primary);
+}
+
+void enable_nonboot_cpus(void)
+{
+	enable_nonboot_cpus_ptr();
+}
+
+bool kexec_compat_jump_available(void)
+{
+	return freeze_processes_ptr && thaw_processes_ptr
+	       && suspend_console_ptr && resume_console_ptr
+	       && freeze_secondary_cpus_ptr && enable_nonboot_cpus_ptr;
+}
+
+void *kexec_compat_boot_fdt(void)
+{
+	return *initial_boot_params_ptr;
+}
+
+int fdt_open_into(const void *fdt, void *buf, int bufsize)
+{
+	return fdt_open_into_ptr(fdt, buf, bufsize);
+}
+
+int fdt_pack(void *fdt)
+{
+	return fdt_pack_ptr(fdt);
+}
+
+int fdt_path_offset(const void *fdt, const char *path)
+{
+	return fdt_path_offset_ptr(fdt, path);
+}
+
+int fdt_add_subnode(void *fdt, int parentoffset, const char *name)
+{
+	return fdt_add_subnode_ptr(fdt, parentoffset, name);
+}
+
+const void *fdt_getprop(const void *fdt, int nodeoffset, const char *name,
+			int *lenp)
+{
+	return fdt_getprop_ptr(fdt, nodeoffset, name, lenp);
+}
+
+int fdt_setprop(void *fdt, int nodeoffset, const char *name, const void *val,
+		int len)
+{
+	return fdt_setprop_ptr(fdt, nodeoffset, name, val, len);
+}
+
+int fdt_delprop(void *fdt, int nodeoffset, const char *name)
+{
+	return fdt_delprop_ptr(fdt, nodeoffset, name);
+}
+
+bool kexec_compat_fdt_available(void)
+{
+	return initial_boot_params_ptr && *initial_boot_params_ptr
+	       && fdt_open_into_ptr && fdt_pack_ptr && fdt_path_offset_ptr
+	       && fdt_add_subnode_ptr && fdt_getprop_ptr && fdt_setprop_ptr
+	       && fdt_delprop_ptr;
+}
+
+struct kset *kexec_compat_devices_kset(void)
+{
+	return *devices_kset_ptr;
+}
+
+struct blocking_notifier_head *kexec_compat_reboot_notifier_list(void)
+{
+	return reboot_notifier_list_ptr;
+}
+
 static void *ksym(const char *name)
 {
 	return (void *)kallsyms_lookup_name(name);
@@ -61,6 +243,39 @@ int kexec_compat_load()
 	    || !(kernel_restart_prepare_ptr = ksym("kernel_restart_prepare"))
 	    || !(cpu_hotplug_enable_ptr = ksym("cpu_hotplug_enable")))
 		return -ENOENT;
+
+	/* Data symbols can only be found with CONFIG_KALLSYMS_ALL */
+	devices_kset_ptr = ksym("devices_kset");
+	reboot_notifier_list_ptr = ksym("reboot_notifier_list");
+	__usermodehelper_disable_ptr = ksym("__usermodehelper_disable");
+	device_block_probing_ptr = ksym("device_block_probing");
+	device_shutdown_ptr = ksym("device_shutdown");
+	if (!kexec_compat_shutdown_available())
+		pr_info("Kexec-specific device shutdown not available.\n");
+
+	paddr_vmcoreinfo_note_ptr = ksym("paddr_vmcoreinfo_note");
+	walk_system_ram_res_ptr = ksym("walk_system_ram_res");
+
+	freeze_processes_ptr = ksym("freeze_processes");
+	thaw_processes_ptr = ksym("thaw_processes");
+	suspend_console_ptr = ksym("suspend_console");
+	resume_console_ptr = ksym("resume_console");
+	freeze_secondary_cpus_ptr = ksym("freeze_secondary_cpus");
+	if (!(enable_nonboot_cpus_ptr = ksym("enable_nonboot_cpus")))
+		enable_nonboot_cpus_ptr = ksym("thaw_secondary_cpus");
+	if (!kexec_compat_jump_available())
+		pr_info("Kexec jump not available.\n");
+
+	initial_boot_params_ptr = ksym("initial_boot_params");
+	fdt_open_into_ptr = ksym("fdt_open_into");
+	fdt_pack_ptr = ksym("fdt_pack");
+	fdt_path_offset_ptr = ksym("fdt_path_offset");
+	fdt_add_subnode_ptr = ksym("fdt_add_subnode");
+	fdt_getprop_ptr = ksym("fdt_getprop");
+	fdt_setprop_ptr = ksym("fdt_setprop");
+	fdt_delprop_ptr = ksym("fdt_delprop");
+	if (!kexec_compat_fdt_available())
+		pr_info("Loading from files not available.\n");
 	return 0;
 }
 
@@ -13,6 +13,11 @@
 #ifndef LINUX_KEXEC_COMPAT_H
 #define LINUX_KEXEC_COMPAT_H
 
+#include <linux/types.h>
+
+struct kset;
+struct blocking_notifier_head;
+
 /**
  * Load the kexec compatibility layer.
  */
@@ -23,4 +28,63 @@ int kexec_compat_load(void);
  */
 void kexec_compat_unload(void);
 
+/**
+ * Determine whether the symbols needed by the kexec-specific shutdown path
+ * could be resolved.
+ */
+bool kexec_compat_shutdown_available(void);
+
+/**
+ * Determine whether the vmcoreinfo note of the kernel could be found.
+ */
+bool kexec_compat_vmcoreinfo_available(void);
+
+/**
+ * Obtain the physical address of the vmcoreinfo note (crash_core.h).
+ */
+phys_addr_t paddr_vmcoreinfo_note(void);
+
+/**
+ * Determine whether walk_system_ram_res() could be found.
+ */
+bool kexec_compat_ram_walk_available(void);
+
+/**
+ * Determine whether the symbols needed to freeze and thaw the system around a
+ * kexec jump could be resolved.
+ */
+bool kexec_compat_jump_available(void);
+
+/**
+ * Bring the secondary CPUs back online after freeze_secondary_cpus()
+ * (linux/cpu.h, called thaw_secondary_cpus since Linux 5.10).
+ */
+void enable_nonboot_cpus(void);
+
+/**
+ * Determine whether the device tree this kernel booted with and the libfdt
+ * functions needed to patch a copy of it could be found.
+ */
+bool kexec_compat_fdt_available(void);
+
+/**
+ * Obtain the flattened device tree this kernel booted with.
+ */
+void *kexec_compat_boot_fdt(void);
+
+/**
+ * Obtain the kset containing all devices in the system.
+ */
+struct kset *kexec_compat_devices_kset(void);
+
+/**
+ * Obtain the notifier chain invoked when the system reboots.
+ */
+struct blocking_notifier_head *kexec_compat_reboot_notifier_list(void);
+
+/**
+ * Prevent new devices from being probed (drivers/base/base.h).
+ */
+void device_block_probing(void);
+
 #endif /* LINUX_KEXEC_COMPAT_H */
@@ -38,6 +38,8 @@
 #include <linux/compiler.h>
 #include <linux/hugetlb.h>
 #include <linux/frame.h>
+#include <linux/workqueue.h>
+#include <linux/delay.h>
 
 #include <asm/page.h>
 #include <asm/sections.h>
@@ -45,9 +47,13 @@
 #include <crypto/hash.h>
 #include <crypto/sha.h>
 
+#include "kexec_compat.h"
 #include "kexec.h"
 #include "kexec_internal.h"
 
+#define CREATE_TRACE_POINTS
+#include "kexec_trace.h"
+
 DEFINE_MUTEX(kexec_mutex);
 
 /* Flag to indicate we are going to kexec a new kernel */
@@ -156,6 +162,28 @@ int sanity_check_segment_list(struct kimage *image)
 		       if ((mend > pstart) && (mstart < pend))
 			       return -EINVAL;
 	       }
+
+	       /* Do not load over memory the next kernel inherits */
+	       if (image->type == KEXEC_TYPE_DEFAULT &&
+		   kexec_preserve_overlaps(mstart, mend))
+		       return -EBUSY;
+       }
+
+       /* Verify our destination addresses fall inside the reserved
+	* crash kernel region, which is the only memory we load a
+	* crash kernel into.
+	*/
+       if (image->type == KEXEC_TYPE_CRASH) {
+	       for (i = 0; i < nr_segments; i++) {
+		       unsigned long mstart, mend;
+
+		       mstart = image->segment[i].mem;
+		       mend = mstart + image->segment[i].memsz - 1;
+		       /* Ensure we are within the crash kernel limits */
+		       if ((mstart < phys_to_boot_phys(kexec_crash_res.start)) ||
+			   (mend > phys_to_boot_phys(kexec_crash_res.end)))
+			       return -EADDRNOTAVAIL;
+	       }
        }
 
        /* Ensure our buffer sizes are strictly less than
@@ -185,6 +213,7 @@ int sanity_check_segment_list(struct kimage *image)
 
        return 0;
 }
+EXPORT_SYMBOL_GPL(sanity_check_segment_list);
 
 struct kimage *do_kimage_alloc_init(void)
 {
@@ -211,6 +240,7 @@ struct kimage *do_kimage_alloc_init(void)
 
        return image;
 }
+EXPORT_SYMBOL_GPL(do_kimage_alloc_init);
 
 int kimage_is_destination_range(struct kimage *image,
 			       unsigned long start,
@@ -279,8 +309,8 @@ void kimage_free_page_list(struct list_head *list)
        }
 }
 
-struct page *kimage_alloc_control_pages(struct kimage *image,
-					unsigned int order)
+static struct page *kimage_alloc_normal_control_pages(struct kimage *image,
+						      unsigned int order)
 {
        /* Control pages are special, they are the intermediaries
 	* that are needed while we copy the rest of the pages
@@ -297,7 +327,7 @@ struct page *kimage_alloc_control_pages(struct kimage *image,
 	*/
        struct list_head extra_pages;
        struct page *pages;
-       unsigned int count;
+       unsigned int count, retries = 0;
 
        count = 1 << order;
        INIT_LIST_HEAD(&extra_pages);
@@ -316,12 +346,18 @@ struct page *kimage_alloc_control_pages(struct kimage *image,
 	       addr  = pfn << PAGE_SHIFT;
 	       eaddr = epfn << PAGE_SHIFT;
 	       if ((epfn >= (KEXEC_CONTROL_MEMORY_LIMIT >> PAGE_SHIFT)) ||
-		   kimage_is_destination_range(image, addr, eaddr)) {
+		   kimage_is_destination_range(image, addr, eaddr) ||
+		   kexec_preserve_overlaps(addr, eaddr)) {
 		       list_add(&pages->lru, &extra_pages);
 		       pages = NULL;
+		       retries++;
 	       }
        } while (!pages);
 
+       image->stats.control_retries += retries;
+       trace_kexec_alloc_control_pages(order,
+	       pages ? page_to_boot_pfn(pages) << PAGE_SHIFT : 0, retries);
+
        if (pages) {
 	       /* Remember the allocated page... */
 	       list_add(&pages->lru, &image->control_pages);
@@ -345,6 +381,85 @@ struct page *kimage_alloc_control_pages(struct kimage *image,
        return pages;
 }
 
+static struct page *kimage_alloc_crash_control_pages(struct kimage *image,
+						     unsigned int order)
+{
+       /* Control pages are special, they are the intermediaries
+	* that are needed while we copy the rest of the pages
+	* to their final resting place.  As such they must
+	* not conflict with either the destination addresses
+	* or memory the kernel is already using.
+	*
+	* Control pages are also the only pages we must allocate
+	* when loading a crash kernel.  All of the other pages
+	* are specified by the segments and we just memcpy
+	* into them directly.
+	*
+	* Given the low demand this implements a very simple
+	* allocator that finds the first hole of the appropriate
+	* size in the reserved memory region, and allocates all
+	* of the memory up to and including the hole.
+	*/
+       unsigned long hole_start, hole_end, size;
+       struct page *pages;
+
+       pages = NULL;
+       size = (1 << order) << PAGE_SHIFT;
+       hole_start = (image->control_page + (size - 1)) & ~(size - 1);
+       hole_end   = hole_start + size - 1;
+       while (hole_end <= kexec_crash_res.end) {
+	       unsigned long i;
+
+	       cond_resched();
+
+	       if (hole_end > KEXEC_CRASH_CONTROL_MEMORY_LIMIT)
+		       break;
+	       /* See if I overlap any of the segments */
+	       for (i = 0; i < image->nr_segments; i++) {
+		       unsigned long mstart, mend;
+
+		       mstart = image->segment[i].mem;
+		       mend   = mstart + image->segment[i].memsz - 1;
+		       if ((hole_end >= mstart) && (hole_start <= mend)) {
+			       /* Advance the hole to the end of the segment */
+			       hole_start = (mend + (size - 1)) & ~(size - 1);
+			       hole_end   = hole_start + size - 1;
+			       image->stats.control_retries++;
+			       break;
+		       }
+	       }
+	       /* If I don't overlap any segments I have found my hole! */
+	       if (i == image->nr_segments) {
+		       pages = pfn_to_page(hole_start >> PAGE_SHIFT);
+		       image->control_page = hole_end;
+		       break;
+	       }
+       }
+
+       trace_kexec_alloc_control_pages(order, pages ? hole_start : 0,
+				       image->stats.control_retries);
+
+       return pages;
+}
+
+struct page *kimage_alloc_control_pages(struct kimage *image,
+					unsigned int order)
+{
+       struct page *pages = NULL;
+
+       switch (image->type) {
+       case KEXEC_TYPE_DEFAULT:
+	       pages = kimage_alloc_normal_control_pages(image, order);
+	       break;
+       case KEXEC_TYPE_CRASH:
+	       pages = kimage_alloc_crash_control_pages(image, order);
+	       break;
+       }
+
+       return pages;
+}
+EXPORT_SYMBOL_GPL(kimage_alloc_control_pages);
+
 static int kimage_add_entry(struct kimage *image, kimage_entry_t entry)
 {
        if (*image->entry != 0)
@@ -357,6 +472,7 @@ static int kimage_add_entry(struct kimage *image, kimage_entry_t entry)
 	       page = kimage_alloc_page(image, GFP_KERNEL, KIMAGE_NO_DEST);
 	       if (!page)
 		       return -ENOMEM;
+	       image->stats.indirection_pages++;
 
 	       ind_page = page_address(page);
 	       *image->entry = virt_to_boot_phys(ind_page) | IND_INDIRECTION;
@@ -409,12 +525,79 @@ void kimage_terminate(struct kimage *image)
 	       image->entry++;
 
        *image->entry = IND_DONE;
+
+       trace_kexec_load_stats(&image->stats);
+}
+EXPORT_SYMBOL_GPL(kimage_terminate);
+
+/*
+ * Summarize what loading @image costs and what executing it will move, for a
+ * dry run of kexec_load.
+ */
+void kimage_plan(struct kimage *image, struct kexec_plan *plan)
+{
+       kimage_entry_t *ptr, entry;
+       unsigned long dest = 0;
+       struct page *page;
+
+       memset(plan, 0, sizeof(*plan));
+
+       for_each_kimage_entry(image, ptr, entry) {
+	       if (entry & IND_DESTINATION) {
+		       dest = entry & PAGE_MASK;
+	       } else if (entry & IND_SOURCE) {
+		       plan->flush_bytes += PAGE_SIZE;
+		       if ((entry & PAGE_MASK) != dest)
+			       plan->relocate_bytes += PAGE_SIZE;
+		       dest += PAGE_SIZE;
+	       }
+       }
+
+       list_for_each_entry(page, &image->control_pages, lru)
+	       plan->staging_bytes += PAGE_SIZE << page_private(page);
+       plan->staging_bytes += image->stats.pages_allocated * PAGE_SIZE;
+
+       plan->collisions = image->stats.dest_collisions;
+       plan->swaps = image->stats.swaps;
+       plan->parked_pages = image->stats.dest_pages +
+			    image->stats.unusable_pages;
+       plan->control_retries = image->stats.control_retries;
+       plan->indirection_pages = image->stats.indirection_pages;
 }
 
-#define for_each_kimage_entry(image, ptr, entry) \
-       for (ptr = &image->head; (entry = *ptr) && !(entry & IND_DONE); \
-	       ptr = (entry & IND_INDIRECTION) ? \
-		       boot_phys_to_virt((entry & PAGE_MASK)) : ptr + 1)
+/*
+ * Estimate what loading @image costs from its segments alone, without the
+ * allocation pass. Every destination page of a normal image takes a source
+ * page, which the stub relocates unless the allocator happens to return the
+ * destination itself, so the relocated bytes are an upper bound. A crash
+ * image is loaded in place and only holds its control pages.
+ */
+void kimage_plan_count(struct kimage *image, struct kexec_plan *plan)
+{
+       unsigned long per_page = PAGE_SIZE / sizeof(kimage_entry_t) - 1;
+       unsigned long i, pages = 0, entries = 0;
+       struct page *page;
+
+       memset(plan, 0, sizeof(*plan));
+
+       list_for_each_entry(page, &image->control_pages, lru)
+	       plan->staging_bytes += PAGE_SIZE << page_private(page);
+
+       if (image->type == KEXEC_TYPE_CRASH)
+	       return;
+
+       /* One destination entry per segment and a source entry per page */
+       for (i = 0; i < image->nr_segments; i++) {
+	       pages += PAGE_ALIGN(image->segment[i].memsz) >> PAGE_SHIFT;
+	       entries++;
+       }
+       entries += pages;
+
+       plan->indirection_pages = DIV_ROUND_UP(entries, per_page);
+       plan->staging_bytes += (pages + plan->indirection_pages) * PAGE_SIZE;
+       plan->relocate_bytes = pages * PAGE_SIZE;
+       plan->flush_bytes = pages * PAGE_SIZE;
+}
 
 static void kimage_free_entry(kimage_entry_t entry)
 {
@@ -464,6 +647,7 @@ void kimage_free(struct kimage *image)
 
        kfree(image);
 }
+EXPORT_SYMBOL_GPL(kimage_free);
 
 static kimage_entry_t *kimage_dst_used(struct kimage *image,
 				      unsigned long page)
@@ -528,14 +712,23 @@ static struct page *kimage_alloc_page(struct kimage *image,
 	       page = kimage_alloc_pages(gfp_mask, 0);
 	       if (!page)
 		       return NULL;
+	       image->stats.pages_allocated++;
 	       /* If the page cannot be used file it away */
 	       if (page_to_boot_pfn(page) >
 		   (KEXEC_SOURCE_MEMORY_LIMIT >> PAGE_SHIFT)) {
 		       list_add(&page->lru, &image->unusable_pages);
+		       image->stats.unusable_pages++;
 		       continue;
 	       }
 	       addr = page_to_boot_pfn(page) << PAGE_SHIFT;
 
+	       /* Nor can a page the next kernel inherits */
+	       if (kexec_preserve_overlaps(addr, addr + PAGE_SIZE)) {
+		       list_add(&page->lru, &image->unusable_pages);
+		       image->stats.unusable_pages++;
+		       continue;
+	       }
+
 	       /* If it is the destination page we want use it */
 	       if (addr == destination)
 		       break;
@@ -550,6 +743,7 @@ static struct page *kimage_alloc_page(struct kimage *image,
 		* See if there is already a source page for this
 		* destination page.  And if so swap the source pages.
 		*/
+	       image->stats.dest_collisions++;
 	       old = kimage_dst_used(image, addr);
 	       if (old) {
 		       /* If so move it */
@@ -565,6 +759,7 @@ static struct page *kimage_alloc_page(struct kimage *image,
 			* destination page, so return it if it's
 			* gfp_flags honor the ones passed in.
 			*/
+		       image->stats.swaps++;
 		       if (!(gfp_mask & __GFP_HIGHMEM) &&
 			   PageHighMem(old_page)) {
 			       kimage_free_pages(old_page);
@@ -576,16 +771,18 @@ static struct page *kimage_alloc_page(struct kimage *image,
 	       }
 	       /* Place the page on the destination list, to be used later */
 	       list_add(&page->lru, &image->dest_pages);
+	       image->stats.dest_pages++;
        }
 
        return page;
 }
 
-int kimage_load_segment(struct kimage *image,
-			struct kexec_segment *segment)
+static int kimage_load_normal_segment(struct kimage *image,
+				      struct kexec_segment *segment)
 {
-       unsigned long maddr;
+       unsigned long maddr, addr;
        size_t ubytes, mbytes;
+       u64 start_ns, alloc_start_ns, alloc_ns = 0;
        int result;
        unsigned char __user *buf = NULL;
        unsigned char *kbuf = NULL;
@@ -599,6 +796,12 @@ int kimage_load_segment(struct kimage *image,
        mbytes = segment->memsz;
        maddr = segment->mem;
 
+       /*
+	* The allocations are timed per page, but only accounted once per
+	* segment. What is left of the segment is copying.
+	*/
+       start_ns = ktime_get_ns();
+
        result = kimage_set_destination(image, maddr);
        if (result < 0)
 	       goto out;
@@ -608,6 +811,7 @@ int kimage_load_segment(struct kimage *image,
 	       char *ptr;
 	       size_t uchunk, mchunk;
 
+	       alloc_start_ns = ktime_get_ns();
 	       page = kimage_alloc_page(image, GFP_HIGHUSER, maddr);
 	       if (!page) {
 		       result  = -ENOMEM;
@@ -617,21 +821,112 @@ int kimage_load_segment(struct kimage *image,
 						       << PAGE_SHIFT);
 	       if (result < 0)
 		       goto out;
+	       alloc_ns += ktime_get_ns() - alloc_start_ns;
+
+	       addr = page_to_boot_pfn(page) << PAGE_SHIFT;
+	       if (addr == (maddr & PAGE_MASK))
+		       image->stats.in_place_pages++;
+	       trace_kexec_alloc_page(maddr & PAGE_MASK, addr);
 
-	       ptr = kmap(page);
-	       /* Start with a clear page */
-	       clear_page(ptr);
-	       ptr += maddr & ~PAGE_MASK;
 	       mchunk = min_t(size_t, mbytes,
 			      PAGE_SIZE - (maddr & ~PAGE_MASK));
 	       uchunk = min(ubytes, mchunk);
 
-	       /* For file based kexec, source pages are in kernel memory */
+	       /* A dry run only places the pages, it does not fill them */
+	       if (!image->dry_run) {
+		       ptr = kmap(page);
+		       /* Start with a clear page */
+		       clear_page(ptr);
+		       ptr += maddr & ~PAGE_MASK;
+
+		       /* For file based kexec, sources are in kernel memory */
+		       if (image->file_mode)
+			       memcpy(ptr, kbuf, uchunk);
+		       else
+			       result = copy_from_user(ptr, buf, uchunk);
+		       kunmap(page);
+	       }
+	       if (result) {
+		       result = -EFAULT;
+		       goto out;
+	       }
+	       ubytes -= uchunk;
+	       maddr  += mchunk;
 	       if (image->file_mode)
-		       memcpy(ptr, kbuf, uchunk);
+		       kbuf += mchunk;
 	       else
-		       result = copy_from_user(ptr, buf, uchunk);
-	       kunmap(page);
+		       buf += mchunk;
+	       mbytes -= mchunk;
+
+	       cond_resched();
+       }
+out:
+       kimage_phase_add(image, KEXEC_PHASE_ALLOC, start_ns, alloc_ns);
+       if (!image->dry_run)
+	       kimage_phase_add(image, KEXEC_PHASE_COPY, start_ns,
+				ktime_get_ns() - start_ns - alloc_ns);
+       return result;
+}
+
+static int kimage_load_crash_segment(struct kimage *image,
+				     struct kexec_segment *segment)
+{
+       /* For crash dumps kernels we simply copy the data from
+	* user space to it's destination.
+	* We do things a page at a time for the sake of kmap.
+	*/
+       unsigned long maddr;
+       size_t ubytes, mbytes;
+       u64 start_ns;
+       int result;
+       unsigned char __user *buf = NULL;
+       unsigned char *kbuf = NULL;
+
+       result = 0;
+       if (image->file_mode)
+	       kbuf = segment->kbuf;
+       else
+	       buf = segment->buf;
+       ubytes = segment->bufsz;
+       mbytes = segment->memsz;
+       maddr = segment->mem;
+       start_ns = ktime_get_ns();
+       while (mbytes) {
+	       struct page *page;
+	       char *ptr;
+	       size_t uchunk, mchunk;
+
+	       page = boot_pfn_to_page(maddr >> PAGE_SHIFT);
+	       if (!page) {
+		       result  = -ENOMEM;
+		       goto out;
+	       }
+	       mchunk = min_t(size_t, mbytes,
+			      PAGE_SIZE - (maddr & ~PAGE_MASK));
+	       uchunk = min(ubytes, mchunk);
+
+	       /* A dry run only checks the segments, it does not fill them */
+	       if (!image->dry_run) {
+		       ptr = kmap(page);
+		       ptr += maddr & ~PAGE_MASK;
+		       if (mchunk > uchunk) {
+			       /* Zero the trailing part of the page */
+			       memset(ptr + uchunk, 0, mchunk - uchunk);
+		       }
+
+		       /* For file based kexec, sources are in kernel memory */
+		       if (image->file_mode)
+			       memcpy(ptr, kbuf, uchunk);
+		       else
+			       result = copy_from_user(ptr, buf, uchunk);
+
+		       /*
+			* The data is already in place, so clean it to PoC
+			* now rather than on the panic path.
+			*/
+		       machine_kexec_flush(ptr, mchunk);
+		       kunmap(page);
+	       }
 	       if (result) {
 		       result = -EFAULT;
 		       goto out;
@@ -647,30 +942,251 @@ int kimage_load_segment(struct kimage *image,
 	       cond_resched();
        }
 out:
+       if (!image->dry_run)
+	       kimage_phase_add(image, KEXEC_PHASE_COPY, start_ns,
+				ktime_get_ns() - start_ns);
        return result;
 }
 
-struct kimage *kexec_image;
+int kimage_load_segment(struct kimage *image,
+			struct kexec_segment *segment)
+{
+       int result = -ENOMEM;
+
+       switch (image->type) {
+       case KEXEC_TYPE_DEFAULT:
+	       result = kimage_load_normal_segment(image, segment);
+	       break;
+       case KEXEC_TYPE_CRASH:
+	       result = kimage_load_crash_segment(image, segment);
+	       break;
+       }
+
+       return result;
+}
+EXPORT_SYMBOL_GPL(kimage_load_segment);
+
+/*
+ * Copy @len bytes at @offset into @segment of a loaded image to @buf, or from
+ * @buf into the image if @write is set. Used to patch staged data after the
+ * fact, such as the device tree.
+ */
+int kimage_segment_rw(struct kimage *image, struct kexec_segment *segment,
+		      void *buf, size_t offset, size_t len, bool write)
+{
+       unsigned long maddr = segment->mem + offset;
+
+       if (offset + len > segment->memsz || image->dry_run)
+	       return -EINVAL;
+
+       while (len) {
+	       kimage_entry_t *ptr;
+	       struct page *page;
+	       size_t chunk;
+	       char *vaddr;
+
+	       /* Crash segments are loaded in place */
+	       if (image->type == KEXEC_TYPE_CRASH) {
+		       page = boot_pfn_to_page(maddr >> PAGE_SHIFT);
+	       } else {
+		       ptr = kimage_dst_used(image, maddr & PAGE_MASK);
+		       if (!ptr)
+			       return -EINVAL;
+		       page = boot_pfn_to_page(*ptr >> PAGE_SHIFT);
+	       }
+
+	       chunk = min_t(size_t, len, PAGE_SIZE - (maddr & ~PAGE_MASK));
+	       vaddr = kmap(page) + (maddr & ~PAGE_MASK);
+	       if (!write) {
+		       memcpy(buf, vaddr, chunk);
+	       } else {
+		       memcpy(vaddr, buf, chunk);
+		       if (image->type == KEXEC_TYPE_CRASH)
+			       machine_kexec_flush(vaddr, chunk);
+	       }
+	       kunmap(page);
+
+	       buf += chunk;
+	       maddr += chunk;
+	       len -= chunk;
+       }
+
+       return 0;
+}
+
+struct kimage *kexec_slots[KEXEC_SLOT_MAX];
+struct kimage *kexec_crash_image;
+
+/* Memory the crash kernel is loaded into, see kexec_crash_init() */
+struct resource kexec_crash_res = {
+       .name  = "Crash kernel",
+       .start = 0,
+       .end   = 0,
+       .flags = IORESOURCE_BUSY | IORESOURCE_SYSTEM_RAM,
+};
 int kexec_load_disabled;
 
+/* Clean the source pages to PoC on all online CPUs before shutdown */
+int kexec_parallel_flush = 1;
+
+/*
+ * Number of source pages a CPU claims at once while cleaning the image in
+ * parallel.  Large enough to amortize the atomic, small enough to balance.
+ */
+#define KIMAGE_FLUSH_BATCH 256
+
+static struct {
+       struct kimage *image;
+       atomic_long_t next;
+} kimage_flush;
+
+static void kimage_flush_sources_work(struct work_struct *work)
+{
+       kimage_entry_t *ptr, entry;
+       unsigned long index = 0;
+       long batch;
+
+       /*
+	* Every CPU walks the whole entry list, but only cleans the batches
+	* of source pages it managed to claim.  Since claims are handed out
+	* in increasing order, a CPU that moved past its batch simply claims
+	* the next free one.
+	*/
+       batch = atomic_long_inc_return(&kimage_flush.next) - 1;
+       for_each_kimage_entry(kimage_flush.image, ptr, entry) {
+	       if (!(entry & IND_SOURCE))
+		       continue;
+
+	       while (index / KIMAGE_FLUSH_BATCH > batch)
+		       batch = atomic_long_inc_return(&kimage_flush.next) - 1;
+
+	       if (index / KIMAGE_FLUSH_BATCH == batch)
+		       machine_kexec_flush(boot_phys_to_virt(entry & PAGE_MASK),
+					   PAGE_SIZE);
+	       if (++index % KIMAGE_FLUSH_BATCH == 0)
+		       cond_resched();
+       }
+}
+
+/*
+ * Clean the source pages of the image to PoC using every online CPU, so
+ * that machine_kexec() only has to flush the entry list and control page
+ * once the secondary CPUs are gone.
+ */
+static void kimage_flush_sources(struct kimage *image)
+{
+       kimage_flush.image = image;
+       atomic_long_set(&kimage_flush.next, 0);
+
+       if (schedule_on_each_cpu(kimage_flush_sources_work))
+	       return;
+
+       image->sources_flushed = 1;
+}
+
+/* Stop the secondary CPUs with a single IPI instead of CPU hotplug */
+int kexec_fast_park = 1;
+
+/*
+ * Park the secondary CPUs through a single IPI, rather than taking each of
+ * them through the CPU hotplug state machine in machine_shutdown().  Returns
+ * false if that did not work out, in which case machine_shutdown() still
+ * has to deal with the CPUs that are left online.
+ */
+static bool kexec_park_secondaries(void)
+{
+       unsigned long timeout = USEC_PER_SEC;
+       unsigned int this_cpu, nr_cpus;
+       int cpu;
+
+       preempt_disable();
+       this_cpu = smp_processor_id();
+       for_each_online_cpu(cpu) {
+	       if (cpu != this_cpu && !machine_kexec_can_park(cpu)) {
+		       preempt_enable();
+		       return false;
+	       }
+       }
+
+       nr_cpus = num_online_cpus() - 1;
+       smp_call_function(machine_kexec_park_cpu, NULL, 0);
+       preempt_enable();
+
+       while (num_online_cpus() > 1 && timeout--)
+	       udelay(1);
+
+       if (num_online_cpus() > 1) {
+	       pr_warn("Failed to park secondary CPUs\n");
+	       machine_kexec_unpark_cpus(nr_cpus);
+	       return false;
+       }
+
+       return true;
+}
+
 /*
- * Move into place and start executing a preloaded standalone
- * executable.  If nothing was preloaded return an error.
+ * Move into place and start executing the standalone executable
+ * preloaded in @slot.  If nothing was preloaded return an error.
+ * An image loaded with KEXEC_PRESERVE_CONTEXT returns here when it is done.
  */
-int kernel_kexec(void)
+int kernel_kexec(unsigned int slot)
 {
+       struct kimage *image;
        int error = 0;
+       bool parked;
+       u64 start_ns;
+
+       if (slot >= KEXEC_SLOT_MAX)
+	       return -EINVAL;
 
        if (!mutex_trylock(&kexec_mutex))
 	       return -EBUSY;
-       if (!kexec_image) {
+       image = kexec_slots[slot];
+       if (!image) {
 	       error = -EINVAL;
 	       goto Unlock;
        }
 
-       {
+       if (image->preserve_context) {
+	       /*
+		* Put the system to sleep as for hibernation, so that it
+		* survives a round-trip through the image.
+		*/
+	       start_ns = kimage_phase_begin(image,
+					     KEXEC_PHASE_RESTART_PREPARE);
+	       error = freeze_processes();
+	       if (error) {
+		       error = -EBUSY;
+		       goto Unlock;
+	       }
+	       suspend_console();
+	       error = dpm_suspend_start(PMSG_FREEZE);
+	       if (error)
+		       goto Resume_console;
+	       error = dpm_suspend_end(PMSG_FREEZE);
+	       if (error)
+		       goto Resume_devices;
+	       error = freeze_secondary_cpus(0);
+	       if (error)
+		       goto Enable_cpus;
+	       local_irq_disable();
+	       error = syscore_suspend();
+	       if (error)
+		       goto Enable_irqs;
+	       kimage_phase_end(image, KEXEC_PHASE_RESTART_PREPARE,
+				start_ns);
+
+	       pr_emerg("Jumping to image in slot %u\n", slot);
+       } else {
 	       kexec_in_progress = true;
-	       kernel_restart_prepare(NULL);
+	       start_ns = kimage_phase_begin(image,
+					     KEXEC_PHASE_RESTART_PREPARE);
+	       kexec_restart_prepare(NULL);
+	       kimage_phase_end(image, KEXEC_PHASE_RESTART_PREPARE,
+				start_ns);
+
+	       start_ns = kimage_phase_begin(image,
+					     KEXEC_PHASE_CPU_TEARDOWN);
 	       migrate_to_reboot_cpu();
 
 	       /*
@@ -680,11 +1196,47 @@ int kernel_kexec(void)
 		* CPU hotplug again; so re-enable it here.
 		*/
 	       cpu_hotplug_enable();
+	       kimage_phase_end(image, KEXEC_PHASE_CPU_TEARDOWN,
+				start_ns);
+
+	       if (kexec_parallel_flush) {
+		       start_ns = kimage_phase_begin(image,
+						     KEXEC_PHASE_LIST_FLUSH);
+		       kimage_flush_sources(image);
+		       kimage_phase_end(image, KEXEC_PHASE_LIST_FLUSH,
+					start_ns);
+	       }
+
 	       pr_emerg("Starting new kernel\n");
-	       machine_shutdown();
+
+	       start_ns = kimage_phase_begin(image, KEXEC_PHASE_CPU_PARK);
+	       parked = kexec_fast_park && kexec_park_secondaries();
+	       kimage_phase_end(image, KEXEC_PHASE_CPU_PARK, start_ns);
+
+	       if (!parked) {
+		       start_ns = kimage_phase_begin(
+			       image, KEXEC_PHASE_MACHINE_SHUTDOWN);
+		       machine_shutdown();
+		       kimage_phase_end(image,
+					KEXEC_PHASE_MACHINE_SHUTDOWN, start_ns);
+	       }
        }
 
-       machine_kexec(kexec_image);
+       machine_kexec(image);
+
+       if (image->preserve_context) {
+	       syscore_resume();
+ Enable_irqs:
+	       local_irq_enable();
+ Enable_cpus:
+	       enable_nonboot_cpus();
+	       dpm_resume_start(PMSG_RESTORE);
+ Resume_devices:
+	       dpm_resume_end(PMSG_RESTORE);
+ Resume_console:
+	       resume_console();
+	       thaw_processes();
+       }
 Unlock:
        mutex_unlock(&kexec_mutex);
        return error;
@@ -0,0 +1,192 @@
+/*
+ * Crash kernel support for kexec_mod: reserves the region the crash kernel
+ * is loaded into and jumps into it when the running kernel panics.
+ *
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/atomic.h>
+#include <linux/ioport.h>
+#include <linux/kernel.h>
+#include <linux/mm.h>
+#include <linux/notifier.h>
+#include <linux/ptrace.h>
+
+#include "kexec.h"
+#include "kexec_internal.h"
+
+/* Physical region to load the crash kernel into */
+unsigned long kexec_crash_base;
+unsigned long kexec_crash_size;
+
+/* Set by the first CPU to enter the crash kernel */
+static atomic_t kexec_crash_running = ATOMIC_INIT(0);
+
+/*
+ * Jump into the crash kernel, if one is loaded.
+ *
+ * Runs on the CPU that panicked, after panic() stopped the other CPUs. No
+ * locks are taken, since the panic may have happened while any of them was
+ * held: the load path only publishes kexec_crash_image once the image is
+ * complete, and unpublishes it before tearing it down.
+ */
+static void kexec_crash(struct pt_regs *regs)
+{
+	struct pt_regs fixed_regs;
+	struct kimage *image;
+
+	if (!READ_ONCE(kexec_crash_image))
+		return;
+	if (atomic_xchg(&kexec_crash_running, 1))
+		return;
+
+	crash_setup_regs(&fixed_regs, regs);
+	kexec_crash_save_cpu(&fixed_regs, smp_processor_id());
+	machine_crash_shutdown(&fixed_regs);
+
+	/* Only this CPU runs now, so the image can no longer change. */
+	kexec_elfcore_copy();
+	image = READ_ONCE(kexec_crash_image);
+	if (image)
+		machine_kexec(image);
+
+	atomic_set(&kexec_crash_running, 0);
+}
+
+static int kexec_crash_panic(struct notifier_block *nb, unsigned long event,
+			     void *data)
+{
+	kexec_crash(NULL);
+	return NOTIFY_DONE;
+}
+
+static struct notifier_block kexec_crash_nb = {
+	.notifier_call = kexec_crash_panic,
+	/* Before anything else gets to poke at the crashed kernel */
+	.priority = INT_MAX,
+};
+
+/*
+ * Check that the crash region is memory the page allocator keeps its hands
+ * off, for instance a reserved-memory node without no-map. We write to it
+ * through the linear map, so it must be covered by struct pages.
+ */
+static bool kexec_crash_region_reserved(unsigned long base, unsigned long size)
+{
+	unsigned long pfn;
+
+	for (pfn = PFN_DOWN(base); pfn < PFN_DOWN(base + size); pfn++) {
+		if (!pfn_valid(pfn) || !PageReserved(pfn_to_page(pfn)))
+			return false;
+	}
+
+	return true;
+}
+
+/**
+ * kexec_crash_init - Claim the crash kernel region and hook into panic.
+ *
+ * The region shows up as "Crash kernel" in /proc/iomem, which is where
+ * kexec-tools looks for it when loading with --load-panic. Its last
+ * KEXEC_ELFCORE_SIZE bytes are kept out of that range, for the ELF core
+ * header.
+ */
+int kexec_crash_init(void)
+{
+	unsigned long base = kexec_crash_base, size = kexec_crash_size;
+	int ret;
+
+	if (!size)
+		return 0;
+
+	if (!PAGE_ALIGNED(base) || !PAGE_ALIGNED(size) || !base) {
+		pr_err("Crash kernel region %#lx+%#lx is not page aligned.\n",
+		       base, size);
+		return -EINVAL;
+	}
+
+	if (size <= 2 * KEXEC_ELFCORE_SIZE) {
+		pr_err("Crash kernel region %#lx+%#lx is too small.\n",
+		       base, size);
+		return -EINVAL;
+	}
+
+	if (!kexec_crash_region_reserved(base, size)) {
+		pr_err("Crash kernel region %#lx+%#lx is not reserved memory.\n",
+		       base, size);
+		return -EINVAL;
+	}
+
+	kexec_crash_res.start = base;
+	kexec_crash_res.end = base + size - KEXEC_ELFCORE_SIZE - 1;
+
+	/*
+	 * Nest the region as deep as it fits, usually in a "reserved" range
+	 * below System RAM, rather than next to what is already there.
+	 */
+	if (insert_resource(&iomem_resource, &kexec_crash_res)) {
+		pr_err("Crash kernel region %#lx+%#lx is in use.\n", base, size);
+		kexec_crash_res.start = kexec_crash_res.end = 0;
+		return -EBUSY;
+	}
+
+	ret = kexec_elfcore_init(kexec_crash_res.end + 1);
+	if (ret) {
+		pr_err("Failed to set up the ELF core header: %d\n", ret);
+		remove_resource(&kexec_crash_res);
+		kexec_crash_res.start = kexec_crash_res.end = 0;
+		return ret;
+	}
+
+	atomic_notifier_chain_register(&panic_notifier_list, &kexec_crash_nb);
+
+	pr_info("Reserved %lu MiB at %#lx for the crash kernel.\n",
+		size >> 20, base);
+	return 0;
+}
+
+void kexec_crash_exit(void)
+{
+	if (!kexec_crash_res.end)
+		return;
+
+	atomic_notifier_chain_unregister(&panic_notifier_list, &kexec_crash_nb);
+	kimage_free(xchg(&kexec_crash_image, NULL));
+	kexec_elfcore_exit();
+
+	remove_resource(&kexec_crash_res);
+	kexec_crash_res.start = kexec_crash_res.end = 0;
+}
+
+/**
+ * kexec_crash_publish - Point a crash kernel to the ELF core header.
+ *
+ * Called with the segments of @image loaded. The header kexec-tools adds
+ * through the device tree takes precedence over elfcorehdr= on the command
+ * line, so the first segment that holds a device tree is pointed to ours
+ * instead. Without a device tree, the crash kernel goes by elfcorehdr=.
+ */
+int kexec_crash_publish(struct kimage *image)
+{
+	unsigned long i;
+	int ret;
+
+	if (image->type != KEXEC_TYPE_CRASH || image->dry_run ||
+	    !kexec_elfcore_addr)
+		return 0;
+
+	for (i = 0; i < image->nr_segments; i++) {
+		ret = kexec_fdt_patch_crash(image, &image->segment[i]);
+		if (ret != -ENOENT)
+			return ret;
+	}
+
+	return 0;
+}
@@ -18,41 +18,274 @@
 #include <linux/sysfs.h>
 #include <linux/device.h>
 #include <linux/reboot.h>
+#include <linux/version.h>
 
 #include <uapi/linux/stat.h>
 
 #include "kexec_compat.h"
 #include "kexec.h"
+#include "kexec_internal.h"
 
 MODULE_LICENSE("GPL v2");
 MODULE_AUTHOR("Fabian Mastenbroek <mail.fabianm@gmail.com>");
 MODULE_DESCRIPTION("Kexec backport as Kernel Module");
 MODULE_VERSION("1.1");
 
+module_param_named(parallel_flush, kexec_parallel_flush, int, 0644);
+MODULE_PARM_DESC(parallel_flush,
+		 "Clean the image to PoC on all CPUs before shutdown (default = 1)");
+
+module_param_named(fast_park, kexec_fast_park, int, 0644);
+MODULE_PARM_DESC(fast_park,
+		 "Park secondary CPUs with an IPI instead of hotplug (default = 1)");
+
+module_param_named(parallel_shutdown, kexec_parallel_shutdown, int, 0644);
+MODULE_PARM_DESC(parallel_shutdown,
+		 "Shut down independent devices in parallel (default = 0)");
+
+module_param_named(shutdown_skip, kexec_shutdown_skip, charp, 0644);
+MODULE_PARM_DESC(shutdown_skip,
+		 "Comma-separated names of devices not to shut down");
+
+module_param_named(shutdown_quiesce, kexec_shutdown_quiesce, charp, 0644);
+MODULE_PARM_DESC(shutdown_quiesce,
+		 "Comma-separated names of devices to only stop DMA for");
+
+module_param_named(profile_shutdown, kexec_profile_shutdown, int, 0644);
+MODULE_PARM_DESC(profile_shutdown,
+		 "Report the slowest reboot notifiers and devices (default = 0)");
+
+module_param_named(verify, kexec_verify, int, 0644);
+MODULE_PARM_DESC(verify,
+		 "Check the segments against SHA-256 digests before entry (default = 0)");
+
+module_param_named(crash_base, kexec_crash_base, ulong, 0444);
+MODULE_PARM_DESC(crash_base,
+		 "Physical address of the reserved region for the crash kernel");
+
+module_param_named(crash_size, kexec_crash_size, ulong, 0444);
+MODULE_PARM_DESC(crash_size,
+		 "Size of the reserved region for the crash kernel (default = 0)");
+
 static ssize_t kexecmod_loaded_show(struct kobject *kobj,
 		  		    struct kobj_attribute *attr, char *buf)
 {
-	extern struct kimage *kexec_image;
-	return sprintf(buf, "%d\n", !!kexec_image);
+	return sprintf(buf, "%d\n", !!kexec_slots[0]);
 }
 
 static struct kobj_attribute kexec_loaded_attr = __ATTR(kexec_loaded, S_IRUGO, kexecmod_loaded_show, NULL);
 
+static ssize_t kexecmod_crash_loaded_show(struct kobject *kobj,
+					  struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%d\n", !!kexec_crash_image);
+}
+
+static struct kobj_attribute kexec_crash_loaded_attr = __ATTR(kexec_crash_loaded, S_IRUGO, kexecmod_crash_loaded_show, NULL);
+
+/*
+ * Phase timings of the image in slot 0, one line per phase that was entered:
+ * name, ktime_get_ns() at start and total duration in nanoseconds. The exec
+ * phases are printed to the kernel log instead, right before the handoff.
+ */
+static ssize_t kexecmod_timings_show(struct kobject *kobj,
+				     struct kobj_attribute *attr, char *buf)
+{
+	struct kimage *image;
+	ssize_t len = 0;
+	int phase;
+
+	mutex_lock(&kexec_mutex);
+	image = kexec_slots[0];
+	for (phase = 0; image && phase < KEXEC_PHASE_NR; phase++) {
+		struct kexec_phase_time *time = &image->phases[phase];
+
+		if (!time->start_ns)
+			continue;
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%s %llu %llu\n",
+				 kexec_phase_name(phase), time->start_ns,
+				 time->duration_ns);
+	}
+	mutex_unlock(&kexec_mutex);
+
+	return len;
+}
+
+static struct kobj_attribute kexec_timings_attr = __ATTR(timings, S_IRUGO, kexecmod_timings_show, NULL);
+
+/*
+ * Allocator and relocation counters of the image in slot 0, one "name value"
+ * pair per line. See struct kexec_load_stats.
+ */
+static ssize_t kexecmod_stats_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	struct kexec_load_stats stats = {};
+
+	mutex_lock(&kexec_mutex);
+	if (kexec_slots[0])
+		stats = kexec_slots[0]->stats;
+	mutex_unlock(&kexec_mutex);
+
+	return scnprintf(buf, PAGE_SIZE,
+			 "pages_allocated %lu\n"
+			 "dest_collisions %lu\n"
+			 "swaps %lu\n"
+			 "dest_pages %lu\n"
+			 "unusable_pages %lu\n"
+			 "control_retries %lu\n"
+			 "indirection_pages %lu\n"
+			 "in_place_pages %lu\n",
+			 stats.pages_allocated, stats.dest_collisions,
+			 stats.swaps, stats.dest_pages, stats.unusable_pages,
+			 stats.control_retries, stats.indirection_pages,
+			 stats.in_place_pages);
+}
+
+static struct kobj_attribute kexec_stats_attr = __ATTR(stats, S_IRUGO, kexecmod_stats_show, NULL);
+
+/*
+ * Staged images, one line per occupied slot: slot number, entry point,
+ * number of segments and the total size of the segments in bytes.
+ */
+static ssize_t kexecmod_slots_show(struct kobject *kobj,
+				   struct kobj_attribute *attr, char *buf)
+{
+	ssize_t len = 0;
+	unsigned int slot;
+
+	mutex_lock(&kexec_mutex);
+	for (slot = 0; slot < KEXEC_SLOT_MAX; slot++) {
+		struct kimage *image = kexec_slots[slot];
+		unsigned long i, bytes = 0;
+
+		if (!image)
+			continue;
+		for (i = 0; i < image->nr_segments; i++)
+			bytes += image->segment[i].memsz;
+		len += scnprintf(buf + len, PAGE_SIZE - len, "%u %#lx %lu %lu\n",
+				 slot, image->start, image->nr_segments, bytes);
+	}
+	mutex_unlock(&kexec_mutex);
+
+	return len;
+}
+
+static struct kobj_attribute kexec_slots_attr = __ATTR(slots, S_IRUGO, kexecmod_slots_show, NULL);
+
+/*
+ * Kernel argument that points the crash kernel to the ELF core header, or an
+ * empty file when no crash kernel region was set up.
+ */
+static ssize_t kexecmod_elfcorehdr_show(struct kobject *kobj,
+					struct kobj_attribute *attr, char *buf)
+{
+	if (!kexec_elfcore_addr)
+		return 0;
+
+	return sprintf(buf, "elfcorehdr=%#zx@%pa\n", kexec_elfcore_len,
+		       &kexec_elfcore_addr);
+}
+
+static struct kobj_attribute kexec_elfcorehdr_attr = __ATTR(elfcorehdr, S_IRUGO, kexecmod_elfcorehdr_show, NULL);
+
+/*
+ * Physical memory preserved for the next kernel, one "start size" pair per
+ * line. There can be more ranges than fit in a page, so this is a binary
+ * attribute with lines of a fixed width that is read piece by piece.
+ */
+#define KEXEC_PRESERVED_LINE sizeof("0x0123456789abcdef 0x0123456789abcdef\n")
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6,16,0)
+#define KEXEC_BIN_ATTR_CONST const
+#else
+#define KEXEC_BIN_ATTR_CONST
+#endif
+
+static ssize_t kexecmod_preserved_read(struct file *file, struct kobject *kobj,
+				       KEXEC_BIN_ATTR_CONST struct bin_attribute *attr,
+				       char *buf, loff_t off, size_t count)
+{
+	char line[KEXEC_PRESERVED_LINE];
+	size_t len = 0, n;
+	u32 skip;
+	u64 i;
+
+	mutex_lock(&kexec_mutex);
+	i = div_u64_rem(off, KEXEC_PRESERVED_LINE - 1, &skip);
+	for (; i < kexec_preserved_nr && len < count; i++, skip = 0) {
+		snprintf(line, sizeof(line), "0x%016llx 0x%016llx\n",
+			 (unsigned long long)kexec_preserved[i].start,
+			 (unsigned long long)kexec_preserved[i].size);
+		n = min_t(size_t, count - len, KEXEC_PRESERVED_LINE - 1 - skip);
+		memcpy(buf + len, line + skip, n);
+		len += n;
+	}
+	mutex_unlock(&kexec_mutex);
+
+	return len;
+}
+
+static struct bin_attribute kexec_preserved_attr = {
+	.attr = { .name = "preserved", .mode = S_IRUGO },
+	.read = kexecmod_preserved_read,
+};
+
+static struct attribute *kexec_attrs[] = {
+	&kexec_timings_attr.attr,
+	&kexec_stats_attr.attr,
+	&kexec_slots_attr.attr,
+	&kexec_elfcorehdr_attr.attr,
+	NULL,
+};
+
+static const struct attribute_group kexec_attr_group = {
+	.attrs = kexec_attrs,
+};
+
+static struct kobject *kexec_kobj;
+
 static long kexecmod_ioctl(struct file *file, unsigned req, unsigned long arg)
 {
-	struct {
-		unsigned long entry;
-		unsigned long nr_segs;
-		struct kexec_segment *segs;
-		unsigned long flags;
-	} ap;
+	struct kexec_ioctl_load ap;
+	struct kexec_ioctl_preserve pp;
+	struct kexec_ioctl_file_load fp;
 	switch (req) {
-	case LINUX_REBOOT_CMD_KEXEC - 1:
+	case KEXEC_IOCTL_LOAD_FDT:
 		if (copy_from_user(&ap, (void*)arg, sizeof ap))
 			return -EFAULT;
-		return sys_kexec_load(ap.entry, ap.nr_segs, ap.segs, ap.flags);
-	case LINUX_REBOOT_CMD_KEXEC:
-		return kernel_kexec();
+		return sys_kexec_load_fdt(ap.entry, ap.nr_segs, ap.segs,
+					  ap.flags, ap.slot, ap.fdt);
+	case KEXEC_IOCTL_FILE_LOAD:
+		if (copy_from_user(&fp, (void*)arg, sizeof fp))
+			return -EFAULT;
+		return sys_kexec_file_load(fp.kernel_fd, fp.initrd_fd,
+					   fp.cmdline_len, fp.cmdline,
+					   fp.flags, fp.slot);
+	case KEXEC_IOCTL_PRESERVE:
+		if (copy_from_user(&pp, (void*)arg, sizeof pp))
+			return -EFAULT;
+		return sys_kexec_preserve(pp.addr, pp.size, pp.flags);
+	case KEXEC_IOCTL_LOAD_SLOT:
+		if (copy_from_user(&ap, (void*)arg, sizeof ap))
+			return -EFAULT;
+		return sys_kexec_load(ap.entry, ap.nr_segs, ap.segs, ap.flags,
+				      ap.slot);
+	case KEXEC_IOCTL_PLAN:
+		if (copy_from_user(&ap, (void*)arg, offsetof(typeof(ap), slot)))
+			return -EFAULT;
+		return sys_kexec_plan(ap.entry, ap.nr_segs, ap.segs, ap.flags,
+				      ap.plan);
+	case KEXEC_IOCTL_LOAD:
+		if (copy_from_user(&ap, (void*)arg, offsetof(typeof(ap), plan)))
+			return -EFAULT;
+		return sys_kexec_load(ap.entry, ap.nr_segs, ap.segs, ap.flags,
+				      0);
+	case KEXEC_IOCTL_EXEC:
+		/* The argument selects the slot to execute */
+		if (arg >= KEXEC_SLOT_MAX)
+			return -EINVAL;
+		return kernel_kexec(arg);
 	}
 	return -EINVAL;
 }
@@ -80,22 +313,66 @@ kexecmod_init(void)
 
 	/* Register character device at /dev/kexec */
 	kexec_maj = register_chrdev(0, "kexec", &fops);
-	if (kexec_maj < 0)
-		return kexec_maj;
+	if (kexec_maj < 0) {
+		err = kexec_maj;
+		goto out_compat;
+	}
 	kexec_class = class_create(THIS_MODULE, "kexec");
-	if (IS_ERR(kexec_class))
-		return PTR_ERR(kexec_class);
+	if (IS_ERR(kexec_class)) {
+		err = PTR_ERR(kexec_class);
+		goto out_chrdev;
+	}
 	kexec_dev = MKDEV(kexec_maj, 0);
 	kexec_device = device_create(kexec_class, 0, kexec_dev, 0, "kexec");
-	if (IS_ERR(kexec_device))
-		return PTR_ERR(kexec_device);
+	if (IS_ERR(kexec_device)) {
+		err = PTR_ERR(kexec_device);
+		goto out_class;
+	}
 
 	/* Register sysfs object */
 	err = sysfs_create_file(kernel_kobj, &(kexec_loaded_attr.attr));
+	err = sysfs_create_file(kernel_kobj, &(kexec_crash_loaded_attr.attr));
+
+	/* Register sysfs directory at /sys/kernel/kexec */
+	kexec_kobj = kobject_create_and_add("kexec", kernel_kobj);
+	if (!kexec_kobj) {
+		err = -ENOMEM;
+		goto out_files;
+	}
+	err = sysfs_create_group(kexec_kobj, &kexec_attr_group);
+	if (err)
+		goto out_kobj;
+	err = sysfs_create_bin_file(kexec_kobj, &kexec_preserved_attr);
+	if (err)
+		goto out_group;
+
+	/* Claim the crash kernel region and hook into panic */
+	if ((err = kexec_crash_init()) != 0) {
+		pr_err("Failed to set up crash kernel: %d\n", err);
+		goto out_bin;
+	}
 
 	pr_info("Kexec functionality now available at /dev/kexec.\n");
 
 	return 0;
+
+out_bin:
+	sysfs_remove_bin_file(kexec_kobj, &kexec_preserved_attr);
+out_group:
+	sysfs_remove_group(kexec_kobj, &kexec_attr_group);
+out_kobj:
+	kobject_put(kexec_kobj);
+out_files:
+	sysfs_remove_file(kernel_kobj, &(kexec_loaded_attr.attr));
+	sysfs_remove_file(kernel_kobj, &(kexec_crash_loaded_attr.attr));
+	device_destroy(kexec_class, kexec_dev);
+out_class:
+	class_destroy(kexec_class);
+out_chrdev:
+	unregister_chrdev(kexec_maj, "kexec");
+out_compat:
+	kexec_compat_unload();
+	return err;
 }
 
 module_init(kexecmod_init)
@@ -105,6 +382,12 @@ kexecmod_exit(void)
 {
 	pr_info("Stopping...\n");
 
+	/* Release the crash kernel region */
+	kexec_crash_exit();
+
+	/* Unpin the preserved pages */
+	kexec_preserve_clear();
+
 	/* Unload compatibility layer */
 	kexec_compat_unload();
 
@@ -115,6 +398,10 @@ kexecmod_exit(void)
 
 	/* Remove sysfs object */
 	sysfs_remove_file(kernel_kobj, &(kexec_loaded_attr.attr));
+	sysfs_remove_file(kernel_kobj, &(kexec_crash_loaded_attr.attr));
+	sysfs_remove_bin_file(kexec_kobj, &kexec_preserved_attr);
+	sysfs_remove_group(kexec_kobj, &kexec_attr_group);
+	kobject_put(kexec_kobj);
 }
 
 module_exit(kexecmod_exit);
@@ -0,0 +1,300 @@
+/*
+ * ELF core header for the crash kernel: describes the memory of the crashed
+ * kernel and the CPU state saved on panic, so that /proc/vmcore in the crash
+ * kernel works without kexec-tools building the header from /proc/iomem.
+ *
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/elf.h>
+#include <linux/elfcore.h>
+#include <linux/gfp.h>
+#include <linux/ioport.h>
+#include <linux/memory.h>
+#include <linux/mutex.h>
+#include <linux/sched.h>
+#include <linux/string.h>
+
+#include "kexec_compat.h"
+#include "kexec.h"
+#include "kexec_internal.h"
+
+/* Location of the header, in the tail of the crash kernel region */
+phys_addr_t kexec_elfcore_addr;
+size_t kexec_elfcore_len;
+static DEFINE_MUTEX(kexec_elfcore_mutex);
+
+/*
+ * The header is built in whichever of two buffers is not the current one and
+ * only copied to its location on panic, so a panic in the middle of a rebuild
+ * still hands the crash kernel the last complete header.
+ */
+static Elf64_Ehdr *kexec_elfcore_bufs[2];
+static Elf64_Ehdr *kexec_elfcore_current;
+
+/* Per-CPU register notes, filled in on panic */
+static note_buf_t *kexec_crash_notes;
+
+static u32 *kexec_append_note(u32 *buf, char *name, unsigned int type,
+			      void *data, size_t data_len)
+{
+	struct elf_note *note = (struct elf_note *)buf;
+
+	note->n_namesz = strlen(name) + 1;
+	note->n_descsz = data_len;
+	note->n_type   = type;
+	buf += DIV_ROUND_UP(sizeof(*note), sizeof(Elf_Word));
+	memcpy(buf, name, note->n_namesz);
+	buf += DIV_ROUND_UP(note->n_namesz, sizeof(Elf_Word));
+	memcpy(buf, data, data_len);
+	buf += DIV_ROUND_UP(data_len, sizeof(Elf_Word));
+
+	return buf;
+}
+
+static void kexec_final_note(u32 *buf)
+{
+	memset(buf, 0, sizeof(struct elf_note));
+}
+
+/**
+ * kexec_crash_save_cpu - Record the registers of @cpu for the crash kernel.
+ *
+ * Called on panic. The note of a CPU that never got here stays empty, which
+ * the crash kernel skips.
+ */
+void kexec_crash_save_cpu(struct pt_regs *regs, int cpu)
+{
+	struct elf_prstatus prstatus;
+	u32 *buf;
+
+	if (!kexec_crash_notes || cpu < 0 || cpu >= nr_cpu_ids)
+		return;
+
+	buf = (u32 *)&kexec_crash_notes[cpu];
+	memset(&prstatus, 0, sizeof(prstatus));
+	prstatus.pr_pid = current->pid;
+	elf_core_copy_kernel_regs(&prstatus.pr_reg, regs);
+	buf = kexec_append_note(buf, KEXEC_CORE_NOTE_NAME, NT_PRSTATUS,
+				&prstatus, sizeof(prstatus));
+	kexec_final_note(buf);
+
+	/* The crash kernel reads the note with the caches off at first */
+	machine_kexec_flush(&kexec_crash_notes[cpu], sizeof(note_buf_t));
+}
+
+static Elf64_Phdr *kexec_elfcore_add(Elf64_Ehdr *ehdr, Elf64_Word type,
+				     phys_addr_t start, phys_addr_t end)
+{
+	Elf64_Phdr *phdr = (Elf64_Phdr *)(ehdr + 1) + ehdr->e_phnum;
+
+	if ((void *)(phdr + 1) > (void *)ehdr + KEXEC_ELFCORE_SIZE)
+		return NULL;
+
+	phdr->p_type = type;
+	phdr->p_offset = start;
+	phdr->p_paddr = start;
+	phdr->p_filesz = phdr->p_memsz = end - start;
+	if (type == PT_LOAD) {
+		phdr->p_flags = PF_R | PF_W | PF_X;
+		phdr->p_vaddr = (unsigned long)__va(start);
+	}
+	ehdr->e_phnum++;
+
+	return phdr;
+}
+
+/*
+ * Describe a range of System RAM, leaving out the crash kernel region: that
+ * is where the crash kernel runs, so it is not part of the dump.
+ */
+static int kexec_elfcore_add_ram(struct resource *res, void *arg)
+{
+	Elf64_Ehdr *ehdr = arg;
+	phys_addr_t start = res->start, end = res->end + 1;
+	phys_addr_t cstart = kexec_crash_base;
+	phys_addr_t cend = kexec_crash_base + kexec_crash_size;
+
+	if (start < cstart && cstart < end) {
+		if (!kexec_elfcore_add(ehdr, PT_LOAD, start, cstart))
+			return -E2BIG;
+		start = cstart;
+	}
+	if (start < cend && cend < end)
+		start = cend;
+	if (start >= cstart && end <= cend)
+		return 0;
+
+	return kexec_elfcore_add(ehdr, PT_LOAD, start, end) ? 0 : -E2BIG;
+}
+
+/*
+ * (Re)build the header from the current memory layout. The crash kernel finds
+ * it through its device tree, see kexec_crash_publish(), or otherwise through
+ * the elfcorehdr= argument in /sys/kernel/kexec/elfcorehdr.
+ */
+static int kexec_elfcore_update(void)
+{
+	Elf64_Ehdr *ehdr;
+	int cpu, ret;
+
+	mutex_lock(&kexec_elfcore_mutex);
+	ehdr = kexec_elfcore_bufs[kexec_elfcore_current == kexec_elfcore_bufs[0]];
+
+	memset(ehdr, 0, KEXEC_ELFCORE_SIZE);
+	memcpy(ehdr->e_ident, ELFMAG, SELFMAG);
+	ehdr->e_ident[EI_CLASS] = ELFCLASS64;
+	ehdr->e_ident[EI_DATA] = ELF_DATA;
+	ehdr->e_ident[EI_VERSION] = EV_CURRENT;
+	ehdr->e_ident[EI_OSABI] = ELF_OSABI;
+	ehdr->e_type = ET_CORE;
+	ehdr->e_machine = ELF_ARCH;
+	ehdr->e_version = EV_CURRENT;
+	ehdr->e_phoff = sizeof(Elf64_Ehdr);
+	ehdr->e_ehsize = sizeof(Elf64_Ehdr);
+	ehdr->e_phentsize = sizeof(Elf64_Phdr);
+
+	/* One note per CPU, then the vmcoreinfo note if we can find it */
+	for_each_possible_cpu(cpu) {
+		phys_addr_t notes = virt_to_phys(&kexec_crash_notes[cpu]);
+
+		kexec_elfcore_add(ehdr, PT_NOTE, notes,
+				  notes + sizeof(note_buf_t));
+	}
+	if (kexec_compat_vmcoreinfo_available()) {
+		phys_addr_t vmcoreinfo = paddr_vmcoreinfo_note();
+
+		kexec_elfcore_add(ehdr, PT_NOTE, vmcoreinfo,
+				  vmcoreinfo + VMCOREINFO_NOTE_SIZE);
+	}
+
+	/* Under the resource lock, as memory may come and go meanwhile */
+	ret = walk_system_ram_res(0, -1, ehdr, kexec_elfcore_add_ram);
+
+	if (ret) {
+		/* Keep the last complete header */
+		pr_err("Too many memory ranges for the ELF core header.\n");
+	} else {
+		smp_store_release(&kexec_elfcore_current, ehdr);
+		kexec_elfcore_len = PAGE_ALIGN(ehdr->e_phoff +
+					       ehdr->e_phnum * ehdr->e_phentsize);
+	}
+
+	mutex_unlock(&kexec_elfcore_mutex);
+	return ret;
+}
+
+/**
+ * kexec_elfcore_copy - Copy the current header to where the crash kernel
+ * looks for it.
+ *
+ * Called on panic with the other CPUs stopped, so a rebuild can at most be
+ * stuck halfway in the buffer that is not current.
+ */
+void kexec_elfcore_copy(void)
+{
+	Elf64_Ehdr *ehdr = smp_load_acquire(&kexec_elfcore_current);
+	void *dst = phys_to_virt(kexec_elfcore_addr);
+
+	if (!ehdr)
+		return;
+
+	memcpy(dst, ehdr, KEXEC_ELFCORE_SIZE);
+	machine_kexec_flush(dst, KEXEC_ELFCORE_SIZE);
+}
+
+static int kexec_elfcore_memory_notify(struct notifier_block *nb,
+				       unsigned long action, void *data)
+{
+	switch (action) {
+	case MEM_ONLINE:
+	case MEM_OFFLINE:
+		kexec_elfcore_update();
+		break;
+	}
+
+	return NOTIFY_OK;
+}
+
+static struct notifier_block kexec_elfcore_memory_nb = {
+	.notifier_call = kexec_elfcore_memory_notify,
+};
+
+static void kexec_elfcore_free_bufs(void)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(kexec_elfcore_bufs); i++) {
+		if (kexec_elfcore_bufs[i])
+			free_pages_exact(kexec_elfcore_bufs[i],
+					 KEXEC_ELFCORE_SIZE);
+		kexec_elfcore_bufs[i] = NULL;
+	}
+	kexec_elfcore_current = NULL;
+}
+
+/**
+ * kexec_elfcore_init - Set up the ELF core header at @addr.
+ *
+ * @addr points to KEXEC_ELFCORE_SIZE bytes of the reserved crash kernel
+ * region, which no crash kernel segment is loaded into.
+ */
+int kexec_elfcore_init(phys_addr_t addr)
+{
+	int i, ret;
+
+	if (!kexec_compat_ram_walk_available())
+		return -EOPNOTSUPP;
+
+	kexec_crash_notes = alloc_pages_exact(nr_cpu_ids * sizeof(note_buf_t),
+					      GFP_KERNEL | __GFP_ZERO);
+	if (!kexec_crash_notes)
+		return -ENOMEM;
+
+	for (i = 0; i < ARRAY_SIZE(kexec_elfcore_bufs); i++) {
+		kexec_elfcore_bufs[i] = alloc_pages_exact(KEXEC_ELFCORE_SIZE,
+							  GFP_KERNEL);
+		if (!kexec_elfcore_bufs[i]) {
+			ret = -ENOMEM;
+			goto out_free_bufs;
+		}
+	}
+
+	kexec_elfcore_addr = addr;
+	ret = kexec_elfcore_update();
+	if (ret)
+		goto out_free_bufs;
+
+	ret = register_memory_notifier(&kexec_elfcore_memory_nb);
+	if (ret)
+		goto out_free_bufs;
+
+	return 0;
+
+out_free_bufs:
+	kexec_elfcore_free_bufs();
+	free_pages_exact(kexec_crash_notes, nr_cpu_ids * sizeof(note_buf_t));
+	kexec_crash_notes = NULL;
+	kexec_elfcore_addr = 0;
+	return ret;
+}
+
+void kexec_elfcore_exit(void)
+{
+	if (!kexec_crash_notes)
+		return;
+
+	unregister_memory_notifier(&kexec_elfcore_memory_nb);
+	kexec_elfcore_free_bufs();
+	free_pages_exact(kexec_crash_notes, nr_cpu_ids * sizeof(note_buf_t));
+	kexec_crash_notes = NULL;
+	kexec_elfcore_addr = 0;
+	kexec_elfcore_len = 0;
+}
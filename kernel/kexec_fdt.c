@@ -0,0 +1,263 @@
+/*
+ * Device tree for the next kernel, built by kexec_mod from the flattened
+ * device tree the running kernel booted with. Only /chosen is changed: it
+ * gets the command line and initrd of the new image and fresh random seeds.
+ *
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/err.h>
+#include <linux/libfdt.h>
+#include <linux/mm.h>
+#include <linux/random.h>
+#include <linux/sizes.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "kexec_compat.h"
+#include "kexec.h"
+#include "kexec_internal.h"
+
+/* Room for the properties that /chosen gains, on top of the command line */
+#define KEXEC_FDT_EXTRA		SZ_4K
+
+/* Size of the rng-seed property, as the arm64 kexec_file_load uses */
+#define KEXEC_FDT_RNG_SEED_SIZE	128
+
+/*
+ * Set @name of @node to the range [@addr, @addr + @size), in the number of
+ * cells the root node asks for.
+ */
+static int kexec_fdt_setprop_range(void *fdt, int node, const char *name,
+				   u64 addr, u64 size)
+{
+	int addr_cells = 2, size_cells = 1;
+	const fdt32_t *cells;
+	fdt32_t buf[4], *p = buf;
+
+	cells = fdt_getprop(fdt, 0, "#address-cells", NULL);
+	if (cells)
+		addr_cells = fdt32_to_cpu(*cells);
+	cells = fdt_getprop(fdt, 0, "#size-cells", NULL);
+	if (cells)
+		size_cells = fdt32_to_cpu(*cells);
+	if (addr_cells < 1 || addr_cells > 2 || size_cells < 1 ||
+	    size_cells > 2)
+		return -FDT_ERR_BADNCELLS;
+
+	if (addr_cells == 2)
+		*p++ = cpu_to_fdt32(upper_32_bits(addr));
+	*p++ = cpu_to_fdt32(lower_32_bits(addr));
+	if (size_cells == 2)
+		*p++ = cpu_to_fdt32(upper_32_bits(size));
+	*p++ = cpu_to_fdt32(lower_32_bits(size));
+
+	return fdt_setprop(fdt, node, name, buf, (p - buf) * sizeof(*p));
+}
+
+/*
+ * Point a crash kernel to the ELF core header and keep it in its region. The
+ * usable range includes the tail that holds the header, as kernels up to 5.10
+ * only map the header if it lies in memory they may use.
+ */
+static int kexec_fdt_set_crash(void *fdt, int node)
+{
+	int ret;
+
+	ret = kexec_fdt_setprop_range(fdt, node, "linux,elfcorehdr",
+				      kexec_elfcore_addr, kexec_elfcore_len);
+	if (ret)
+		return ret;
+	return kexec_fdt_setprop_range(fdt, node, "linux,usable-memory-range",
+				       kexec_crash_res.start,
+				       kexec_elfcore_addr + KEXEC_ELFCORE_SIZE -
+				       kexec_crash_res.start);
+}
+
+static int kexec_fdt_patch_chosen(struct kimage *image, void *fdt,
+				  const char *cmdline,
+				  unsigned long initrd_start,
+				  unsigned long initrd_len)
+{
+	u8 rng_seed[KEXEC_FDT_RNG_SEED_SIZE];
+	u64 kaslr_seed;
+	int node, ret;
+
+	node = fdt_path_offset(fdt, "/chosen");
+	if (node == -FDT_ERR_NOTFOUND)
+		node = fdt_add_subnode(fdt, 0, "chosen");
+	if (node < 0)
+		return node;
+
+	/* Drop what only applied to the running kernel */
+	fdt_delprop(fdt, node, "bootargs");
+	fdt_delprop(fdt, node, "linux,initrd-start");
+	fdt_delprop(fdt, node, "linux,initrd-end");
+	fdt_delprop(fdt, node, "linux,elfcorehdr");
+	fdt_delprop(fdt, node, "linux,usable-memory-range");
+
+	if (cmdline) {
+		ret = fdt_setprop_string(fdt, node, "bootargs", cmdline);
+		if (ret)
+			return ret;
+	}
+
+	if (initrd_len) {
+		ret = fdt_setprop_u64(fdt, node, "linux,initrd-start",
+				      initrd_start);
+		if (ret)
+			return ret;
+		ret = fdt_setprop_u64(fdt, node, "linux,initrd-end",
+				      initrd_start + initrd_len);
+		if (ret)
+			return ret;
+	}
+
+	if (image->type == KEXEC_TYPE_CRASH) {
+		ret = kexec_fdt_set_crash(fdt, node);
+		if (ret)
+			return ret;
+	}
+
+	/* Fresh seeds, the next kernel must not reuse ours */
+	get_random_bytes(&kaslr_seed, sizeof(kaslr_seed));
+	ret = fdt_setprop_u64(fdt, node, "kaslr-seed", kaslr_seed);
+	if (ret)
+		return ret;
+
+	get_random_bytes(rng_seed, sizeof(rng_seed));
+	return fdt_setprop(fdt, node, "rng-seed", rng_seed, sizeof(rng_seed));
+}
+
+/**
+ * kexec_fdt_create - Build the device tree for the next kernel.
+ *
+ * Copies the device tree the running kernel booted with and points /chosen
+ * to @cmdline (none if NULL) and the initrd at @initrd_start, if @initrd_len
+ * is non-zero. A crash kernel also learns where its region and the ELF core
+ * header are. Returns a kvmalloc()ed device tree of @size bytes.
+ */
+void *kexec_fdt_create(struct kimage *image, const char *cmdline,
+		       unsigned long initrd_start, unsigned long initrd_len,
+		       size_t *size)
+{
+	const void *boot_fdt;
+	size_t len;
+	void *fdt;
+	int ret;
+
+	if (!kexec_compat_fdt_available())
+		return ERR_PTR(-EOPNOTSUPP);
+
+	boot_fdt = kexec_compat_boot_fdt();
+	len = fdt_totalsize(boot_fdt) + KEXEC_FDT_EXTRA;
+	if (cmdline)
+		len += strlen(cmdline) + 1;
+
+	fdt = kvmalloc(len, GFP_KERNEL);
+	if (!fdt)
+		return ERR_PTR(-ENOMEM);
+
+	ret = fdt_open_into(boot_fdt, fdt, len);
+	if (!ret)
+		ret = kexec_fdt_patch_chosen(image, fdt, cmdline, initrd_start,
+					     initrd_len);
+	if (!ret)
+		ret = fdt_pack(fdt);
+	if (ret) {
+		pr_err("Failed to build the device tree: %d\n", ret);
+		kvfree(fdt);
+		return ERR_PTR(-EINVAL);
+	}
+
+	*size = fdt_totalsize(fdt);
+	return fdt;
+}
+
+/**
+ * kexec_fdt_set_initrd - Move the initrd in a device tree.
+ *
+ * Points the initrd properties that kexec_fdt_create() gave @fdt to
+ * @initrd_start, in place. The device tree keeps its size, so it can be built
+ * before the initrd has a place.
+ */
+int kexec_fdt_set_initrd(void *fdt, unsigned long initrd_start,
+			 unsigned long initrd_len)
+{
+	int node, ret;
+
+	node = fdt_path_offset(fdt, "/chosen");
+	if (node < 0)
+		return -EINVAL;
+
+	ret = fdt_setprop_u64(fdt, node, "linux,initrd-start", initrd_start);
+	if (!ret)
+		ret = fdt_setprop_u64(fdt, node, "linux,initrd-end",
+				      initrd_start + initrd_len);
+	return ret ? -EINVAL : 0;
+}
+
+/**
+ * kexec_fdt_patch_crash - Point the device tree in @segment to the ELF core
+ * header.
+ *
+ * For crash images loaded with a device tree of their own, as kexec-tools
+ * builds. The device tree may grow into the rest of the segment. Returns
+ * -ENOENT if the segment holds no device tree.
+ */
+int kexec_fdt_patch_crash(struct kimage *image, struct kexec_segment *segment)
+{
+	fdt32_t magic;
+	void *fdt;
+	int node, ret;
+
+	if (segment->bufsz < sizeof(magic))
+		return -ENOENT;
+
+	ret = kimage_segment_rw(image, segment, &magic, 0, sizeof(magic),
+				false);
+	if (ret)
+		return ret;
+	if (fdt32_to_cpu(magic) != FDT_MAGIC)
+		return -ENOENT;
+
+	if (!kexec_compat_fdt_available())
+		return -EOPNOTSUPP;
+
+	fdt = kvmalloc(segment->memsz, GFP_KERNEL);
+	if (!fdt)
+		return -ENOMEM;
+	ret = kimage_segment_rw(image, segment, fdt, 0, segment->memsz, false);
+	if (ret)
+		goto out;
+
+	ret = fdt_open_into(fdt, fdt, segment->memsz);
+	if (!ret) {
+		node = fdt_path_offset(fdt, "/chosen");
+		if (node == -FDT_ERR_NOTFOUND)
+			node = fdt_add_subnode(fdt, 0, "chosen");
+		ret = node < 0 ? node : kexec_fdt_set_crash(fdt, node);
+	}
+	if (!ret)
+		ret = fdt_pack(fdt);
+	if (ret) {
+		pr_err("Failed to patch the device tree: %d\n", ret);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = kimage_segment_rw(image, segment, fdt, 0, fdt_totalsize(fdt),
+				true);
+	if (!ret)
+		segment->bufsz = fdt_totalsize(fdt);
+out:
+	kvfree(fdt);
+	return ret;
+}
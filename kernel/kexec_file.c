@@ -0,0 +1,433 @@
+/*
+ * kexec_file.c - kexec_file_load for kexec_mod
+ *
+ * The kernel and initrd are read from file descriptors by the module itself
+ * instead of being staged by user space, and the device tree is built from
+ * the one the running kernel booted with (see kexec_fdt.c). The image is
+ * placed in the lowest System RAM it fits in.
+ *
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/capability.h>
+#include <linux/err.h>
+#include <linux/file.h>
+#include <linux/fs.h>
+#include <linux/ioport.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/security.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <linux/vmalloc.h>
+
+#include "kexec_compat.h"
+#include "kexec.h"
+#include "kexec_internal.h"
+
+/* An image loaded from files, and where its parts go */
+struct kexec_file {
+	struct kimage *image;
+
+	void *kernel;
+	unsigned long kernel_len;
+	struct kexec_image_layout layout;
+
+	void *initrd;
+	unsigned long initrd_len;
+
+	char *cmdline;
+
+	void *dtb;
+	size_t dtb_len;
+
+	/* Memory taken by the kernel, the initrd and the device tree */
+	unsigned long kernel_memsz, initrd_memsz, dtb_memsz;
+	/* Where the kernel goes, the rest follows it */
+	unsigned long mem;
+};
+
+/*
+ * Read the regular file behind @fd into a vmalloc()ed buffer.
+ */
+static int kexec_file_read(int fd, void **buf, unsigned long *len)
+{
+	struct fd f = fdget(fd);
+	loff_t size, pos = 0;
+	ssize_t n;
+	int ret = 0;
+
+	if (!f.file)
+		return -EBADF;
+
+	if (!(f.file->f_mode & FMODE_READ)) {
+		ret = -EBADF;
+		goto out;
+	}
+	if (!S_ISREG(file_inode(f.file)->i_mode)) {
+		ret = -EINVAL;
+		goto out;
+	}
+
+	size = i_size_read(file_inode(f.file));
+	if (size <= 0 || size > INT_MAX) {
+		ret = size ? -EFBIG : -EINVAL;
+		goto out;
+	}
+
+	*buf = vmalloc(size);
+	if (!*buf) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while (pos < size) {
+		n = kernel_read(f.file, *buf + pos, size - pos, &pos);
+		if (n <= 0) {
+			ret = n ? n : -EIO;
+			vfree(*buf);
+			*buf = NULL;
+			goto out;
+		}
+	}
+	*len = size;
+out:
+	fdput(f);
+	return ret;
+}
+
+/*
+ * Return the end of what [@start, @end) must not overlap, or zero if it is
+ * free: memory reserved at boot within @ram, the crash kernel region, unless
+ * that is what we load into, and the preserved ranges.
+ */
+static unsigned long kexec_file_conflict(struct kimage *image,
+					 struct resource *ram,
+					 unsigned long start,
+					 unsigned long end)
+{
+	struct kexec_preserved_range *range;
+	struct resource *res;
+
+	/* Firmware tables and reserved-memory nodes the next kernel needs */
+	for (res = ram ? ram->child : NULL; res; res = res->sibling) {
+		if (!strcmp(res->name, "reserved") && start <= res->end &&
+		    end > res->start)
+			return res->end + 1;
+	}
+
+	if (image->type != KEXEC_TYPE_CRASH && kexec_crash_res.end &&
+	    start <= kexec_crash_res.end && end > kexec_crash_res.start)
+		return kexec_crash_res.end + 1;
+
+	range = kexec_preserve_find(start, end);
+	if (range)
+		return range->start + range->size;
+
+	return 0;
+}
+
+/*
+ * Place the image at the lowest address in [@start, @end) of @ram that suits
+ * the kernel and overlaps nothing it must not.
+ */
+static int kexec_file_place(struct kexec_file *kf, struct resource *ram,
+			    unsigned long start, unsigned long end)
+{
+	unsigned long size = kf->kernel_memsz + kf->initrd_memsz +
+			     kf->dtb_memsz;
+	unsigned long base = start, mem;
+
+	for (;;) {
+		mem = ALIGN(base, kf->layout.align) + kf->layout.offset;
+		if (mem < base || mem + size < mem || mem + size > end)
+			return -ENOSPC;
+
+		base = kexec_file_conflict(kf->image, ram, mem, mem + size);
+		if (!base)
+			break;
+	}
+
+	kf->mem = mem;
+	return 0;
+}
+
+/*
+ * Lay the image out as the kernel, then the initrd and then the device tree,
+ * and set up the segments for it.
+ */
+static int kexec_file_layout(struct kexec_file *kf)
+{
+	struct kimage *image = kf->image;
+	struct kexec_segment *segment = image->segment;
+	struct resource *res;
+	int ret = -ENOSPC;
+
+	ret = machine_kexec_image_probe(kf->kernel, kf->kernel_len,
+					&kf->layout);
+	if (ret)
+		return ret;
+
+	if (!kf->layout.align || !PAGE_ALIGNED(kf->layout.align) ||
+	    !PAGE_ALIGNED(kf->layout.offset))
+		return -EINVAL;
+
+	/* The device tree leaves room for the preserved ranges */
+	kf->kernel_memsz = PAGE_ALIGN(max(kf->layout.memsz, kf->kernel_len));
+	kf->initrd_memsz = PAGE_ALIGN(kf->initrd_len);
+	kf->dtb_memsz = PAGE_ALIGN(kf->dtb_len + kexec_preserved_nr *
+				   sizeof(struct kexec_preserved_range));
+
+	if (image->type == KEXEC_TYPE_CRASH) {
+		ret = kexec_file_place(kf, NULL, kexec_crash_res.start,
+				       kexec_crash_res.end + 1);
+	} else {
+		for (res = iomem_resource.child; res && ret; res = res->sibling) {
+			if (strcmp(res->name, "System RAM"))
+				continue;
+			ret = kexec_file_place(kf, res, res->start,
+					       res->end + 1);
+		}
+	}
+	if (ret) {
+		pr_err("No room for a %lu byte image.\n",
+		       kf->kernel_memsz + kf->initrd_memsz + kf->dtb_memsz);
+		return ret;
+	}
+
+	segment->kbuf = kf->kernel;
+	segment->bufsz = kf->kernel_len;
+	segment->mem = kf->mem;
+	segment->memsz = kf->kernel_memsz;
+	image->start = kf->mem + kf->layout.entry;
+
+	if (kf->initrd) {
+		segment++;
+		segment->kbuf = kf->initrd;
+		segment->bufsz = kf->initrd_len;
+		segment->mem = segment[-1].mem + segment[-1].memsz;
+		segment->memsz = kf->initrd_memsz;
+
+		ret = kexec_fdt_set_initrd(kf->dtb, segment->mem,
+					   kf->initrd_len);
+		if (ret)
+			return ret;
+	}
+
+	segment++;
+	segment->kbuf = kf->dtb;
+	segment->bufsz = kf->dtb_len;
+	segment->mem = segment[-1].mem + segment[-1].memsz;
+	segment->memsz = kf->dtb_memsz;
+
+	image->nr_segments = segment - image->segment + 1;
+	return 0;
+}
+
+/*
+ * Counterpart of kimage_alloc_init() in kexec.c, for an image loaded from
+ * files.
+ */
+static int kimage_file_alloc_init(struct kexec_file *kf, int kernel_fd,
+				  int initrd_fd, unsigned long flags)
+{
+	bool kexec_on_panic = flags & KEXEC_FILE_ON_CRASH;
+	struct kimage *image;
+	u64 start_ns;
+	int ret;
+
+	/* Without a reserved region there is nowhere to load to */
+	if (kexec_on_panic && !kexec_crash_res.end)
+		return -EADDRNOTAVAIL;
+
+	image = do_kimage_alloc_init();
+	if (!image)
+		return -ENOMEM;
+
+	image->file_mode = 1;
+	if (kexec_on_panic) {
+		/* Enable special crash kernel control page alloc policy. */
+		image->control_page = kexec_crash_res.start;
+		image->type = KEXEC_TYPE_CRASH;
+	}
+	kf->image = image;
+
+	start_ns = kimage_phase_begin(image, KEXEC_PHASE_VALIDATE);
+	ret = kexec_file_read(kernel_fd, &kf->kernel, &kf->kernel_len);
+	if (ret)
+		goto out_free_image;
+
+	if (!(flags & KEXEC_FILE_NO_INITRAMFS)) {
+		ret = kexec_file_read(initrd_fd, &kf->initrd, &kf->initrd_len);
+		if (ret)
+			goto out_free_image;
+	}
+
+	/* The initrd is filled in once it has a place */
+	kf->dtb = kexec_fdt_create(image, kf->cmdline, 0, kf->initrd_len,
+				   &kf->dtb_len);
+	if (IS_ERR(kf->dtb)) {
+		ret = PTR_ERR(kf->dtb);
+		kf->dtb = NULL;
+		goto out_free_image;
+	}
+
+	ret = kexec_file_layout(kf);
+	if (ret)
+		goto out_free_image;
+
+	ret = sanity_check_segment_list(image);
+	if (ret)
+		goto out_free_image;
+	kimage_phase_end(image, KEXEC_PHASE_VALIDATE, start_ns);
+
+	start_ns = kimage_phase_begin(image, KEXEC_PHASE_CONTROL);
+	ret = -ENOMEM;
+	image->control_code_page = kimage_alloc_control_pages(
+		image, get_order(KEXEC_CONTROL_PAGE_SIZE));
+	if (!image->control_code_page) {
+		pr_err("Could not allocate control_code_buffer\n");
+		goto out_free_image;
+	}
+
+	if (!kexec_on_panic) {
+		image->swap_page = kimage_alloc_control_pages(image, 0);
+		if (!image->swap_page) {
+			pr_err("Could not allocate swap buffer\n");
+			goto out_free_control_pages;
+		}
+	}
+	kimage_phase_end(image, KEXEC_PHASE_CONTROL, start_ns);
+
+	return 0;
+out_free_control_pages:
+	kimage_free_page_list(&image->control_pages);
+out_free_image:
+	kf->image = NULL;
+	kfree(image);
+	return ret;
+}
+
+static int do_kexec_file_load(int kernel_fd, int initrd_fd,
+			      unsigned long flags, unsigned int slot,
+			      struct kexec_file *kf)
+{
+	struct kimage **dest_image, *image;
+	unsigned long i;
+	u64 start_ns;
+	int ret;
+
+	if (flags & KEXEC_FILE_ON_CRASH)
+		dest_image = &kexec_crash_image;
+	else
+		dest_image = &kexec_slots[slot];
+
+	/* Free the image in place before we possibly load over it */
+	kimage_free(xchg(dest_image, NULL));
+	if (flags & KEXEC_FILE_UNLOAD)
+		return 0;
+
+	ret = kimage_file_alloc_init(kf, kernel_fd, initrd_fd, flags);
+	if (ret)
+		return ret;
+	image = kf->image;
+	image->verify = !!kexec_verify;
+
+	start_ns = kimage_phase_begin(image, KEXEC_PHASE_CONTROL);
+	ret = machine_kexec_prepare(image);
+	if (ret)
+		goto out;
+	kimage_phase_end(image, KEXEC_PHASE_CONTROL, start_ns);
+
+	for (i = 0; i < image->nr_segments; i++) {
+		ret = kimage_load_segment(image, &image->segment[i]);
+		if (ret)
+			goto out;
+	}
+
+	kimage_terminate(image);
+
+	/* Reserve the preserved ranges in the new kernel's device tree */
+	ret = kexec_preserve_publish(image);
+	if (ret)
+		goto out;
+
+	/* Digest the segments last, once nothing changes them anymore */
+	start_ns = kimage_phase_begin(image, KEXEC_PHASE_DIGEST);
+	ret = kimage_digest_segments(image);
+	if (ret)
+		goto out;
+	kimage_phase_end(image, KEXEC_PHASE_DIGEST, start_ns);
+
+	/* Install the new kernel */
+	image = xchg(dest_image, image);
+
+out:
+	kimage_free(image);
+	return ret;
+}
+
+/*
+ * kexec_file_load: load the kernel behind @kernel_fd, with the initrd behind
+ * @initrd_fd unless KEXEC_FILE_NO_INITRAMFS is set, and the command line at
+ * @cmdline_ptr, into @slot.
+ */
+long sys_kexec_file_load(int kernel_fd, int initrd_fd,
+			 unsigned long cmdline_len,
+			 const char __user *cmdline_ptr,
+			 unsigned long flags, unsigned int slot)
+{
+	struct kexec_file kf = { };
+	int ret;
+
+	/* We only trust the superuser with rebooting the system. */
+	if (!capable(CAP_SYS_BOOT) || kexec_load_disabled)
+		return -EPERM;
+
+	/* Permit LSMs and IMA to fail the kexec */
+	ret = security_kernel_load_data(LOADING_KEXEC_IMAGE);
+	if (ret < 0)
+		return ret;
+
+	if (flags != (flags & KEXEC_FILE_FLAGS))
+		return -EINVAL;
+
+	/* A crash kernel has its own slot */
+	if (slot >= KEXEC_SLOT_MAX || (slot && (flags & KEXEC_FILE_ON_CRASH)))
+		return -EINVAL;
+
+	if (!kexec_compat_fdt_available() && !(flags & KEXEC_FILE_UNLOAD))
+		return -EOPNOTSUPP;
+
+	if (cmdline_len && !(flags & KEXEC_FILE_UNLOAD)) {
+		kf.cmdline = memdup_user(cmdline_ptr, cmdline_len);
+		if (IS_ERR(kf.cmdline))
+			return PTR_ERR(kf.cmdline);
+		if (kf.cmdline[cmdline_len - 1] != '\0') {
+			kfree(kf.cmdline);
+			return -EINVAL;
+		}
+	}
+
+	if (!mutex_trylock(&kexec_mutex)) {
+		ret = -EBUSY;
+		goto out;
+	}
+
+	ret = do_kexec_file_load(kernel_fd, initrd_fd, flags, slot, &kf);
+
+	mutex_unlock(&kexec_mutex);
+out:
+	kvfree(kf.dtb);
+	vfree(kf.initrd);
+	vfree(kf.kernel);
+	kfree(kf.cmdline);
+	return ret;
+}
@@ -9,11 +9,65 @@ int sanity_check_segment_list(struct kimage *image);
 void kimage_free_page_list(struct list_head *list);
 void kimage_free(struct kimage *image);
 int kimage_load_segment(struct kimage *image, struct kexec_segment *segment);
+int kimage_segment_rw(struct kimage *image, struct kexec_segment *segment,
+		      void *buf, size_t offset, size_t len, bool write);
 void kimage_terminate(struct kimage *image);
+int kimage_digest_segments(struct kimage *image);
+void kimage_plan(struct kimage *image, struct kexec_plan *plan);
+void kimage_plan_count(struct kimage *image, struct kexec_plan *plan);
 int kimage_is_destination_range(struct kimage *image,
 				unsigned long start, unsigned long end);
 
+#define for_each_kimage_entry(image, ptr, entry) \
+	for (ptr = &image->head; (entry = *ptr) && !(entry & IND_DONE); \
+		ptr = (entry & IND_INDIRECTION) ? \
+			boot_phys_to_virt((entry & PAGE_MASK)) : ptr + 1)
+
 extern struct mutex kexec_mutex;
+extern int kexec_parallel_flush;
+extern int kexec_fast_park;
+extern int kexec_parallel_shutdown;
+extern char *kexec_shutdown_skip;
+extern char *kexec_shutdown_quiesce;
+extern int kexec_profile_shutdown;
+extern int kexec_verify;
+extern unsigned long kexec_crash_base;
+extern unsigned long kexec_crash_size;
+
+/* Room for the ELF core header at the end of the crash kernel region */
+#define KEXEC_ELFCORE_SIZE (64UL << 10)
+
+extern phys_addr_t kexec_elfcore_addr;
+extern size_t kexec_elfcore_len;
+
+/* Physical memory the next kernel inherits, see kexec_preserve.c */
+struct kexec_preserved_range {
+	phys_addr_t start;
+	u64 size;
+};
+
+extern struct kexec_preserved_range *kexec_preserved;
+extern unsigned int kexec_preserved_nr;
+
+void kexec_restart_prepare(char *cmd);
+int kexec_crash_init(void);
+void kexec_crash_exit(void);
+int kexec_elfcore_init(phys_addr_t addr);
+void kexec_elfcore_exit(void);
+void kexec_elfcore_copy(void);
+void kexec_crash_save_cpu(struct pt_regs *regs, int cpu);
+struct kexec_preserved_range *kexec_preserve_find(unsigned long start,
+						  unsigned long end);
+bool kexec_preserve_overlaps(unsigned long start, unsigned long end);
+int kexec_preserve_publish(struct kimage *image);
+void *kexec_fdt_create(struct kimage *image, const char *cmdline,
+		       unsigned long initrd_start, unsigned long initrd_len,
+		       size_t *size);
+int kexec_fdt_set_initrd(void *fdt, unsigned long initrd_start,
+			 unsigned long initrd_len);
+int kexec_fdt_patch_crash(struct kimage *image, struct kexec_segment *segment);
+int kexec_crash_publish(struct kimage *image);
+void kexec_preserve_clear(void);
 
 static inline void kimage_file_post_load_cleanup(struct kimage *image) { }
 #endif /* LINUX_KEXEC_INTERNAL_H */
\ No newline at end of file
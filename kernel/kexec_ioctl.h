@@ -0,0 +1,120 @@
+/*
+ * Interface of /dev/kexec, shared by kexec_mod and the tools in user/.
+ *
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+#ifndef LINUX_KEXEC_IOCTL_H
+#define LINUX_KEXEC_IOCTL_H
+
+#include <linux/types.h>
+#include <linux/reboot.h>
+
+#ifndef __user
+#define __user
+#endif
+
+/*
+ * Requests of /dev/kexec. They count down from LINUX_REBOOT_CMD_KEXEC, which
+ * executes the image in the slot passed as the argument itself.
+ */
+#define KEXEC_IOCTL_EXEC	LINUX_REBOOT_CMD_KEXEC
+/* struct kexec_ioctl_load up to plan, loads into slot 0 */
+#define KEXEC_IOCTL_LOAD	(LINUX_REBOOT_CMD_KEXEC - 1)
+/* struct kexec_ioctl_load up to slot, see struct kexec_plan */
+#define KEXEC_IOCTL_PLAN	(LINUX_REBOOT_CMD_KEXEC - 2)
+/* struct kexec_ioctl_load, loads into slot, or unloads it without segments */
+#define KEXEC_IOCTL_LOAD_SLOT	(LINUX_REBOOT_CMD_KEXEC - 3)
+/* struct kexec_ioctl_preserve */
+#define KEXEC_IOCTL_PRESERVE	(LINUX_REBOOT_CMD_KEXEC - 4)
+/* struct kexec_ioctl_file_load */
+#define KEXEC_IOCTL_FILE_LOAD	(LINUX_REBOOT_CMD_KEXEC - 5)
+/* struct kexec_ioctl_load with a device tree built by the module */
+#define KEXEC_IOCTL_LOAD_FDT	(LINUX_REBOOT_CMD_KEXEC - 6)
+
+struct kexec_segment;
+
+/*
+ * Result of a dry run of kexec_load, as returned to user space. All sizes are
+ * in bytes.
+ */
+struct kexec_plan {
+	/* In: KEXEC_PLAN_* flags */
+	__u64 flags;
+	/* Memory the loaded image would hold on to */
+	__u64 staging_bytes;
+	/* Data the relocation stub would copy at exec time */
+	__u64 relocate_bytes;
+	/* Data cleaned to PoC at exec time */
+	__u64 flush_bytes;
+	/* Allocated pages that collided with a destination */
+	__u64 collisions;
+	__u64 swaps;
+	/* Pages allocated but not usable as source pages */
+	__u64 parked_pages;
+	__u64 control_retries;
+	__u64 indirection_pages;
+};
+
+/*
+ * Run the allocation pass of a load for the plan instead of counting pages.
+ * Only then are collisions, swaps, parked pages and control page retries
+ * known, but the staging memory is allocated for a moment.
+ */
+#define KEXEC_PLAN_ALLOC 0x1
+
+/*
+ * What the device tree the module builds for a kexec_load gets in /chosen,
+ * see sys_kexec_load_fdt().
+ */
+struct kexec_fdt_request {
+	/* Command line including its NUL, none if cmdline_len is zero */
+	const char __user *cmdline;
+	unsigned long cmdline_len;
+	/* Where the initrd was loaded, none if initrd_size is zero */
+	unsigned long initrd_start;
+	unsigned long initrd_size;
+	/* Where the device tree goes, zero for after the last segment */
+	unsigned long mem;
+};
+
+/* Argument of the load requests, the arguments of kexec_load() and more */
+struct kexec_ioctl_load {
+	unsigned long entry;
+	unsigned long nr_segs;
+	struct kexec_segment __user *segs;
+	unsigned long flags;
+	union {
+		/* KEXEC_IOCTL_PLAN: where the plan goes */
+		struct kexec_plan __user *plan;
+		/* KEXEC_IOCTL_LOAD_FDT: what goes in the device tree */
+		const struct kexec_fdt_request __user *fdt;
+	};
+	unsigned long slot;
+};
+
+/* Flag for KEXEC_IOCTL_PRESERVE: the address is a user mapping to pin */
+#define KEXEC_PRESERVE_USER 0x1
+
+/* Argument of KEXEC_IOCTL_PRESERVE, a size of zero clears all ranges */
+struct kexec_ioctl_preserve {
+	unsigned long addr;
+	unsigned long size;
+	unsigned long flags;
+};
+
+/* Argument of KEXEC_IOCTL_FILE_LOAD, the arguments of kexec_file_load() */
+struct kexec_ioctl_file_load {
+	long kernel_fd;
+	long initrd_fd;
+	unsigned long cmdline_len;
+	const char __user *cmdline;
+	unsigned long flags;
+	unsigned long slot;
+};
+
+#endif /* LINUX_KEXEC_IOCTL_H */
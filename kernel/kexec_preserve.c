@@ -0,0 +1,373 @@
+/*
+ * Preserved memory for kexec_mod: ranges of physical memory that the next
+ * kernel inherits untouched, such as a warm cache in a memfd. No segment or
+ * staging page of an image is placed in them, and they are published to the
+ * next kernel as /memreserve/ entries in the device tree segment.
+ *
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/capability.h>
+#include <linux/mm.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/vmalloc.h>
+
+#include "kexec.h"
+#include "kexec_internal.h"
+
+/* Header of a flattened device tree, all fields big-endian */
+struct kexec_fdt_header {
+	__be32 magic;
+	__be32 totalsize;
+	__be32 off_dt_struct;
+	__be32 off_dt_strings;
+	__be32 off_mem_rsvmap;
+	__be32 version;
+	__be32 last_comp_version;
+	__be32 boot_cpuid_phys;
+	__be32 size_dt_strings;
+	__be32 size_dt_struct;
+};
+
+struct kexec_fdt_reserve_entry {
+	__be64 address;
+	__be64 size;
+};
+
+#define KEXEC_FDT_MAGIC 0xd00dfeed
+
+/* Ranges to preserve, sorted by address and merged where adjacent */
+struct kexec_preserved_range *kexec_preserved;
+unsigned int kexec_preserved_nr;
+
+/* User pages pinned for the ranges above, one entry per registration */
+struct kexec_preserve_pin {
+	struct list_head list;
+	struct page **pages;
+	unsigned long nr_pages;
+};
+static LIST_HEAD(kexec_preserve_pins);
+
+/**
+ * kexec_preserve_find - Find the first preserved range that overlaps
+ * [@start, @end), or NULL if there is none.
+ */
+struct kexec_preserved_range *kexec_preserve_find(unsigned long start,
+						  unsigned long end)
+{
+	unsigned int lo = 0, hi = kexec_preserved_nr, mid;
+
+	/* The first range that ends after @start */
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (kexec_preserved[mid].start + kexec_preserved[mid].size <=
+		    start)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+
+	if (lo < kexec_preserved_nr && kexec_preserved[lo].start < end)
+		return &kexec_preserved[lo];
+	return NULL;
+}
+
+/**
+ * kexec_preserve_overlaps - Whether [@start, @end) overlaps a preserved range.
+ */
+bool kexec_preserve_overlaps(unsigned long start, unsigned long end)
+{
+	return kexec_preserve_find(start, end) != NULL;
+}
+
+static int kexec_preserve_cmp(const void *a, const void *b)
+{
+	const struct kexec_preserved_range *x = a, *y = b;
+
+	if (x->start == y->start)
+		return 0;
+	return x->start < y->start ? -1 : 1;
+}
+
+/*
+ * Merge the @nr ranges at @add, sorted by address, into the preserved ranges
+ * and coalesce adjacent ones. If any two ranges overlap, -EEXIST is returned
+ * and the preserved ranges are left as they were.
+ */
+static int kexec_preserve_merge(struct kexec_preserved_range *add,
+				unsigned long nr)
+{
+	struct kexec_preserved_range *ranges, *next, *last = NULL;
+	unsigned long i = 0, j = 0, n = 0;
+
+	ranges = kvmalloc_array(kexec_preserved_nr + nr, sizeof(*ranges),
+				GFP_KERNEL);
+	if (!ranges)
+		return -ENOMEM;
+
+	while (i < kexec_preserved_nr || j < nr) {
+		if (j == nr || (i < kexec_preserved_nr &&
+				kexec_preserved[i].start < add[j].start))
+			next = &kexec_preserved[i++];
+		else
+			next = &add[j++];
+
+		if (last && next->start < last->start + last->size) {
+			kvfree(ranges);
+			return -EEXIST;
+		}
+		if (last && next->start == last->start + last->size) {
+			last->size += next->size;
+			continue;
+		}
+		last = &ranges[n++];
+		*last = *next;
+	}
+
+	kvfree(kexec_preserved);
+	kexec_preserved = ranges;
+	kexec_preserved_nr = n;
+	return 0;
+}
+
+static int kexec_preserve_add(phys_addr_t start, u64 size)
+{
+	struct kexec_preserved_range range = { .start = start, .size = size };
+
+	return kexec_preserve_merge(&range, 1);
+}
+
+/*
+ * Pin the pages mapped at [@addr, @addr + @size) of the calling process, for
+ * instance a memfd, and preserve the physical memory behind them. The pages
+ * stay pinned until the ranges are cleared, also when the process exits.
+ * They may be scattered over physical memory, so they are sorted and merged
+ * into the ranges in one go.
+ */
+static int kexec_preserve_user(unsigned long addr, u64 size)
+{
+	unsigned long nr_pages = size >> PAGE_SHIFT, pinned = 0, i;
+	struct kexec_preserved_range *ranges = NULL;
+	struct kexec_preserve_pin *pin;
+	struct page **pages;
+	int ret = 0;
+
+	pin = kmalloc(sizeof(*pin), GFP_KERNEL);
+	pages = kvmalloc_array(nr_pages, sizeof(*pages), GFP_KERNEL);
+	if (!pin || !pages) {
+		ret = -ENOMEM;
+		goto out_free;
+	}
+
+	while (pinned < nr_pages) {
+		ret = get_user_pages_fast(addr + (pinned << PAGE_SHIFT),
+					  nr_pages - pinned, 1,
+					  pages + pinned);
+		if (ret <= 0) {
+			ret = ret ? ret : -EFAULT;
+			goto out_unpin;
+		}
+		pinned += ret;
+	}
+
+	ranges = kvmalloc_array(nr_pages, sizeof(*ranges), GFP_KERNEL);
+	if (!ranges) {
+		ret = -ENOMEM;
+		goto out_unpin;
+	}
+	for (i = 0; i < nr_pages; i++) {
+		ranges[i].start = page_to_phys(pages[i]);
+		ranges[i].size = PAGE_SIZE;
+	}
+	sort(ranges, nr_pages, sizeof(*ranges), kexec_preserve_cmp, NULL);
+
+	ret = kexec_preserve_merge(ranges, nr_pages);
+	kvfree(ranges);
+	if (ret)
+		goto out_unpin;
+
+	pin->pages = pages;
+	pin->nr_pages = nr_pages;
+	list_add(&pin->list, &kexec_preserve_pins);
+	return 0;
+
+out_unpin:
+	for (i = 0; i < pinned; i++)
+		put_page(pages[i]);
+out_free:
+	kvfree(pages);
+	kfree(pin);
+	return ret;
+}
+
+/**
+ * kexec_preserve_clear - Forget all preserved ranges and unpin their pages.
+ */
+void kexec_preserve_clear(void)
+{
+	struct kexec_preserve_pin *pin, *tmp;
+	unsigned long i;
+
+	list_for_each_entry_safe(pin, tmp, &kexec_preserve_pins, list) {
+		for (i = 0; i < pin->nr_pages; i++)
+			put_page(pin->pages[i]);
+		kvfree(pin->pages);
+		list_del(&pin->list);
+		kfree(pin);
+	}
+
+	kvfree(kexec_preserved);
+	kexec_preserved = NULL;
+	kexec_preserved_nr = 0;
+}
+
+/*
+ * Register memory to preserve across kexec: physical memory at @addr, or with
+ * KEXEC_PRESERVE_USER the pages mapped at @addr. A @size of zero clears all
+ * ranges. The ranges can only change while no image is loaded, since they are
+ * checked and published when an image is loaded.
+ */
+long sys_kexec_preserve(unsigned long addr, unsigned long size,
+			unsigned long flags)
+{
+	unsigned int slot;
+	long ret = 0;
+
+	if (!capable(CAP_SYS_BOOT) || kexec_load_disabled)
+		return -EPERM;
+
+	if (flags & ~KEXEC_PRESERVE_USER)
+		return -EINVAL;
+
+	if (!PAGE_ALIGNED(addr) || !PAGE_ALIGNED(size) || addr + size < addr)
+		return -EINVAL;
+
+	if (!mutex_trylock(&kexec_mutex))
+		return -EBUSY;
+
+	for (slot = 0; slot < KEXEC_SLOT_MAX; slot++) {
+		if (kexec_slots[slot]) {
+			ret = -EBUSY;
+			goto out;
+		}
+	}
+
+	if (!size)
+		kexec_preserve_clear();
+	else if (flags & KEXEC_PRESERVE_USER)
+		ret = kexec_preserve_user(addr, size);
+	else
+		ret = kexec_preserve_add(addr, size);
+
+out:
+	mutex_unlock(&kexec_mutex);
+	return ret;
+}
+
+/*
+ * Append the preserved ranges to the memory reservation map of the device
+ * tree in @segment, moving the blocks that follow it up. Returns -ENOENT if
+ * the segment holds no device tree.
+ */
+static int kexec_preserve_patch_fdt(struct kimage *image,
+				    struct kexec_segment *segment)
+{
+	struct kexec_fdt_reserve_entry *rsv;
+	struct kexec_fdt_header hdr;
+	size_t total, delta, end;
+	unsigned int i;
+	void *fdt;
+	int ret;
+
+	if (segment->bufsz < sizeof(hdr))
+		return -ENOENT;
+
+	ret = kimage_segment_rw(image, segment, &hdr, 0, sizeof(hdr), false);
+	if (ret)
+		return ret;
+	if (be32_to_cpu(hdr.magic) != KEXEC_FDT_MAGIC)
+		return -ENOENT;
+
+	total = be32_to_cpu(hdr.totalsize);
+	delta = kexec_preserved_nr * sizeof(*rsv);
+	if (total < sizeof(hdr) || total > segment->memsz)
+		return -EINVAL;
+	if (total + delta > segment->memsz) {
+		pr_err("No room in the device tree for %u reserved ranges.\n",
+		       kexec_preserved_nr);
+		return -ENOSPC;
+	}
+
+	fdt = vmalloc(total + delta);
+	if (!fdt)
+		return -ENOMEM;
+	ret = kimage_segment_rw(image, segment, fdt, 0, total, false);
+	if (ret)
+		goto out;
+
+	/* Find the entry that terminates the map */
+	end = be32_to_cpu(hdr.off_mem_rsvmap);
+	for (;;) {
+		if (end + sizeof(*rsv) > total) {
+			ret = -EINVAL;
+			goto out;
+		}
+		rsv = fdt + end;
+		if (!rsv->address && !rsv->size)
+			break;
+		end += sizeof(*rsv);
+	}
+
+	memmove(fdt + end + delta, fdt + end, total - end);
+	for (i = 0; i < kexec_preserved_nr; i++, rsv++) {
+		rsv->address = cpu_to_be64(kexec_preserved[i].start);
+		rsv->size = cpu_to_be64(kexec_preserved[i].size);
+	}
+
+	if (be32_to_cpu(hdr.off_dt_struct) >= end)
+		be32_add_cpu(&hdr.off_dt_struct, delta);
+	if (be32_to_cpu(hdr.off_dt_strings) >= end)
+		be32_add_cpu(&hdr.off_dt_strings, delta);
+	be32_add_cpu(&hdr.totalsize, delta);
+	memcpy(fdt, &hdr, sizeof(hdr));
+
+	ret = kimage_segment_rw(image, segment, fdt, 0, total + delta, true);
+out:
+	vfree(fdt);
+	return ret;
+}
+
+/**
+ * kexec_preserve_publish - Tell the next kernel about the preserved ranges.
+ *
+ * Called with the segments of @image loaded. The first segment that holds a
+ * device tree gets a /memreserve/ entry for each range, which keeps the next
+ * kernel from using the memory.
+ */
+int kexec_preserve_publish(struct kimage *image)
+{
+	unsigned long i;
+	int ret;
+
+	if (!kexec_preserved_nr || image->type == KEXEC_TYPE_CRASH ||
+	    image->dry_run)
+		return 0;
+
+	for (i = 0; i < image->nr_segments; i++) {
+		ret = kexec_preserve_patch_fdt(image, &image->segment[i]);
+		if (ret != -ENOENT)
+			return ret;
+	}
+
+	pr_warn("No device tree to publish the preserved ranges in.\n");
+	return 0;
+}
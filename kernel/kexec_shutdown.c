@@ -0,0 +1,548 @@
+/*
+ * Parallel and selective device shutdown for kexec_mod.
+ *
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/async.h>
+#include <linux/device.h>
+#include <linux/hash.h>
+#include <linux/kmod.h>
+#include <linux/log2.h>
+#include <linux/moduleparam.h>
+#include <linux/notifier.h>
+#include <linux/pci.h>
+#include <linux/pm_runtime.h>
+#include <linux/reboot.h>
+#include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/string.h>
+#include <linux/timekeeping.h>
+#include <linux/version.h>
+
+#include "kexec_compat.h"
+#include "kexec_internal.h"
+
+/* Shut down independent devices in parallel */
+int kexec_parallel_shutdown;
+
+/* Comma-separated names of devices to leave alone or only quiesce */
+char *kexec_shutdown_skip;
+char *kexec_shutdown_quiesce;
+
+/* Copies of the lists above, taken once the exec starts */
+static char *kexec_skip_list;
+static char *kexec_quiesce_list;
+
+/* Time each reboot notifier and device shutdown */
+int kexec_profile_shutdown;
+
+/* Number of slowest shutdown steps reported by the profiler */
+#define KEXEC_PROFILE_TOP 16
+
+/* Room for reboot notifiers and devices that show up late */
+#define KEXEC_PROFILE_SLACK 128
+
+struct kexec_profile_sample {
+	const char *kind;
+	char name[48];
+	u64 start_ns;
+	u64 duration_ns;
+};
+
+static struct {
+	struct kexec_profile_sample *samples;
+	unsigned int size;
+	atomic_t count;
+	u64 start_ns;
+} kexec_profile;
+
+/*
+ * Upper bound on the number of passes needed to order the devices, in case
+ * the device list does not follow the parent/child and supplier/consumer
+ * order we expect.
+ */
+#define KEXEC_SHUTDOWN_MAX_PASSES 8
+
+enum kexec_shutdown_action {
+	KEXEC_SHUTDOWN_FULL,
+	KEXEC_SHUTDOWN_QUIESCE,
+	KEXEC_SHUTDOWN_SKIP,
+};
+
+struct kexec_shutdown_dev {
+	struct device *dev;
+	struct hlist_node node;
+	unsigned int level;
+};
+
+struct kexec_shutdown_plan {
+	struct kexec_shutdown_dev *devs;
+	unsigned int nr_devs;
+	struct hlist_head *table;
+	unsigned int table_bits;
+	unsigned int nr_levels;
+};
+
+static void kexec_profile_start(void)
+{
+	struct kset *kset = kexec_compat_devices_kset();
+	struct kobject *kobj;
+	unsigned int size = KEXEC_PROFILE_SLACK;
+
+	spin_lock(&kset->list_lock);
+	list_for_each_entry(kobj, &kset->list, entry)
+		size++;
+	spin_unlock(&kset->list_lock);
+
+	kexec_profile.samples = kcalloc(size, sizeof(*kexec_profile.samples),
+					GFP_KERNEL);
+	kexec_profile.size = kexec_profile.samples ? size : 0;
+	atomic_set(&kexec_profile.count, 0);
+	kexec_profile.start_ns = ktime_get_ns();
+}
+
+/*
+ * Record a shutdown step that started at @start_ns and just finished. Safe to
+ * call from the parallel shutdown workers.
+ */
+static void kexec_profile_record(const char *kind, u64 start_ns,
+				 const char *fmt, ...)
+{
+	struct kexec_profile_sample *sample;
+	unsigned int index;
+	va_list args;
+
+	if (!kexec_profile.samples)
+		return;
+
+	index = atomic_inc_return(&kexec_profile.count) - 1;
+	if (index >= kexec_profile.size)
+		return;
+
+	sample = &kexec_profile.samples[index];
+	sample->kind = kind;
+	sample->start_ns = start_ns - kexec_profile.start_ns;
+	sample->duration_ns = ktime_get_ns() - start_ns;
+
+	va_start(args, fmt);
+	vsnprintf(sample->name, sizeof(sample->name), fmt, args);
+	va_end(args);
+}
+
+static int kexec_profile_cmp(const void *a, const void *b)
+{
+	const struct kexec_profile_sample *x = a, *y = b;
+
+	if (x->duration_ns == y->duration_ns)
+		return 0;
+	return x->duration_ns < y->duration_ns ? 1 : -1;
+}
+
+/*
+ * Print the slowest shutdown steps, with their start time relative to the
+ * start of the shutdown, so they end up in the log before machine_kexec().
+ */
+static void kexec_profile_report(void)
+{
+	unsigned int count, i;
+	u64 total_ns;
+
+	if (!kexec_profile.samples)
+		return;
+
+	total_ns = ktime_get_ns() - kexec_profile.start_ns;
+	count = min_t(unsigned int, atomic_read(&kexec_profile.count),
+		      kexec_profile.size);
+	sort(kexec_profile.samples, count, sizeof(*kexec_profile.samples),
+	     kexec_profile_cmp, NULL);
+
+	pr_info("Shutdown took %llu us over %u steps, slowest:\n",
+		div_u64(total_ns, NSEC_PER_USEC), count);
+	for (i = 0; i < min_t(unsigned int, count, KEXEC_PROFILE_TOP); i++) {
+		struct kexec_profile_sample *sample = &kexec_profile.samples[i];
+
+		pr_info("  +%8llu us %8llu us  %-8s %s\n",
+			div_u64(sample->start_ns, NSEC_PER_USEC),
+			div_u64(sample->duration_ns, NSEC_PER_USEC),
+			sample->kind, sample->name);
+	}
+
+	kfree(kexec_profile.samples);
+	kexec_profile.samples = NULL;
+	kexec_profile.size = 0;
+}
+
+static bool kexec_shutdown_listed(const char *list, const char *name)
+{
+	size_t len = strlen(name);
+
+	while (list && *list) {
+		if (!strncmp(list, name, len) &&
+		    (list[len] == ',' || list[len] == '\0'))
+			return true;
+
+		list = strchr(list, ',');
+		if (list)
+			list++;
+	}
+
+	return false;
+}
+
+/*
+ * Copy the device lists under the parameter lock, as they may be written
+ * through sysfs while the devices are shut down. Returns false if there is
+ * nothing on either list.
+ */
+static bool kexec_shutdown_lists_get(void)
+{
+	kernel_param_lock(THIS_MODULE);
+	kexec_skip_list = kstrdup(kexec_shutdown_skip, GFP_KERNEL);
+	kexec_quiesce_list = kstrdup(kexec_shutdown_quiesce, GFP_KERNEL);
+	if ((kexec_shutdown_skip && !kexec_skip_list) ||
+	    (kexec_shutdown_quiesce && !kexec_quiesce_list))
+		pr_warn("Cannot copy the device lists, shutting down all devices\n");
+	kernel_param_unlock(THIS_MODULE);
+
+	return kexec_skip_list || kexec_quiesce_list;
+}
+
+static void kexec_shutdown_lists_put(void)
+{
+	kfree(kexec_skip_list);
+	kfree(kexec_quiesce_list);
+	kexec_skip_list = NULL;
+	kexec_quiesce_list = NULL;
+}
+
+static enum kexec_shutdown_action kexec_shutdown_action(struct device *dev)
+{
+	if (kexec_shutdown_listed(kexec_skip_list, dev_name(dev)))
+		return KEXEC_SHUTDOWN_SKIP;
+	if (kexec_shutdown_listed(kexec_quiesce_list, dev_name(dev)))
+		return KEXEC_SHUTDOWN_QUIESCE;
+	return KEXEC_SHUTDOWN_FULL;
+}
+
+/*
+ * Stop a device from doing DMA into memory the next kernel is about to use,
+ * without running its driver's shutdown callback. Only PCI devices can be
+ * quiesced generically; other devices are left alone.
+ */
+static void kexec_quiesce_device(struct device *dev)
+{
+#ifdef CONFIG_PCI
+	if (dev_is_pci(dev)) {
+		pci_clear_master(to_pci_dev(dev));
+		return;
+	}
+#endif
+	dev_warn(dev, "cannot quiesce, skipping shutdown\n");
+}
+
+/*
+ * Mirrors the body of device_shutdown() for a single device. The parent is
+ * not locked: it is only shut down once all its children are done, and
+ * probing is blocked, so taking its lock would only serialize siblings.
+ */
+static void kexec_shutdown_device(struct device *dev)
+{
+	u64 start_ns = ktime_get_ns();
+
+	device_lock(dev);
+
+	pm_runtime_get_noresume(dev);
+	pm_runtime_barrier(dev);
+
+	switch (kexec_shutdown_action(dev)) {
+	case KEXEC_SHUTDOWN_SKIP:
+		dev_info(dev, "skipping shutdown\n");
+		break;
+	case KEXEC_SHUTDOWN_QUIESCE:
+		kexec_quiesce_device(dev);
+		break;
+	case KEXEC_SHUTDOWN_FULL:
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,15,0)
+		if (dev->class && dev->class->shutdown_pre)
+			dev->class->shutdown_pre(dev);
+#else
+		if (dev->class && dev->class->shutdown)
+			dev->class->shutdown(dev);
+#endif
+		if (dev->bus && dev->bus->shutdown)
+			dev->bus->shutdown(dev);
+		else if (dev->driver && dev->driver->shutdown)
+			dev->driver->shutdown(dev);
+		break;
+	}
+
+	device_unlock(dev);
+
+	kexec_profile_record("device", start_ns, "%s %s",
+			     dev_driver_string(dev), dev_name(dev));
+}
+
+static void kexec_shutdown_async(void *data, async_cookie_t cookie)
+{
+	struct kexec_shutdown_dev *sdev = data;
+
+	kexec_shutdown_device(sdev->dev);
+}
+
+static struct kexec_shutdown_dev *
+kexec_shutdown_find(struct kexec_shutdown_plan *plan, struct device *dev)
+{
+	struct kexec_shutdown_dev *sdev;
+	struct hlist_head *head;
+
+	head = &plan->table[hash_ptr(dev, plan->table_bits)];
+	hlist_for_each_entry(sdev, head, node) {
+		if (sdev->dev == dev)
+			return sdev;
+	}
+
+	return NULL;
+}
+
+/*
+ * Make sure @supplier is shut down at a later level than @consumer. Returns
+ * whether the level of @supplier had to be raised.
+ */
+static bool kexec_shutdown_order(struct kexec_shutdown_plan *plan,
+				 struct kexec_shutdown_dev *consumer,
+				 struct device *supplier)
+{
+	struct kexec_shutdown_dev *sdev;
+
+	if (!supplier)
+		return false;
+
+	sdev = kexec_shutdown_find(plan, supplier);
+	if (!sdev || sdev->level > consumer->level)
+		return false;
+
+	sdev->level = consumer->level + 1;
+	return true;
+}
+
+/*
+ * Assign each device a level, such that every device is shut down after its
+ * children and consumers. Devices on the same level are independent of each
+ * other. The devices are in device_shutdown() order, which already puts
+ * dependents first, so the levels normally settle after a single pass.
+ */
+static int kexec_shutdown_levels(struct kexec_shutdown_plan *plan)
+{
+	unsigned int i, pass;
+	bool changed = true;
+
+	for (pass = 0; changed && pass < KEXEC_SHUTDOWN_MAX_PASSES; pass++) {
+		changed = false;
+
+		for (i = 0; i < plan->nr_devs; i++) {
+			struct kexec_shutdown_dev *sdev = &plan->devs[i];
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,10,0)
+			struct device_link *link;
+
+			list_for_each_entry(link, &sdev->dev->links.suppliers, c_node)
+				changed |= kexec_shutdown_order(plan, sdev, link->supplier);
+#endif
+			changed |= kexec_shutdown_order(plan, sdev, sdev->dev->parent);
+		}
+	}
+
+	if (changed)
+		return -ELOOP;
+
+	for (i = 0; i < plan->nr_devs; i++)
+		plan->nr_levels = max(plan->nr_levels, plan->devs[i].level + 1);
+
+	return 0;
+}
+
+static void kexec_shutdown_release(struct kexec_shutdown_plan *plan)
+{
+	unsigned int i;
+
+	for (i = 0; i < plan->nr_devs; i++)
+		put_device(plan->devs[i].dev);
+
+	kfree(plan->devs);
+	kfree(plan->table);
+	plan->devs = NULL;
+	plan->table = NULL;
+	plan->nr_devs = 0;
+}
+
+/*
+ * Take a reference to every device, in the order device_shutdown() would shut
+ * them down.
+ */
+static int kexec_shutdown_collect(struct kexec_shutdown_plan *plan)
+{
+	struct kset *kset = kexec_compat_devices_kset();
+	struct kobject *kobj;
+	unsigned int size = 0, i;
+	bool overflow;
+
+	spin_lock(&kset->list_lock);
+	list_for_each_entry(kobj, &kset->list, entry)
+		size++;
+	spin_unlock(&kset->list_lock);
+
+	do {
+		/* Leave some room for devices that show up in the meantime */
+		size += 64;
+		plan->devs = kcalloc(size, sizeof(*plan->devs), GFP_KERNEL);
+		if (!plan->devs)
+			return -ENOMEM;
+
+		i = 0;
+		overflow = false;
+		spin_lock(&kset->list_lock);
+		list_for_each_entry_reverse(kobj, &kset->list, entry) {
+			if (i == size) {
+				overflow = true;
+				break;
+			}
+			plan->devs[i++].dev = get_device(kobj_to_dev(kobj));
+		}
+		spin_unlock(&kset->list_lock);
+
+		plan->nr_devs = i;
+		if (overflow) {
+			kexec_shutdown_release(plan);
+			size *= 2;
+		}
+	} while (overflow);
+
+	plan->table_bits = ilog2(roundup_pow_of_two(plan->nr_devs + 1));
+	plan->table = kcalloc(1 << plan->table_bits, sizeof(*plan->table),
+			      GFP_KERNEL);
+	if (!plan->table)
+		return -ENOMEM;
+
+	for (i = 0; i < plan->nr_devs; i++) {
+		struct kexec_shutdown_dev *sdev = &plan->devs[i];
+
+		hlist_add_head(&sdev->node,
+			       &plan->table[hash_ptr(sdev->dev, plan->table_bits)]);
+	}
+
+	return 0;
+}
+
+/*
+ * Shut down all devices like device_shutdown() does, but level by level, with
+ * the devices of a level shut down in parallel.
+ */
+static void kexec_device_shutdown(void)
+{
+	ASYNC_DOMAIN_EXCLUSIVE(domain);
+	struct kexec_shutdown_plan plan = {};
+	bool parallel = kexec_parallel_shutdown;
+	unsigned int i, level;
+	int err;
+
+	wait_for_device_probe();
+	device_block_probing();
+
+	err = kexec_shutdown_collect(&plan);
+	if (err) {
+		pr_warn("Falling back to device_shutdown(): %d\n", err);
+		kexec_shutdown_release(&plan);
+		device_shutdown();
+		return;
+	}
+
+	if (parallel && (err = kexec_shutdown_levels(&plan))) {
+		pr_warn("Falling back to serial device shutdown: %d\n", err);
+		parallel = false;
+	}
+
+	if (!parallel) {
+		for (i = 0; i < plan.nr_devs; i++)
+			kexec_shutdown_device(plan.devs[i].dev);
+		goto out;
+	}
+
+	pr_info("Shutting down %u devices in %u levels\n", plan.nr_devs,
+		plan.nr_levels);
+
+	for (level = 0; level < plan.nr_levels; level++) {
+		for (i = 0; i < plan.nr_devs; i++) {
+			if (plan.devs[i].level == level)
+				async_schedule_domain(kexec_shutdown_async,
+						      &plan.devs[i], &domain);
+		}
+		async_synchronize_full_domain(&domain);
+	}
+out:
+	kexec_shutdown_release(&plan);
+}
+
+/*
+ * Equivalent of blocking_notifier_call_chain() that times each notifier.
+ */
+static void kexec_reboot_notifiers(char *cmd)
+{
+	struct blocking_notifier_head *nh = kexec_compat_reboot_notifier_list();
+	struct notifier_block *nb;
+
+	if (!kexec_profile.samples) {
+		blocking_notifier_call_chain(nh, SYS_RESTART, cmd);
+		return;
+	}
+
+	down_read(&nh->rwsem);
+	for (nb = rcu_dereference_raw(nh->head); nb;
+	     nb = rcu_dereference_raw(nb->next)) {
+		u64 start_ns = ktime_get_ns();
+		int ret = nb->notifier_call(nb, SYS_RESTART, cmd);
+
+		kexec_profile_record("notifier", start_ns, "%ps",
+				     nb->notifier_call);
+		if (ret & NOTIFY_STOP_MASK)
+			break;
+	}
+	up_read(&nh->rwsem);
+}
+
+/*
+ * Replacement for kernel_restart_prepare() that shuts down the devices using
+ * kexec_device_shutdown().
+ */
+void kexec_restart_prepare(char *cmd)
+{
+	bool listed;
+
+	if (!kexec_compat_shutdown_available()) {
+		kernel_restart_prepare(cmd);
+		return;
+	}
+
+	listed = kexec_shutdown_lists_get();
+	if (!kexec_parallel_shutdown && !listed && !kexec_profile_shutdown) {
+		kernel_restart_prepare(cmd);
+		return;
+	}
+
+	if (kexec_profile_shutdown)
+		kexec_profile_start();
+
+	kexec_reboot_notifiers(cmd);
+	system_state = SYSTEM_RESTART;
+	usermodehelper_disable();
+	kexec_device_shutdown();
+	kexec_shutdown_lists_put();
+
+	kexec_profile_report();
+}
@@ -0,0 +1,97 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM kexec_mod
+
+#if !defined(_KEXEC_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _KEXEC_TRACE_H
+
+#include <linux/tracepoint.h>
+
+#include "kexec.h"
+
+TRACE_EVENT(kexec_alloc_page,
+
+	TP_PROTO(unsigned long destination, unsigned long addr),
+
+	TP_ARGS(destination, addr),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, destination)
+		__field(unsigned long, addr)
+	),
+
+	TP_fast_assign(
+		__entry->destination = destination;
+		__entry->addr = addr;
+	),
+
+	TP_printk("destination=%#lx addr=%#lx%s",
+		  __entry->destination, __entry->addr,
+		  __entry->destination == __entry->addr ? " in_place" : "")
+);
+
+TRACE_EVENT(kexec_alloc_control_pages,
+
+	TP_PROTO(unsigned int order, unsigned long addr, unsigned int retries),
+
+	TP_ARGS(order, addr, retries),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, order)
+		__field(unsigned long, addr)
+		__field(unsigned int, retries)
+	),
+
+	TP_fast_assign(
+		__entry->order = order;
+		__entry->addr = addr;
+		__entry->retries = retries;
+	),
+
+	TP_printk("order=%u addr=%#lx retries=%u",
+		  __entry->order, __entry->addr, __entry->retries)
+);
+
+TRACE_EVENT(kexec_load_stats,
+
+	TP_PROTO(const struct kexec_load_stats *stats),
+
+	TP_ARGS(stats),
+
+	TP_STRUCT__entry(
+		__field(unsigned long, pages_allocated)
+		__field(unsigned long, dest_collisions)
+		__field(unsigned long, swaps)
+		__field(unsigned long, dest_pages)
+		__field(unsigned long, unusable_pages)
+		__field(unsigned long, control_retries)
+		__field(unsigned long, indirection_pages)
+		__field(unsigned long, in_place_pages)
+	),
+
+	TP_fast_assign(
+		__entry->pages_allocated = stats->pages_allocated;
+		__entry->dest_collisions = stats->dest_collisions;
+		__entry->swaps = stats->swaps;
+		__entry->dest_pages = stats->dest_pages;
+		__entry->unusable_pages = stats->unusable_pages;
+		__entry->control_retries = stats->control_retries;
+		__entry->indirection_pages = stats->indirection_pages;
+		__entry->in_place_pages = stats->in_place_pages;
+	),
+
+	TP_printk("allocated=%lu collisions=%lu swaps=%lu dest=%lu unusable=%lu control_retries=%lu indirection=%lu in_place=%lu",
+		  __entry->pages_allocated, __entry->dest_collisions,
+		  __entry->swaps, __entry->dest_pages, __entry->unusable_pages,
+		  __entry->control_retries, __entry->indirection_pages,
+		  __entry->in_place_pages)
+);
+
+#endif /* _KEXEC_TRACE_H */
+
+/* The header lives in the module directory, not in include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE kexec_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,123 @@
+/*
+ * Integrity check of loaded images for kexec_mod: a SHA-256 digest of each
+ * segment, taken once the segment is final, which the relocation stub checks
+ * the segment against in its final place before entering the image.
+ *
+ * Copyright (C) 2021 Fabian Mastenbroek.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/highmem.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/version.h>
+
+#include <crypto/hash.h>
+
+#include "kexec.h"
+#include "kexec_internal.h"
+
+/* Have the relocation stub check loaded images before entering them */
+int kexec_verify;
+
+static int kexec_digest_page(struct shash_desc *desc, struct page *page)
+{
+	int ret;
+
+	ret = crypto_shash_update(desc, kmap(page), PAGE_SIZE);
+	kunmap(page);
+	cond_resched();
+	return ret;
+}
+
+/*
+ * Hash @segment as it will be after relocation. The source pages of a segment
+ * follow each other in the entry list, in the order of their destination.
+ */
+static int kexec_digest_segment(struct kimage *image, struct shash_desc *desc,
+				struct kexec_segment *segment, u8 *out)
+{
+	unsigned long maddr = segment->mem, end = segment->mem + segment->memsz;
+	unsigned long dest = 0;
+	kimage_entry_t *ptr, entry;
+	int ret;
+
+	ret = crypto_shash_init(desc);
+	if (ret)
+		return ret;
+
+	/* Crash segments are loaded in place */
+	if (image->type == KEXEC_TYPE_CRASH) {
+		for (; maddr < end && !ret; maddr += PAGE_SIZE)
+			ret = kexec_digest_page(desc,
+					boot_pfn_to_page(maddr >> PAGE_SHIFT));
+		goto out;
+	}
+
+	for_each_kimage_entry(image, ptr, entry) {
+		if (entry & IND_DESTINATION) {
+			dest = entry & PAGE_MASK;
+		} else if (entry & IND_SOURCE) {
+			if (dest == maddr && maddr < end) {
+				ret = kexec_digest_page(desc,
+					boot_pfn_to_page(entry >> PAGE_SHIFT));
+				if (ret)
+					return ret;
+				maddr += PAGE_SIZE;
+			}
+			dest += PAGE_SIZE;
+		}
+	}
+
+	if (maddr != end)
+		return -EINVAL;
+out:
+	return ret ? ret : crypto_shash_final(desc, out);
+}
+
+/**
+ * kimage_digest_segments - Take the digests the relocation stub checks.
+ *
+ * Called with the segments of @image loaded and patched, so that the digests
+ * cover the segments as the image will see them. Does nothing unless the
+ * verify parameter was set when the load started, see image->verify.
+ */
+int kimage_digest_segments(struct kimage *image)
+{
+	struct crypto_shash *tfm;
+	unsigned long i;
+	int ret = 0;
+
+	if (!image->verify || image->dry_run)
+		return 0;
+
+	tfm = crypto_alloc_shash("sha256", 0, 0);
+	if (IS_ERR(tfm)) {
+		pr_err("Failed to allocate sha256: %ld\n", PTR_ERR(tfm));
+		return PTR_ERR(tfm);
+	}
+
+	{
+		SHASH_DESC_ON_STACK(desc, tfm);
+
+		desc->tfm = tfm;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(5,1,0)
+		desc->flags = 0;
+#endif
+
+		for (i = 0; i < image->nr_segments && !ret; i++)
+			ret = kexec_digest_segment(image, desc,
+						   &image->segment[i],
+						   image->digest[i]);
+		shash_desc_zero(desc);
+	}
+
+	crypto_free_shash(tfm);
+	return ret;
+}
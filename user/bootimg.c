@@ -0,0 +1,265 @@
+/*
+ * Android boot.img and vendor_boot parsing for kexec-load, after the layout
+ * of system/tools/mkbootimg/include/bootimg/bootimg.h. All fields are
+ * little-endian, and each part starts on a page of the image.
+ */
+#include <endian.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "bootimg.h"
+
+#define BOOT_MAGIC		"ANDROID!"
+#define VENDOR_BOOT_MAGIC	"VNDRBOOT"
+#define BOOT_MAGIC_SIZE		8
+
+/* Page size of boot.img from version 3 on */
+#define BOOT_V3_PAGE_SIZE	4096
+
+#define FDT_MAGIC		0xd00dfeed
+
+/* Header versions 0 to 2 */
+struct boot_img_hdr_v0 {
+	uint8_t magic[BOOT_MAGIC_SIZE];
+	uint32_t kernel_size;
+	uint32_t kernel_addr;
+	uint32_t ramdisk_size;
+	uint32_t ramdisk_addr;
+	uint32_t second_size;
+	uint32_t second_addr;
+	uint32_t tags_addr;
+	uint32_t page_size;
+	uint32_t header_version;
+	uint32_t os_version;
+	uint8_t name[16];
+	uint8_t cmdline[512];
+	uint32_t id[8];
+	uint8_t extra_cmdline[1024];
+	/* Version 1 */
+	uint32_t recovery_dtbo_size;
+	uint64_t recovery_dtbo_offset;
+	uint32_t header_size;
+	/* Version 2 */
+	uint32_t dtb_size;
+	uint64_t dtb_addr;
+} __attribute__((packed));
+
+/* Header versions 3 and 4 */
+struct boot_img_hdr_v3 {
+	uint8_t magic[BOOT_MAGIC_SIZE];
+	uint32_t kernel_size;
+	uint32_t ramdisk_size;
+	uint32_t os_version;
+	uint32_t header_size;
+	uint32_t reserved[4];
+	uint32_t header_version;
+	uint8_t cmdline[1536];
+	/* Version 4 */
+	uint32_t signature_size;
+} __attribute__((packed));
+
+/* vendor_boot header versions 3 and 4 */
+struct vendor_boot_img_hdr {
+	uint8_t magic[BOOT_MAGIC_SIZE];
+	uint32_t header_version;
+	uint32_t page_size;
+	uint32_t kernel_addr;
+	uint32_t ramdisk_addr;
+	uint32_t vendor_ramdisk_size;
+	uint8_t cmdline[2048];
+	uint32_t tags_addr;
+	uint8_t name[16];
+	uint32_t header_size;
+	uint32_t dtb_size;
+	uint64_t dtb_addr;
+	/* Version 4 */
+	uint32_t vendor_ramdisk_table_size;
+	uint32_t vendor_ramdisk_table_entry_num;
+	uint32_t vendor_ramdisk_table_entry_size;
+	uint32_t bootconfig_size;
+} __attribute__((packed));
+
+/* Where the next part of an image starts, and the image it is in */
+struct cursor {
+	const uint8_t *map;
+	size_t len;
+	size_t off;
+	uint32_t page_size;
+};
+
+/* Take the next part of @size bytes, which may be empty */
+static int take(struct cursor *c, uint32_t size, struct part *part)
+{
+	if (c->off > c->len || size > c->len - c->off) {
+		fprintf(stderr, "boot image truncated\n");
+		return -1;
+	}
+	if (part) {
+		part->buf = size ? c->map + c->off : NULL;
+		part->len = size;
+	}
+	c->off += ((uint64_t)size + c->page_size - 1) / c->page_size *
+		  c->page_size;
+	return 0;
+}
+
+static int check_page_size(uint32_t page_size)
+{
+	if (page_size < 2048 || page_size > (1 << 20) ||
+	    (page_size & (page_size - 1))) {
+		fprintf(stderr, "bad boot image page size %u\n", page_size);
+		return -1;
+	}
+	return 0;
+}
+
+/* Only the first of a series of device trees is passed on */
+static void first_dtb(struct part *dtb)
+{
+	const uint32_t *h = dtb->buf;
+	uint32_t total;
+
+	if (dtb->len < 8 || be32toh(h[0]) != FDT_MAGIC) {
+		dtb->buf = NULL;
+		dtb->len = 0;
+		return;
+	}
+	total = be32toh(h[1]);
+	if (total < dtb->len)
+		dtb->len = total;
+}
+
+/* Append @len bytes of the command line in @s, which may lack a NUL */
+static void add_cmdline(struct boot_image *img, const uint8_t *s, size_t len,
+			int space)
+{
+	size_t n = strlen(img->cmdline), add = strnlen((const char *)s, len);
+
+	if (!add || n + add + 2 > sizeof(img->cmdline))
+		return;
+	if (n && space)
+		img->cmdline[n++] = ' ';
+	memcpy(img->cmdline + n, s, add);
+	img->cmdline[n + add] = '\0';
+}
+
+int bootimg_is_boot(const void *map, size_t len)
+{
+	return len >= BOOT_V3_PAGE_SIZE &&
+	       !memcmp(map, BOOT_MAGIC, BOOT_MAGIC_SIZE);
+}
+
+int bootimg_parse_boot(const void *map, size_t len, struct boot_image *img)
+{
+	const struct boot_img_hdr_v0 *v0 = map;
+	const struct boot_img_hdr_v3 *v3 = map;
+	struct cursor c = { map, len, 0, 0 };
+	struct part ramdisk;
+	uint32_t version;
+
+	/* The version is at the same offset in all headers */
+	if (!bootimg_is_boot(map, len))
+		return -1;
+	version = le32toh(v0->header_version);
+
+	if (version <= 2) {
+		c.page_size = le32toh(v0->page_size);
+		if (check_page_size(c.page_size))
+			return -1;
+		/* The header takes the first page */
+		c.off = c.page_size;
+		if (take(&c, le32toh(v0->kernel_size), &img->kernel) ||
+		    take(&c, le32toh(v0->ramdisk_size), &ramdisk) ||
+		    take(&c, le32toh(v0->second_size), NULL))
+			return -1;
+		if (version >= 1 &&
+		    take(&c, le32toh(v0->recovery_dtbo_size), NULL))
+			return -1;
+		if (version == 2 && take(&c, le32toh(v0->dtb_size), &img->dtb))
+			return -1;
+
+		/* The extra command line continues the first, no space */
+		add_cmdline(img, v0->cmdline, sizeof(v0->cmdline), 1);
+		add_cmdline(img, v0->extra_cmdline, sizeof(v0->extra_cmdline),
+			    0);
+	} else if (version <= 4) {
+		c.page_size = BOOT_V3_PAGE_SIZE;
+		c.off = BOOT_V3_PAGE_SIZE;
+		if (take(&c, le32toh(v3->kernel_size), &img->kernel) ||
+		    take(&c, le32toh(v3->ramdisk_size), &ramdisk))
+			return -1;
+
+		add_cmdline(img, v3->cmdline, sizeof(v3->cmdline), 1);
+	} else {
+		fprintf(stderr, "boot image header version %u not supported\n",
+			version);
+		return -1;
+	}
+
+	if (!img->kernel.len) {
+		fprintf(stderr, "boot image without a kernel\n");
+		return -1;
+	}
+	if (ramdisk.len)
+		img->ramdisk[img->nr_ramdisks++] = ramdisk;
+	first_dtb(&img->dtb);
+	return 0;
+}
+
+int bootimg_parse_vendor(const void *map, size_t len, struct boot_image *img)
+{
+	const struct vendor_boot_img_hdr *h = map;
+	struct cursor c = { map, len, 0, 0 };
+	struct part ramdisk, dtb;
+	uint32_t version;
+	char cmdline[sizeof(img->cmdline)];
+
+	if (len < sizeof(*h) ||
+	    memcmp(h->magic, VENDOR_BOOT_MAGIC, BOOT_MAGIC_SIZE)) {
+		fprintf(stderr, "not a vendor_boot image\n");
+		return -1;
+	}
+	version = le32toh(h->header_version);
+	if (version < 3 || version > 4) {
+		fprintf(stderr, "vendor_boot header version %u not supported\n",
+			version);
+		return -1;
+	}
+
+	c.page_size = le32toh(h->page_size);
+	if (check_page_size(c.page_size))
+		return -1;
+
+	/*
+	 * The ramdisk section holds all vendor ramdisks back to back, loading
+	 * it whole is loading all of them.
+	 */
+	if (take(&c, le32toh(h->header_size), NULL) ||
+	    take(&c, le32toh(h->vendor_ramdisk_size), &ramdisk) ||
+	    take(&c, le32toh(h->dtb_size), &dtb))
+		return -1;
+	if (version == 4 &&
+	    (take(&c, le32toh(h->vendor_ramdisk_table_size), NULL) ||
+	     take(&c, le32toh(h->bootconfig_size), &img->bootconfig)))
+		return -1;
+
+	/* Vendor ramdisks go first, the generic ramdisk overlays them */
+	if (ramdisk.len) {
+		if (img->nr_ramdisks)
+			img->ramdisk[1] = img->ramdisk[0];
+		img->ramdisk[0] = ramdisk;
+		img->nr_ramdisks++;
+	}
+
+	first_dtb(&dtb);
+	if (dtb.len)
+		img->dtb = dtb;
+
+	/* The vendor command line comes first */
+	strcpy(cmdline, img->cmdline);
+	img->cmdline[0] = '\0';
+	add_cmdline(img, h->cmdline, sizeof(h->cmdline), 1);
+	add_cmdline(img, (const uint8_t *)cmdline, sizeof(cmdline), 1);
+	return 0;
+}
@@ -0,0 +1,42 @@
+/*
+ * Android boot.img and vendor_boot parsing for kexec-load. The parts of the
+ * image are returned as pointers into its mapping, nothing is copied.
+ */
+#ifndef BOOTIMG_H
+#define BOOTIMG_H
+
+#include <stddef.h>
+
+struct part {
+	const void *buf;
+	size_t len;
+};
+
+/* Vendor ramdisks, then the generic ramdisk of boot.img */
+#define BOOTIMG_MAX_RAMDISKS 2
+
+struct boot_image {
+	struct part kernel;
+	struct part ramdisk[BOOTIMG_MAX_RAMDISKS];
+	int nr_ramdisks;
+	/* The first device tree of boot.img (v2) or vendor_boot */
+	struct part dtb;
+	/* Bootconfig parameters of vendor_boot (v4), without the trailer */
+	struct part bootconfig;
+	/* The vendor_boot command line followed by that of boot.img */
+	char cmdline[4096];
+};
+
+/* Whether @map is a boot.img */
+int bootimg_is_boot(const void *map, size_t len);
+
+/* Parse the boot.img in @map, header versions 0 to 4 */
+int bootimg_parse_boot(const void *map, size_t len, struct boot_image *img);
+
+/*
+ * Parse the vendor_boot in @map, header versions 3 and 4. Its ramdisks go
+ * before the one of boot.img, so parse boot.img first.
+ */
+int bootimg_parse_vendor(const void *map, size_t len, struct boot_image *img);
+
+#endif /* BOOTIMG_H */
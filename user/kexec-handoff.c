@@ -0,0 +1,110 @@
+/*
+ * kexec-handoff: Report the timestamps the previous kernel left behind in the
+ * kexec handoff page (see handoff_addr of kexec_mod_arm64).
+ *
+ * Usage: kexec-handoff <physical address of the handoff page>
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+
+#define KEXEC_HANDOFF_MAGIC 0x314f48434558454bULL /* "KEXECHO1" */
+
+/* Mirrors struct kexec_handoff in kernel/arch/arm64/relocate_kernel.h */
+struct kexec_handoff {
+	uint64_t magic;
+	uint64_t cntfrq;
+	uint64_t exec_ns;
+	uint64_t machine_kexec;
+	uint64_t stub_entry;
+	uint64_t copy_done;
+	uint64_t jump;
+	uint64_t nr_pages;
+	uint64_t nr_bytes;
+	uint64_t return_addr;
+	uint64_t verified;
+};
+
+static double ticks_to_us(const struct kexec_handoff *h, uint64_t from,
+			  uint64_t to)
+{
+	return (double)(to - from) * 1e6 / h->cntfrq;
+}
+
+int main(int argc, char **argv)
+{
+	const struct kexec_handoff *h;
+	unsigned long long addr;
+	long page_size = sysconf(_SC_PAGESIZE);
+	double copy_us, handoff_us;
+	void *page;
+	int fd;
+
+	if (argc != 2) {
+		fprintf(stderr, "usage: %s <handoff page address>\n", argv[0]);
+		return 2;
+	}
+	addr = strtoull(argv[1], NULL, 0);
+
+	fd = open("/dev/mem", O_RDONLY | O_SYNC);
+	if (fd < 0) {
+		perror("open /dev/mem");
+		return 1;
+	}
+	page = mmap(NULL, page_size, PROT_READ, MAP_SHARED, fd,
+		    addr & ~(unsigned long long)(page_size - 1));
+	if (page == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+	h = (const struct kexec_handoff *)((char *)page +
+					   (addr & (page_size - 1)));
+
+	if (h->magic != KEXEC_HANDOFF_MAGIC || !h->cntfrq) {
+		fprintf(stderr, "no kexec handoff data at %#llx\n", addr);
+		return 1;
+	}
+
+	copy_us = ticks_to_us(h, h->stub_entry, h->copy_done);
+	handoff_us = ticks_to_us(h, h->machine_kexec, h->jump);
+
+	printf("counter frequency:   %llu Hz\n",
+	       (unsigned long long)h->cntfrq);
+	printf("pages relocated:     %llu (%llu bytes)\n",
+	       (unsigned long long)h->nr_pages,
+	       (unsigned long long)h->nr_bytes);
+	printf("shutdown:            %.1f us\n", h->exec_ns / 1e3);
+	printf("kernel to stub:      %.1f us\n",
+	       ticks_to_us(h, h->machine_kexec, h->stub_entry));
+	printf("relocation copy:     %.1f us", copy_us);
+	if (copy_us > 0)
+		printf(" (%.1f MB/s)", h->nr_bytes / copy_us);
+	printf("\n");
+	if (h->verified)
+		printf("integrity check:     %.1f us\n",
+		       ticks_to_us(h, h->copy_done, h->verified));
+	printf("stub total:          %.1f us\n",
+	       ticks_to_us(h, h->stub_entry, h->jump));
+	printf("old-to-new downtime: %.1f us\n",
+	       h->exec_ns / 1e3 + handoff_us);
+	if (h->return_addr)
+		printf("kexec jump return:   %#llx\n",
+		       (unsigned long long)h->return_addr);
+
+#ifdef __aarch64__
+	{
+		uint64_t now;
+
+		asm volatile("isb; mrs %0, cntvct_el0" : "=r" (now));
+		printf("new kernel entry:    %.1f us ago\n",
+		       ticks_to_us(h, h->jump, now));
+	}
+#endif
+
+	munmap(page, page_size);
+	close(fd);
+	return 0;
+}
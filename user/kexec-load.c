@@ -0,0 +1,902 @@
+/*
+ * kexec-load: Load an arm64 kernel into kexec_mod without kexec-tools. The
+ * Image, initrd and device tree are mapped rather than read, and the kernel
+ * copies the segments straight out of the page cache in a single load ioctl.
+ * The time each step takes is reported on stderr.
+ *
+ * Usage: kexec-load [-s slot] [-i initrd] [-d dtb | -b] [-c cmdline | -r]
+ *                   [-v vendor_boot] Image | boot.img
+ *        kexec-load [-s slot] -u | -e
+ *
+ * The kernel may also come from an Android boot.img, a file or a partition,
+ * with its ramdisk and command line and those of the vendor_boot given with
+ * -v. The vendor ramdisks and the generic ramdisk are loaded back to back as
+ * one initrd. -i replaces the ramdisks and -c or -r the command line. The
+ * kernel must be an uncompressed Image, which rules out the Image.gz and
+ * Image.lz4 of most GKI boot images.
+ *
+ * Without -d the module builds the device tree from the one the running kernel
+ * booted with, or with -b the one in the boot images is used. -r reuses the
+ * command line of the running kernel. -u unloads the slot and -e executes it.
+ */
+#include <endian.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/stat.h>
+#include <linux/fs.h>
+
+#include "../kernel/kexec_ioctl.h"
+#include "bootimg.h"
+
+#define MAX_RANGES 256
+
+/* Mirrors struct kexec_segment in kernel/kexec.h */
+struct kexec_segment {
+	const void *buf;
+	size_t bufsz;
+	unsigned long mem;
+	size_t memsz;
+};
+
+/* The header at the start of an arm64 Image, all fields little-endian */
+struct arm64_header {
+	uint32_t code0;
+	uint32_t code1;
+	uint64_t text_offset;
+	uint64_t image_size;
+	uint64_t flags;
+	uint64_t res2;
+	uint64_t res3;
+	uint64_t res4;
+	uint32_t magic;
+	uint32_t res5;
+};
+
+#define ARM64_MAGIC		0x644d5241	/* "ARM\x64" */
+#define ARM64_FLAG_BE		(1 << 0)
+#define ARM64_FLAG_ANYWHERE	(1 << 3)
+
+struct range {
+	unsigned long long start;
+	unsigned long long end;
+};
+
+static unsigned long page_size;
+
+#define ALIGN_UP(x, a) (((x) + (a) - 1) & ~((unsigned long long)(a) - 1))
+
+static double now_us(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static double step_start;
+
+/* Report the time since the previous step */
+static void step(const char *name)
+{
+	double t = now_us();
+
+	fprintf(stderr, "%-10s %10.1f us\n", name, t - step_start);
+	step_start = t;
+}
+
+/*
+ * Whether @buf starts like a gzip or lz4 stream, the forms a kernel in a
+ * boot.img usually takes. kexec-load does not decompress them.
+ */
+static int is_compressed(const void *buf, size_t len)
+{
+	static const unsigned char magic[][4] = {
+		{ 0x1f, 0x8b },			/* gzip, 2 bytes */
+		{ 0x02, 0x21, 0x4c, 0x18 },	/* lz4 legacy */
+		{ 0x04, 0x22, 0x4d, 0x18 },	/* lz4 frame */
+	};
+	size_t i;
+
+	for (i = 0; i < sizeof(magic) / sizeof(magic[0]); i++) {
+		size_t n = i ? 4 : 2;
+
+		if (len >= n && !memcmp(buf, magic[i], n))
+			return 1;
+	}
+	return 0;
+}
+
+/* Map @path read-only, the mapping stays until the process exits */
+static const void *map_file(const char *path, size_t *len)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		return NULL;
+	}
+	/* Partitions have no size of their own */
+	if (S_ISBLK(st.st_mode)) {
+		uint64_t size;
+
+		if (ioctl(fd, BLKGETSIZE64, &size) < 0) {
+			perror(path);
+			return NULL;
+		}
+		st.st_size = size;
+	}
+	if (!st.st_size) {
+		fprintf(stderr, "%s: empty\n", path);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE | MAP_POPULATE,
+		   fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror(path);
+		return NULL;
+	}
+
+	*len = st.st_size;
+	return map;
+}
+
+/*
+ * Read @path into a buffer that stays until the process exits, for device
+ * trees. Files in sysfs such as /sys/firmware/fdt cannot be mapped.
+ */
+static const void *read_file(const char *path, size_t *len)
+{
+	size_t size = 0, room = 0;
+	char *buf = NULL, *p;
+	ssize_t n;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		perror(path);
+		return NULL;
+	}
+	for (;;) {
+		if (size == room) {
+			room = room ? 2 * room : 64 << 10;
+			p = realloc(buf, room);
+			if (!p)
+				goto err;
+			buf = p;
+		}
+		n = read(fd, buf + size, room - size);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			goto err;
+		if (!n)
+			break;
+		size += n;
+	}
+	close(fd);
+
+	if (!size) {
+		fprintf(stderr, "%s: empty\n", path);
+		free(buf);
+		return NULL;
+	}
+	*len = size;
+	return buf;
+
+err:
+	perror(path);
+	close(fd);
+	free(buf);
+	return NULL;
+}
+
+static char *read_text(const char *path)
+{
+	static char buf[4096];
+	size_t n;
+	FILE *f = fopen(path, "r");
+
+	if (!f) {
+		perror(path);
+		return NULL;
+	}
+	n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	while (n && buf[n - 1] == '\n')
+		n--;
+	buf[n] = '\0';
+	return buf;
+}
+
+/*
+ * Where the kernel must go: text_offset bytes into a 2MB aligned region,
+ * taking image_size bytes there.
+ */
+static int parse_arm64(const void *kernel, size_t len,
+		       unsigned long long *offset, unsigned long long *memsz)
+{
+	const struct arm64_header *h = kernel;
+	uint64_t flags;
+
+	if (len < sizeof(*h) || le32toh(h->magic) != ARM64_MAGIC ||
+	    !le64toh(h->image_size)) {
+		fprintf(stderr, "not an arm64 Image\n");
+		return -1;
+	}
+
+	flags = le64toh(h->flags);
+	if (!!(flags & ARM64_FLAG_BE) != (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)) {
+		fprintf(stderr, "Image endianness does not match\n");
+		return -1;
+	}
+	if (!(flags & ARM64_FLAG_ANYWHERE)) {
+		fprintf(stderr, "Image is not relocatable\n");
+		return -1;
+	}
+
+	*offset = le64toh(h->text_offset);
+	*memsz = le64toh(h->image_size);
+	if (*memsz < len)
+		*memsz = len;
+	return 0;
+}
+
+/* Append [@start, @end) to the growing array @ranges of @nr entries */
+static int add_range(struct range **ranges, int *nr,
+		     unsigned long long start, unsigned long long end)
+{
+	struct range *r = *ranges;
+
+	if (!(*nr % MAX_RANGES)) {
+		r = realloc(r, (*nr + MAX_RANGES) * sizeof(*r));
+		if (!r) {
+			perror("realloc");
+			return -1;
+		}
+		*ranges = r;
+	}
+	r[(*nr)++] = (struct range){ start, end };
+	return 0;
+}
+
+/*
+ * Memory the image may go in: System RAM from /proc/iomem, and what it must
+ * not overlap: reserved memory, the crash kernel region and the ranges
+ * kexec_mod preserves. There can be thousands of the latter, so @busy grows
+ * as needed and is for the caller to free.
+ */
+static int read_memory(struct range *ram, int *nr_ram,
+		       struct range **busy, int *nr_busy)
+{
+	unsigned long long start, end;
+	char line[256];
+	int name;
+	FILE *f;
+
+	*nr_ram = *nr_busy = 0;
+	*busy = NULL;
+
+	f = fopen("/proc/iomem", "r");
+	if (!f) {
+		perror("/proc/iomem");
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (sscanf(line, " %llx-%llx : %n", &start, &end, &name) != 2)
+			continue;
+		line[strcspn(line, "\n")] = '\0';
+
+		if (line[0] != ' ' && !strcmp(line + name, "System RAM")) {
+			if (*nr_ram < MAX_RANGES)
+				ram[(*nr_ram)++] = (struct range){ start, end + 1 };
+		} else if (!strncmp(line, "  ", 2) && line[2] != ' ' &&
+			   (!strcmp(line + name, "reserved") ||
+			    !strcmp(line + name, "Crash kernel"))) {
+			if (add_range(busy, nr_busy, start, end + 1)) {
+				fclose(f);
+				return -1;
+			}
+		}
+	}
+	fclose(f);
+
+	/* Without root all addresses read as zero */
+	if (*nr_ram && !ram[0].end) {
+		fprintf(stderr, "/proc/iomem: addresses hidden\n");
+		return -1;
+	}
+
+	f = fopen("/sys/kernel/kexec/preserved", "r");
+	if (f) {
+		while (fscanf(f, "%llx %llx", &start, &end) == 2) {
+			if (add_range(busy, nr_busy, start, start + end)) {
+				fclose(f);
+				return -1;
+			}
+		}
+		fclose(f);
+	}
+	return 0;
+}
+
+/*
+ * Find the lowest address that is @offset into an @align aligned block and
+ * has @size bytes of RAM free after it.
+ */
+static int place(unsigned long long align, unsigned long long offset,
+		 unsigned long long size, unsigned long long *mem)
+{
+	static struct range ram[MAX_RANGES];
+	struct range *busy;
+	unsigned long long base, addr;
+	int nr_ram, nr_busy, i, j;
+
+	if (read_memory(ram, &nr_ram, &busy, &nr_busy)) {
+		free(busy);
+		return -1;
+	}
+
+	for (i = 0; i < nr_ram; i++) {
+		base = ram[i].start;
+		for (;;) {
+			addr = ALIGN_UP(base, align) + offset;
+			if (addr + size > ram[i].end)
+				break;
+			for (j = 0; j < nr_busy; j++) {
+				if (addr < busy[j].end &&
+				    addr + size > busy[j].start)
+					break;
+			}
+			if (j == nr_busy) {
+				*mem = addr;
+				free(busy);
+				return 0;
+			}
+			base = busy[j].end;
+		}
+	}
+
+	free(busy);
+	fprintf(stderr, "no room for a %llu byte image\n", size);
+	return -1;
+}
+
+/*
+ * Room the module needs in the device tree to publish the preserved ranges,
+ * a 16 byte /memreserve/ entry for each.
+ */
+static unsigned long long preserve_room(void)
+{
+	unsigned long long start, size, nr = 0;
+	FILE *f;
+
+	f = fopen("/sys/kernel/kexec/preserved", "r");
+	if (!f)
+		return 0;
+	while (fscanf(f, "%llx %llx", &start, &size) == 2)
+		nr++;
+	fclose(f);
+	return nr * 16;
+}
+
+/*
+ * A minimal flattened device tree writer: the tree is copied token by token,
+ * with the properties of /chosen replaced.
+ */
+#define FDT_MAGIC	0xd00dfeed
+#define FDT_BEGIN_NODE	1
+#define FDT_END_NODE	2
+#define FDT_PROP	3
+#define FDT_NOP		4
+#define FDT_END		9
+
+struct fdt_header {
+	uint32_t magic;
+	uint32_t totalsize;
+	uint32_t off_dt_struct;
+	uint32_t off_dt_strings;
+	uint32_t off_mem_rsvmap;
+	uint32_t version;
+	uint32_t last_comp_version;
+	uint32_t boot_cpuid_phys;
+	uint32_t size_dt_strings;
+	uint32_t size_dt_struct;
+};
+
+struct fdt_out {
+	char *buf;
+	size_t size;
+	/* End of the structure block being written */
+	size_t st;
+	/* The strings block, moved down behind the structure block at the end */
+	size_t str_start;
+	size_t str_size;
+};
+
+/* /chosen properties that only applied to the running kernel */
+static const char *const chosen_drop[] = {
+	"bootargs", "linux,initrd-start", "linux,initrd-end",
+	"linux,elfcorehdr", "linux,usable-memory-range", "kaslr-seed",
+	"rng-seed", NULL,
+};
+
+static void fdt_put(struct fdt_out *o, const void *data, size_t len)
+{
+	memcpy(o->buf + o->st, data, len);
+	memset(o->buf + o->st + len, 0, ALIGN_UP(len, 4) - len);
+	o->st += ALIGN_UP(len, 4);
+}
+
+static void fdt_put32(struct fdt_out *o, uint32_t v)
+{
+	v = htobe32(v);
+	fdt_put(o, &v, 4);
+}
+
+/* Offset of @name in the strings block, added if it is not there yet */
+static uint32_t fdt_string(struct fdt_out *o, const char *name)
+{
+	size_t len = strlen(name) + 1, off;
+
+	for (off = 0; off < o->str_size; off += strlen(o->buf + o->str_start + off) + 1) {
+		if (!strcmp(o->buf + o->str_start + off, name))
+			return off;
+	}
+	memcpy(o->buf + o->str_start + o->str_size, name, len);
+	o->str_size += len;
+	return off;
+}
+
+static void fdt_put_prop(struct fdt_out *o, const char *name,
+			 const void *val, size_t len)
+{
+	fdt_put32(o, FDT_PROP);
+	fdt_put32(o, len);
+	fdt_put32(o, fdt_string(o, name));
+	fdt_put(o, val, len);
+}
+
+static void fdt_put_u64(struct fdt_out *o, const char *name, uint64_t v)
+{
+	v = htobe64(v);
+	fdt_put_prop(o, name, &v, 8);
+}
+
+static void fdt_put_chosen(struct fdt_out *o, const char *cmdline,
+			   unsigned long long initrd_start,
+			   unsigned long long initrd_end)
+{
+	uint8_t seed[8 + 128];
+
+	if (cmdline)
+		fdt_put_prop(o, "bootargs", cmdline, strlen(cmdline) + 1);
+	if (initrd_end) {
+		fdt_put_u64(o, "linux,initrd-start", initrd_start);
+		fdt_put_u64(o, "linux,initrd-end", initrd_end);
+	}
+	if (getrandom(seed, sizeof(seed), 0) == sizeof(seed)) {
+		fdt_put_prop(o, "kaslr-seed", seed, 8);
+		fdt_put_prop(o, "rng-seed", seed + 8, sizeof(seed) - 8);
+	}
+}
+
+/*
+ * Copy the device tree in @fdt with /chosen pointing to @cmdline and the
+ * initrd. Returns a malloc()ed tree.
+ */
+static void *patch_fdt(const void *fdt, size_t len, const char *cmdline,
+		       unsigned long long initrd_start,
+		       unsigned long long initrd_end, size_t *size)
+{
+	const struct fdt_header *h = fdt;
+	const char *st, *strings;
+	struct fdt_out o = { 0 };
+	size_t rsv, rsv_len, st_size, pos = 0, room;
+	int depth = 0, in_chosen = 0, chosen = 0;
+	uint32_t tag, plen, nameoff;
+	struct fdt_header *out;
+
+	if (len < sizeof(*h) || be32toh(h->magic) != FDT_MAGIC ||
+	    be32toh(h->totalsize) > len || be32toh(h->version) < 16) {
+		fprintf(stderr, "bad device tree\n");
+		return NULL;
+	}
+
+	rsv = be32toh(h->off_mem_rsvmap);
+	for (rsv_len = 0; rsv + rsv_len + 16 <= len; rsv_len += 16) {
+		if (!*(const uint64_t *)(fdt + rsv + rsv_len) &&
+		    !*(const uint64_t *)(fdt + rsv + rsv_len + 8))
+			break;
+	}
+	rsv_len += 16;
+
+	st = fdt + be32toh(h->off_dt_struct);
+	st_size = be32toh(h->size_dt_struct);
+	strings = fdt + be32toh(h->off_dt_strings);
+
+	/* What /chosen gains, and a node for it if there is none */
+	room = (cmdline ? strlen(cmdline) : 0) + 512;
+	o.size = ALIGN_UP(sizeof(*h), 8) + rsv_len + st_size + room +
+		 be32toh(h->size_dt_strings) + room;
+	o.buf = calloc(1, o.size);
+	if (!o.buf)
+		return NULL;
+
+	memcpy(o.buf + ALIGN_UP(sizeof(*h), 8), fdt + rsv, rsv_len);
+	o.st = ALIGN_UP(sizeof(*h), 8) + rsv_len;
+	o.str_start = o.st + st_size + room;
+	o.str_size = be32toh(h->size_dt_strings);
+	memcpy(o.buf + o.str_start, strings, o.str_size);
+	out = (struct fdt_header *)o.buf;
+	out->off_dt_struct = htobe32(o.st);
+
+	while (pos + 4 <= st_size) {
+		tag = be32toh(*(const uint32_t *)(st + pos));
+		switch (tag) {
+		case FDT_BEGIN_NODE: {
+			const char *name = st + pos + 4;
+			size_t n = strnlen(name, st_size - pos - 4) + 1;
+
+			depth++;
+			if (depth == 2 && !strcmp(name, "chosen"))
+				in_chosen = chosen = 1;
+			fdt_put32(&o, tag);
+			fdt_put(&o, name, n);
+			pos += 4 + ALIGN_UP(n, 4);
+			continue;
+		}
+		case FDT_END_NODE:
+			if (in_chosen && depth == 2) {
+				fdt_put_chosen(&o, cmdline, initrd_start,
+					       initrd_end);
+				in_chosen = 0;
+			} else if (depth == 1 && !chosen) {
+				fdt_put32(&o, FDT_BEGIN_NODE);
+				fdt_put(&o, "chosen", 7);
+				fdt_put_chosen(&o, cmdline, initrd_start,
+					       initrd_end);
+				fdt_put32(&o, FDT_END_NODE);
+			}
+			depth--;
+			fdt_put32(&o, tag);
+			pos += 4;
+			continue;
+		case FDT_PROP: {
+			const char *const *drop;
+
+			plen = be32toh(*(const uint32_t *)(st + pos + 4));
+			nameoff = be32toh(*(const uint32_t *)(st + pos + 8));
+			if (in_chosen && depth == 2) {
+				for (drop = chosen_drop; *drop; drop++) {
+					if (!strcmp(strings + nameoff, *drop))
+						break;
+				}
+				if (*drop) {
+					pos += 12 + ALIGN_UP(plen, 4);
+					continue;
+				}
+			}
+			fdt_put(&o, st + pos, 12 + plen);
+			pos += 12 + ALIGN_UP(plen, 4);
+			continue;
+		}
+		case FDT_NOP:
+			pos += 4;
+			continue;
+		case FDT_END:
+			fdt_put32(&o, tag);
+			break;
+		default:
+			fprintf(stderr, "bad device tree token %u\n", tag);
+			free(o.buf);
+			return NULL;
+		}
+		break;
+	}
+
+	/* Close the gap between the blocks */
+	memmove(o.buf + o.st, o.buf + o.str_start, o.str_size);
+	out->magic = htobe32(FDT_MAGIC);
+	out->totalsize = htobe32(o.st + o.str_size);
+	out->size_dt_struct = htobe32(o.st - be32toh(out->off_dt_struct));
+	out->off_dt_strings = htobe32(o.st);
+	out->size_dt_strings = htobe32(o.str_size);
+	out->off_mem_rsvmap = htobe32(ALIGN_UP(sizeof(*h), 8));
+	out->version = htobe32(17);
+	out->last_comp_version = htobe32(16);
+	out->boot_cpuid_phys = h->boot_cpuid_phys;
+
+	*size = o.st + o.str_size;
+	return o.buf;
+}
+
+/*
+ * The bootconfig parameters, with the trailer that the kernel looks for at the
+ * end of the initrd: size, checksum and magic.
+ */
+static void *bootconfig_trailer(const struct part *bc, size_t *len)
+{
+	size_t size = strnlen(bc->buf, bc->len) + 1, i;
+	uint32_t csum = 0, v;
+	uint8_t *buf;
+
+	/* The parameters end in a NUL and are padded to 4 bytes */
+	size = ALIGN_UP(size, 4);
+	buf = calloc(1, size + 8 + 12);
+	if (!buf)
+		return NULL;
+	memcpy(buf, bc->buf, strnlen(bc->buf, bc->len));
+	for (i = 0; i < size; i++)
+		csum += buf[i];
+
+	v = htole32(size);
+	memcpy(buf + size, &v, 4);
+	v = htole32(csum);
+	memcpy(buf + size + 4, &v, 4);
+	memcpy(buf + size + 8, "#BOOTCONFIG\n", 12);
+	*len = size + 8 + 12;
+	return buf;
+}
+
+/* Returns -1 with errno set on failure */
+static int dev_kexec_ioctl(int cmd, void *arg)
+{
+	int fd = open("/dev/kexec", O_RDONLY), ret, err;
+
+	if (fd < 0)
+		return -1;
+	ret = ioctl(fd, cmd, arg);
+	err = errno;
+	close(fd);
+	errno = err;
+	return ret < 0 ? -1 : 0;
+}
+
+/*
+ * Load with the device tree built by the module: it goes right after the
+ * other segments. Returns -1 with errno EOPNOTSUPP if the module cannot build
+ * it.
+ */
+static int load_live_fdt(struct kexec_ioctl_load *ap, const char *cmdline,
+			 unsigned long long initrd_start,
+			 unsigned long long initrd_end)
+{
+	struct kexec_fdt_request req = {
+		.cmdline = cmdline,
+		.cmdline_len = cmdline ? strlen(cmdline) + 1 : 0,
+		.initrd_start = initrd_start,
+		.initrd_size = initrd_end - initrd_start,
+	};
+
+	ap->fdt = &req;
+	return dev_kexec_ioctl(KEXEC_IOCTL_LOAD_FDT, ap);
+}
+
+int main(int argc, char **argv)
+{
+	const char *initrd_path = NULL, *dtb_path = NULL, *vendor_path = NULL;
+	const char *cmdline = NULL;
+	unsigned long long offset, kernel_memsz, mem, size, end;
+	unsigned long long initrd_start, initrd_end, room;
+	struct kexec_segment segs[2 + BOOTIMG_MAX_RAMDISKS + 1];
+	struct kexec_ioctl_load ap = { 0 };
+	static struct boot_image img;
+	static char bc_cmdline[sizeof(img.cmdline) + 16];
+	struct part dtb = { 0 }, bootconfig = { 0 };
+	struct stat st;
+	const void *map;
+	size_t map_len, fdt_len;
+	void *fdt;
+	int opt, i, n = 0, unload = 0, exec = 0, boot_dtb = 0;
+
+	while ((opt = getopt(argc, argv, "s:i:d:bc:rv:ue")) != -1) {
+		switch (opt) {
+		case 's':
+			ap.slot = strtoul(optarg, NULL, 0);
+			break;
+		case 'i':
+			initrd_path = optarg;
+			break;
+		case 'd':
+			dtb_path = optarg;
+			break;
+		case 'b':
+			boot_dtb = 1;
+			break;
+		case 'c':
+			cmdline = optarg;
+			break;
+		case 'r':
+			cmdline = read_text("/proc/cmdline");
+			if (!cmdline)
+				return 1;
+			break;
+		case 'v':
+			vendor_path = optarg;
+			break;
+		case 'u':
+			unload = 1;
+			break;
+		case 'e':
+			exec = 1;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (unload || exec) {
+		if (optind != argc || unload + exec > 1)
+			goto usage;
+		if (exec && dev_kexec_ioctl(KEXEC_IOCTL_EXEC,
+					    (void *)ap.slot)) {
+			perror("exec");
+			return 1;
+		}
+		if (unload && dev_kexec_ioctl(KEXEC_IOCTL_LOAD_SLOT, &ap)) {
+			perror("unload");
+			return 1;
+		}
+		return 0;
+	}
+	if (optind != argc - 1 || (dtb_path && boot_dtb))
+		goto usage;
+
+	page_size = sysconf(_SC_PAGESIZE);
+	step_start = now_us();
+
+	map = map_file(argv[optind], &map_len);
+	if (!map)
+		return 1;
+	if (!bootimg_is_boot(map, map_len)) {
+		img.kernel = (struct part){ map, map_len };
+	} else if (bootimg_parse_boot(map, map_len, &img)) {
+		return 1;
+	}
+	if (vendor_path) {
+		map = map_file(vendor_path, &map_len);
+		if (!map || bootimg_parse_vendor(map, map_len, &img))
+			return 1;
+	}
+	if (initrd_path) {
+		map = map_file(initrd_path, &map_len);
+		if (!map)
+			return 1;
+		img.ramdisk[0] = (struct part){ map, map_len };
+		img.nr_ramdisks = 1;
+	}
+
+	if (boot_dtb) {
+		if (!img.dtb.len) {
+			fprintf(stderr, "no device tree in the boot image\n");
+			return 1;
+		}
+		dtb = img.dtb;
+	} else if (dtb_path) {
+		dtb.buf = read_file(dtb_path, &dtb.len);
+		if (!dtb.buf)
+			return 1;
+	} else if (stat("/sys/firmware/fdt", &st) == 0) {
+		/* Only the size, for the room the module needs */
+		dtb.len = st.st_size;
+	}
+	if (!cmdline && img.cmdline[0])
+		cmdline = img.cmdline;
+	step("map");
+
+	if (parse_arm64(img.kernel.buf, img.kernel.len, &offset,
+			&kernel_memsz)) {
+		if (is_compressed(img.kernel.buf, img.kernel.len))
+			fprintf(stderr, "compressed kernels are not supported, "
+				"unpack the image and pass the decompressed "
+				"Image instead\n");
+		return 1;
+	}
+	kernel_memsz = ALIGN_UP(kernel_memsz, page_size);
+
+	/* The kernel only reads bootconfig when asked to */
+	if (img.bootconfig.len && img.nr_ramdisks) {
+		bootconfig.buf = bootconfig_trailer(&img.bootconfig,
+						    &bootconfig.len);
+		if (!bootconfig.buf)
+			return 1;
+		if (!cmdline || !strstr(cmdline, "bootconfig")) {
+			snprintf(bc_cmdline, sizeof(bc_cmdline), "%s%sbootconfig",
+				 cmdline ? cmdline : "", cmdline ? " " : "");
+			cmdline = bc_cmdline;
+		}
+	}
+	step("parse");
+
+	/* The device tree keeps its size, the room for it is an upper bound */
+	room = preserve_room();
+	size = kernel_memsz + ALIGN_UP(bootconfig.len, page_size) +
+	       ALIGN_UP(dtb.len + 4096 + (cmdline ? strlen(cmdline) : 0) +
+			room, page_size);
+	for (i = 0; i < img.nr_ramdisks; i++)
+		size += ALIGN_UP(img.ramdisk[i].len, page_size);
+	if (place(2UL << 20, offset, size, &mem))
+		return 1;
+	step("place");
+
+	segs[n++] = (struct kexec_segment){ img.kernel.buf, img.kernel.len,
+					    mem, kernel_memsz };
+	end = mem + kernel_memsz;
+
+	/*
+	 * The ramdisks and bootconfig each start on a page, the initramfs
+	 * unpacker skips the zeroes between them.
+	 */
+	for (i = 0; i < img.nr_ramdisks; i++) {
+		segs[n++] = (struct kexec_segment){
+			img.ramdisk[i].buf, img.ramdisk[i].len, end,
+			ALIGN_UP(img.ramdisk[i].len, page_size) };
+		end += ALIGN_UP(img.ramdisk[i].len, page_size);
+	}
+	if (bootconfig.len) {
+		segs[n++] = (struct kexec_segment){
+			bootconfig.buf, bootconfig.len, end,
+			ALIGN_UP(bootconfig.len, page_size) };
+		end += ALIGN_UP(bootconfig.len, page_size);
+	}
+
+	initrd_start = n > 1 ? segs[1].mem : 0;
+	initrd_end = n > 1 ? segs[n - 1].mem + segs[n - 1].bufsz : 0;
+	ap.entry = mem;
+	ap.segs = segs;
+	ap.nr_segs = n;
+
+	/* Unless given a device tree, have the module build it */
+	if (!dtb.buf) {
+		if (!load_live_fdt(&ap, cmdline, initrd_start, initrd_end)) {
+			step("load");
+			return 0;
+		}
+		if (errno != EOPNOTSUPP) {
+			perror("load");
+			return 1;
+		}
+		dtb.buf = read_file("/sys/firmware/fdt", &dtb.len);
+		if (!dtb.buf)
+			return 1;
+	}
+
+	fdt = patch_fdt(dtb.buf, dtb.len, cmdline, initrd_start, initrd_end,
+			&fdt_len);
+	if (!fdt)
+		return 1;
+	segs[n++] = (struct kexec_segment){
+		fdt, fdt_len, end,
+		ALIGN_UP(fdt_len + room, page_size) };
+	step("dtb");
+
+	ap.nr_segs = n;
+	ap.fdt = NULL;
+	if (dev_kexec_ioctl(KEXEC_IOCTL_LOAD_SLOT, &ap)) {
+		perror("load");
+		return 1;
+	}
+	step("load");
+	return 0;
+
+usage:
+	fprintf(stderr,
+		"usage: %s [-s slot] [-i initrd] [-d dtb | -b] [-c cmdline | -r]\n"
+		"       %*s [-v vendor_boot] Image | boot.img\n"
+		"       %s [-s slot] -u | -e\n",
+		argv[0], (int)strlen(argv[0]), "", argv[0]);
+	return 2;
+}
@@ -0,0 +1,82 @@
+/*
+ * kexec-preserve: Register memory for kexec_mod to preserve across kexec,
+ * either a physical range or the pages of a file, such as a hugetlbfs file or
+ * a memfd through /proc/<pid>/fd/<fd>. The file pages stay pinned after this
+ * program exits. See /sys/kernel/kexec/preserved for the resulting ranges.
+ *
+ * Usage: kexec-preserve <address> <size>
+ *        kexec-preserve -f <file>
+ *        kexec-preserve -c
+ */
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "../kernel/kexec_ioctl.h"
+
+static int preserve(struct kexec_ioctl_preserve *pp)
+{
+	int fd = open("/dev/kexec", O_RDONLY);
+
+	if (fd < 0) {
+		perror("open /dev/kexec");
+		return 1;
+	}
+	if (ioctl(fd, KEXEC_IOCTL_PRESERVE, pp) < 0) {
+		perror("preserve");
+		return 1;
+	}
+	close(fd);
+	return 0;
+}
+
+static int preserve_file(const char *path, struct kexec_ioctl_preserve *pp)
+{
+	struct stat st;
+	void *map;
+	int fd;
+
+	fd = open(path, O_RDWR);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		perror(path);
+		return 1;
+	}
+
+	/* Fault the pages in, the module pins whatever backs the mapping */
+	map = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
+		   MAP_SHARED | MAP_POPULATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("mmap");
+		return 1;
+	}
+
+	pp->addr = (unsigned long)map;
+	pp->size = st.st_size;
+	pp->flags = KEXEC_PRESERVE_USER;
+	return preserve(pp);
+}
+
+int main(int argc, char **argv)
+{
+	struct kexec_ioctl_preserve pp = { 0 };
+
+	if (argc == 2 && !strcmp(argv[1], "-c"))
+		return preserve(&pp);
+	if (argc == 3 && !strcmp(argv[1], "-f"))
+		return preserve_file(argv[2], &pp);
+	if (argc == 3 && argv[1][0] != '-') {
+		pp.addr = strtoul(argv[1], NULL, 0);
+		pp.size = strtoul(argv[2], NULL, 0);
+		return preserve(&pp);
+	}
+
+	fprintf(stderr, "usage: %s <address> <size> | -f <file> | -c\n",
+		argv[0]);
+	return 2;
+}
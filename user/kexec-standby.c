@@ -0,0 +1,380 @@
+/*
+ * kexec-standby: Keep the next kernel staged in kexec_mod, so that switching
+ * to it only costs the exec. The kernel, initrd, vendor_boot and command line
+ * files are watched and the image is staged again with kexec-load as soon as
+ * one of them changes. The new image goes into the spare of two slots and the
+ * old one is only unloaded once that succeeded, so a complete image is staged
+ * at all times.
+ *
+ * Usage: kexec-standby [-L kexec-load] [-s slot,slot] [-S socket]
+ *                      [-c cmdline file] [-i initrd] [-v vendor_boot]
+ *                      Image | boot.img
+ *
+ * SIGUSR1 or "exec" on the socket executes the staged image, SIGHUP or
+ * "reload" stages it again and "status" reports the slot and the time of the
+ * last load. Without -c the command line of the running kernel is reused.
+ * Like kexec -e, exec does not sync or unmount file systems.
+ */
+#define _GNU_SOURCE
+#include <errno.h>
+#include <limits.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "../kernel/kexec_ioctl.h"
+
+/* Quiet time after the last change before staging again */
+#define SETTLE_MS 200
+
+#define MAX_WATCHES 4
+
+/* A watched file, through the directory it is in to see it replaced */
+struct watch {
+	const char *path;
+	char dir[PATH_MAX];
+	char name[NAME_MAX + 1];
+	int wd;
+};
+
+static const char *loader = "kexec-load";
+static const char *kernel, *initrd, *vendor_boot, *cmdline_file;
+static struct watch watches[MAX_WATCHES];
+static int nr_watches;
+
+/* The slot holding the staged image, or -1, and the spare one */
+static int slots[2] = { 0, 1 };
+static int staged = -1;
+static time_t staged_at;
+
+static int dev_kexec_ioctl(int cmd, void *arg)
+{
+	int fd = open("/dev/kexec", O_RDONLY), ret, err;
+
+	if (fd < 0)
+		return -1;
+	ret = ioctl(fd, cmd, arg);
+	err = errno;
+	close(fd);
+	errno = err;
+	return ret < 0 ? -1 : 0;
+}
+
+static char *read_cmdline(void)
+{
+	static char buf[4096];
+	size_t n;
+	FILE *f = fopen(cmdline_file ? cmdline_file : "/proc/cmdline", "r");
+
+	if (!f)
+		return NULL;
+	n = fread(buf, 1, sizeof(buf) - 1, f);
+	fclose(f);
+	while (n && (buf[n - 1] == '\n' || buf[n - 1] == ' '))
+		n--;
+	buf[n] = '\0';
+	return buf;
+}
+
+/* Stage the image into the spare slot, then drop the one it replaces */
+static int stage(void)
+{
+	int slot = staged == slots[0] ? slots[1] : slots[0];
+	struct kexec_ioctl_load ap = { 0 };
+	char slot_arg[16], *cmdline, *argv[16];
+	int argc = 0, status;
+	pid_t pid;
+
+	cmdline = read_cmdline();
+	if (!cmdline) {
+		perror("command line");
+		return -1;
+	}
+
+	snprintf(slot_arg, sizeof(slot_arg), "%d", slot);
+	argv[argc++] = (char *)loader;
+	argv[argc++] = "-s";
+	argv[argc++] = slot_arg;
+	argv[argc++] = "-c";
+	argv[argc++] = cmdline;
+	if (initrd) {
+		argv[argc++] = "-i";
+		argv[argc++] = (char *)initrd;
+	}
+	if (vendor_boot) {
+		argv[argc++] = "-v";
+		argv[argc++] = (char *)vendor_boot;
+	}
+	argv[argc++] = (char *)kernel;
+	argv[argc] = NULL;
+
+	pid = fork();
+	if (pid < 0) {
+		perror("fork");
+		return -1;
+	}
+	if (!pid) {
+		sigset_t mask;
+
+		sigemptyset(&mask);
+		sigprocmask(SIG_SETMASK, &mask, NULL);
+		execvp(loader, argv);
+		perror(loader);
+		_exit(127);
+	}
+	if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) ||
+	    WEXITSTATUS(status)) {
+		fprintf(stderr, "kexec-standby: staging into slot %d failed, "
+			"slot %d stays\n", slot, staged);
+		return -1;
+	}
+
+	if (staged >= 0) {
+		ap.slot = staged;
+		if (dev_kexec_ioctl(KEXEC_IOCTL_LOAD_SLOT, &ap))
+			perror("unload");
+	}
+	staged = slot;
+	staged_at = time(NULL);
+	fprintf(stderr, "kexec-standby: staged in slot %d\n", slot);
+	return 0;
+}
+
+static int exec_staged(void)
+{
+	if (staged < 0) {
+		fprintf(stderr, "kexec-standby: nothing staged\n");
+		return -1;
+	}
+	/* Only returns on failure */
+	dev_kexec_ioctl(KEXEC_IOCTL_EXEC, (void *)(long)staged);
+	perror("exec");
+	return -1;
+}
+
+static int add_watch(int ifd, const char *path)
+{
+	struct watch *w = &watches[nr_watches];
+	char copy[PATH_MAX];
+
+	if (!path)
+		return 0;
+
+	w->path = path;
+	snprintf(copy, sizeof(copy), "%s", path);
+	snprintf(w->dir, sizeof(w->dir), "%s", dirname(copy));
+	snprintf(copy, sizeof(copy), "%s", path);
+	snprintf(w->name, sizeof(w->name), "%s", basename(copy));
+
+	/* Replacing the file by a rename is the common way to update it */
+	w->wd = inotify_add_watch(ifd, w->dir, IN_CLOSE_WRITE | IN_MOVED_TO |
+				  IN_CREATE | IN_DELETE);
+	if (w->wd < 0) {
+		perror(w->dir);
+		return -1;
+	}
+	nr_watches++;
+	return 0;
+}
+
+/* Whether the inotify events in @buf concern a watched file */
+static int watched_change(const char *buf, ssize_t len)
+{
+	const struct inotify_event *ev;
+	const char *p;
+	int i, hit = 0;
+
+	for (p = buf; p < buf + len; p += sizeof(*ev) + ev->len) {
+		ev = (const struct inotify_event *)p;
+		for (i = 0; i < nr_watches; i++) {
+			if (ev->wd == watches[i].wd && ev->len &&
+			    !strcmp(ev->name, watches[i].name))
+				hit = 1;
+		}
+	}
+	return hit;
+}
+
+static int listen_socket(const char *path)
+{
+	struct sockaddr_un addr = { .sun_family = AF_UNIX };
+	int fd;
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		fprintf(stderr, "%s: path too long\n", path);
+		return -1;
+	}
+	strcpy(addr.sun_path, path);
+	unlink(path);
+
+	fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+	    listen(fd, 4) < 0) {
+		perror(path);
+		return -1;
+	}
+	chmod(path, 0600);
+	return fd;
+}
+
+/* Handle one command on the socket, returns whether to stage again */
+static int handle_client(int lfd)
+{
+	char buf[64];
+	ssize_t n;
+	int fd, reload = 0;
+
+	fd = accept4(lfd, NULL, NULL, SOCK_CLOEXEC);
+	if (fd < 0)
+		return 0;
+
+	n = read(fd, buf, sizeof(buf) - 1);
+	if (n > 0) {
+		buf[n] = '\0';
+		buf[strcspn(buf, "\r\n")] = '\0';
+		if (!strcmp(buf, "exec")) {
+			exec_staged();
+			dprintf(fd, "error: exec failed\n");
+		} else if (!strcmp(buf, "reload")) {
+			reload = 1;
+			dprintf(fd, "ok\n");
+		} else if (!strcmp(buf, "status")) {
+			dprintf(fd, "slot %d staged_at %lld\n", staged,
+				(long long)staged_at);
+		} else {
+			dprintf(fd, "error: unknown command\n");
+		}
+	}
+	close(fd);
+	return reload;
+}
+
+int main(int argc, char **argv)
+{
+	const char *socket_path = NULL;
+	struct pollfd pfd[3];
+	struct signalfd_siginfo si;
+	char buf[4096] __attribute__((aligned(8)));
+	int opt, ifd, sfd, lfd = -1, pending = 0, timeout;
+	sigset_t mask;
+	ssize_t n;
+
+	while ((opt = getopt(argc, argv, "L:s:S:c:i:v:")) != -1) {
+		switch (opt) {
+		case 'L':
+			loader = optarg;
+			break;
+		case 's':
+			if (sscanf(optarg, "%d,%d", &slots[0], &slots[1]) != 2 ||
+			    slots[0] == slots[1])
+				goto usage;
+			break;
+		case 'S':
+			socket_path = optarg;
+			break;
+		case 'c':
+			cmdline_file = optarg;
+			break;
+		case 'i':
+			initrd = optarg;
+			break;
+		case 'v':
+			vendor_boot = optarg;
+			break;
+		default:
+			goto usage;
+		}
+	}
+	if (optind != argc - 1)
+		goto usage;
+	kernel = argv[optind];
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGUSR1);
+	sigaddset(&mask, SIGHUP);
+	sigaddset(&mask, SIGTERM);
+	sigaddset(&mask, SIGINT);
+	sigprocmask(SIG_BLOCK, &mask, NULL);
+	sfd = signalfd(-1, &mask, SFD_CLOEXEC);
+	ifd = inotify_init1(IN_CLOEXEC);
+	if (sfd < 0 || ifd < 0) {
+		perror("kexec-standby");
+		return 1;
+	}
+
+	if (add_watch(ifd, kernel) || add_watch(ifd, initrd) ||
+	    add_watch(ifd, vendor_boot) || add_watch(ifd, cmdline_file))
+		return 1;
+	if (socket_path) {
+		lfd = listen_socket(socket_path);
+		if (lfd < 0)
+			return 1;
+	}
+
+	/* Without a first image there is nothing to stand by with */
+	if (stage())
+		return 1;
+
+	pfd[0] = (struct pollfd){ .fd = sfd, .events = POLLIN };
+	pfd[1] = (struct pollfd){ .fd = ifd, .events = POLLIN };
+	pfd[2] = (struct pollfd){ .fd = lfd, .events = POLLIN };
+
+	for (;;) {
+		/* Let a file that is being written settle first */
+		timeout = pending ? SETTLE_MS : -1;
+		n = poll(pfd, lfd >= 0 ? 3 : 2, timeout);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			break;
+		}
+		if (!n) {
+			pending = 0;
+			stage();
+			continue;
+		}
+
+		if (pfd[0].revents & POLLIN &&
+		    read(sfd, &si, sizeof(si)) == sizeof(si)) {
+			if (si.ssi_signo == SIGUSR1)
+				exec_staged();
+			else if (si.ssi_signo == SIGHUP)
+				pending = 1;
+			else
+				break;
+		}
+		if (pfd[1].revents & POLLIN) {
+			n = read(ifd, buf, sizeof(buf));
+			if (n > 0 && watched_change(buf, n))
+				pending = 1;
+		}
+		if (lfd >= 0 && pfd[2].revents & POLLIN && handle_client(lfd))
+			pending = 1;
+	}
+
+	if (socket_path)
+		unlink(socket_path);
+	return 0;
+
+usage:
+	fprintf(stderr,
+		"usage: %s [-L kexec-load] [-s slot,slot] [-S socket]\n"
+		"       %*s [-c cmdline file] [-i initrd] [-v vendor_boot]\n"
+		"       %*s Image | boot.img\n",
+		argv[0], (int)strlen(argv[0]), "", (int)strlen(argv[0]), "");
+	return 2;
+}
@@ -1,40 +1,134 @@
+#define _GNU_SOURCE
+#include <dlfcn.h>
 #include <stdarg.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <unistd.h>
 #include <sys/syscall.h>
 
-#define LINUX_REBOOT_CMD_KEXEC 0x45584543
+#include "../kernel/kexec_ioctl.h"
+
+/* Open once and kept for the life of the process */
+static int dev_kexec_fd = -1;
 
 static long dev_kexec_ioctl(int cmd, void *arg)
 {
-	return ioctl(open("/dev/kexec", O_RDONLY), cmd, arg);
+	int fd = __atomic_load_n(&dev_kexec_fd, __ATOMIC_ACQUIRE);
+
+	if (fd < 0) {
+		int expected = -1;
+
+		fd = open("/dev/kexec", O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			return -1;
+		/* Another thread may have beaten us to it */
+		if (!__atomic_compare_exchange_n(&dev_kexec_fd, &expected, fd,
+						 0, __ATOMIC_ACQ_REL,
+						 __ATOMIC_ACQUIRE)) {
+			close(fd);
+			fd = expected;
+		}
+	}
+	return ioctl(fd, cmd, arg);
 }
 
-long syscall(long num, ...)
+/* Look up the libc function that @name shadows */
+static void *next_sym(const char *name)
 {
-	if (num != SYS_kexec_load)
+	void *sym = dlsym(RTLD_NEXT, name);
+
+	if (!sym)
 		abort();
-	struct {
-		long entry;
-		long nsegs;
-		void *segs;
-		long flags;
-	} ap;
+	return sym;
+}
+
+/* Slot on /dev/kexec to load into or execute, from KEXEC_SLOT */
+static long kexec_slot(void)
+{
+	const char *slot = getenv("KEXEC_SLOT");
+
+	return slot ? strtol(slot, NULL, 0) : 0;
+}
+
+/* kexec_file_load: the module reads the files and builds the device tree */
+static long kexec_file_load(long kernel_fd, long initrd_fd, long cmdline_len,
+			    const char *cmdline, long flags)
+{
+	struct kexec_ioctl_file_load fp = {
+		kernel_fd, initrd_fd, cmdline_len, cmdline, flags, 0
+	};
+
+	fp.slot = kexec_slot();
+	return dev_kexec_ioctl(KEXEC_IOCTL_FILE_LOAD, &fp);
+}
+
+long syscall(long num, ...)
+{
+	struct kexec_ioctl_load ap = { 0 };
+	struct kexec_plan plan = { 0 };
+	const char *dry_run;
+	long a[6], ret;
 	va_list va;
+	int i;
+
+	/* Syscalls take at most six arguments, pass on what we do not handle */
 	va_start(va, num);
-	ap.entry = va_arg(va, long);
-	ap.nsegs = va_arg(va, long);
-	ap.segs  = va_arg(va, void *);
-	ap.flags = va_arg(va, long);
+	for (i = 0; i < 6; i++)
+		a[i] = va_arg(va, long);
 	va_end(va);
-	return dev_kexec_ioctl(LINUX_REBOOT_CMD_KEXEC - 1, &ap);
+
+	if (num == SYS_kexec_file_load)
+		return kexec_file_load(a[0], a[1], a[2], (const char *)a[3],
+				       a[4]);
+	if (num != SYS_kexec_load) {
+		long (*next)(long, ...) = next_sym("syscall");
+
+		return next(num, a[0], a[1], a[2], a[3], a[4], a[5]);
+	}
+
+	ap.entry = a[0];
+	ap.nr_segs = a[1];
+	ap.segs  = (void *)a[2];
+	ap.flags = a[3];
+
+	/* With KEXEC_DRY_RUN set, only report what the load would cost */
+	dry_run = getenv("KEXEC_DRY_RUN");
+	if (!dry_run) {
+		ap.slot = kexec_slot();
+		return dev_kexec_ioctl(KEXEC_IOCTL_LOAD_SLOT, &ap);
+	}
+
+	/* KEXEC_DRY_RUN=alloc runs the allocation pass of the load */
+	if (!strcmp(dry_run, "alloc"))
+		plan.flags = KEXEC_PLAN_ALLOC;
+	ap.plan = &plan;
+	ret = dev_kexec_ioctl(KEXEC_IOCTL_PLAN, &ap);
+	if (ret == 0)
+		fprintf(stderr,
+			"kexec plan: staging %llu bytes, relocate %llu bytes, "
+			"flush %llu bytes, %llu collisions, %llu swaps, "
+			"%llu parked pages, %llu control retries, "
+			"%llu indirection pages\n",
+			(unsigned long long)plan.staging_bytes,
+			(unsigned long long)plan.relocate_bytes,
+			(unsigned long long)plan.flush_bytes,
+			(unsigned long long)plan.collisions,
+			(unsigned long long)plan.swaps,
+			(unsigned long long)plan.parked_pages,
+			(unsigned long long)plan.control_retries,
+			(unsigned long long)plan.indirection_pages);
+	return ret;
 }
 
 int reboot(int cmd)
 {
-	if (cmd != LINUX_REBOOT_CMD_KEXEC)
-		abort();
-	return dev_kexec_ioctl(cmd, 0);
+	if (cmd != LINUX_REBOOT_CMD_KEXEC) {
+		int (*next)(int) = next_sym("reboot");
+
+		return next(cmd);
+	}
+	return dev_kexec_ioctl(KEXEC_IOCTL_EXEC, (void *)kexec_slot());
 }